@@ -0,0 +1,278 @@
+// Slides Transformation (C) 2025
+// Client for the job server of SlidesTransformation --serve
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Frames are a 4-byte little-endian payload length followed by the payload
+const uint32_t MAX_FRAME = 16 << 20;
+
+bool readBytes(int socket, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t count = ::recv(socket, data, size, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+bool writeBytes(int socket, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t count = ::send(socket, data, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Send a frame, attaching descriptors to its first bytes
+bool writeFrame(int socket, const std::string& payload, const std::vector<int>& descriptors = {}) {
+    const uint32_t size = static_cast<uint32_t>(payload.size());
+    std::string frame(4 + payload.size(), '\0');
+    for (int byte = 0; byte < 4; ++byte) {
+        frame[byte] = static_cast<char>(size >> (8 * byte));
+    }
+    std::memcpy(&frame[4], payload.data(), payload.size());
+    if (descriptors.empty()) {
+        return writeBytes(socket, frame.data(), frame.size());
+    }
+
+    iovec part{&frame[0], frame.size()};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * descriptors.size()));
+    msghdr message{};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * descriptors.size());
+    std::memcpy(CMSG_DATA(header), descriptors.data(), sizeof(int) * descriptors.size());
+    ssize_t sent;
+    do {
+        sent = ::sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent <= 0) {
+        return false;
+    }
+    return writeBytes(socket, frame.data() + sent, frame.size() - static_cast<size_t>(sent));
+}
+
+bool readFrame(int socket, std::string& payload) {
+    unsigned char header[4];
+    if (!readBytes(socket, reinterpret_cast<char*>(header), sizeof(header))) {
+        return false;
+    }
+    uint32_t size = header[0] | header[1] << 8 | header[2] << 16 | static_cast<uint32_t>(header[3]) << 24;
+    if (size > MAX_FRAME) {
+        return false;
+    }
+    payload.resize(size);
+    return readBytes(socket, &payload[0], size);
+}
+
+// A memfd holding a copy of a file, the way a service would hold a score in memory
+int memfdFromFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return -1;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    const std::string bytes = contents.str();
+    int memfd = ::memfd_create("slides-input", MFD_CLOEXEC);
+    if (memfd >= 0 && !bytes.empty() &&
+        ::pwrite(memfd, bytes.data(), bytes.size(), 0) != static_cast<ssize_t>(bytes.size())) {
+        ::close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+// Save what the service wrote into a memfd to a file, or to stdout for "-"
+bool saveMemfd(int memfd, const std::string& path) {
+    struct stat st;
+    if (::fstat(memfd, &st) != 0) {
+        return false;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* mapping = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, memfd, 0) : nullptr;
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    bool saved;
+    if (path == "-") {
+        saved = std::fwrite(mapping, 1, size, stdout) == size && std::fflush(stdout) == 0;
+    } else {
+        std::ofstream file(path, std::ios::binary);
+        file.write(static_cast<const char*>(mapping), static_cast<std::streamsize>(size));
+        file.close();
+        saved = static_cast<bool>(file);
+    }
+    if (mapping) {
+        ::munmap(mapping, size);
+    }
+    return saved;
+}
+
+int connectTo(const std::string& socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+    int connection = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection >= 0 && ::connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+// Usage: SlidesClient [--repeat <n>] <socket> [request...]
+// Each request is a JSON job object such as {"input":"a.txt","output":"b.txt","seed":7}
+// or one of the commands ping, stats and shutdown. Without requests on the command
+// line, one request is read from each line of stdin. The reply to each request is
+// printed on its own line; with --repeat every request is sent n times and the
+// round-trip latencies are reported on stderr.
+//
+// With --memfd the client runs one job through memfds instead of paths:
+//   SlidesClient --memfd <socket> <input_file> <text_output|-|""> [midi_output] [options]
+// The input is copied into a memfd, the outputs are read back from the memfds
+// the server wrote into, and options is a JSON object such as {"pct":60,"seed":7}.
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args;
+    long repeat = 1;
+    bool memfd = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::max(1L, std::strtol(argv[++i], nullptr, 10));
+        } else if (arg == "--memfd") {
+            memfd = true;
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if (args.empty() || (memfd && args.size() < 3)) {
+        std::cout << "Usage: " << argv[0] << " [--repeat <n>] <socket> [request|ping|stats|shutdown]..." << std::endl;
+        std::cout << "       " << argv[0] << " [--repeat <n>] --memfd <socket> <input_file> <text_output|-|\"\">"
+                  << " [midi_output] [options_json]" << std::endl;
+        std::cout << "Without requests, one JSON request is read from each line of stdin" << std::endl;
+        return 1;
+    }
+
+    int connection = connectTo(args[0]);
+    if (connection < 0) {
+        std::cerr << "Cannot connect to " << args[0] << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // Descriptors passed with every request, and the files the outputs are saved to
+    std::vector<int> descriptors;
+    std::vector<std::pair<int, std::string>> outputs;
+    std::vector<std::string> requests(args.begin() + 1, args.end());
+    if (memfd) {
+        const std::string midiOutput = args.size() > 3 ? args[3] : "";
+        std::string options = args.size() > 4 ? args[4] : "{}";
+        int input = memfdFromFile(args[1]);
+        if (input < 0) {
+            std::cerr << "Cannot read " << args[1] << std::endl;
+            return 1;
+        }
+        descriptors.push_back(input);
+        std::string request = "{\"input_fd\":0";
+        const std::pair<const char*, std::string> wanted[] = {{"output_fd", args[2]}, {"midi_fd", midiOutput}};
+        for (const auto& [key, output] : wanted) {
+            if (output.empty()) {
+                continue;
+            }
+            request += ",\"" + std::string(key) + "\":" + std::to_string(descriptors.size());
+            descriptors.push_back(::memfd_create("slides-output", MFD_CLOEXEC));
+            outputs.emplace_back(descriptors.back(), output);
+        }
+        size_t open = options.find('{');
+        size_t close = options.rfind('}');
+        if (open == std::string::npos || close == std::string::npos || close < open) {
+            std::cerr << "Options must be a JSON object" << std::endl;
+            return 1;
+        }
+        std::string extra = options.substr(open + 1, close - open - 1);
+        request += (extra.find_first_not_of(" \t") == std::string::npos ? "" : "," + extra) + "}";
+        requests.assign(1, request);
+    }
+    if (requests.empty()) {
+        for (std::string line; std::getline(std::cin, line);) {
+            if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                requests.push_back(line);
+            }
+        }
+    }
+
+    int status = 0;
+    std::vector<double> latencies;
+    std::string reply;
+    for (std::string request : requests) {
+        if (request == "ping" || request == "stats" || request == "shutdown") {
+            request = "{\"command\":\"" + request + "\"}";
+        }
+        for (long round = 0; round < repeat; ++round) {
+            auto sent = std::chrono::steady_clock::now();
+            if (!writeFrame(connection, request, descriptors) || !readFrame(connection, reply)) {
+                std::cerr << "Connection to " << args[0] << " lost" << std::endl;
+                ::close(connection);
+                return 1;
+            }
+            latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - sent).count());
+        }
+        std::cout << reply << std::endl;
+        if (reply.find("\"status\":\"ok\"") == std::string::npos) {
+            status = 1;
+        }
+    }
+    ::close(connection);
+    for (const auto& [descriptor, path] : outputs) {
+        if (!saveMemfd(descriptor, path)) {
+            std::cerr << "Cannot save " << path << std::endl;
+            status = 1;
+        }
+    }
+    for (int descriptor : descriptors) {
+        ::close(descriptor);
+    }
+
+    if (repeat > 1 && !latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        auto at = [&](double fraction) { return latencies[static_cast<size_t>(fraction * (latencies.size() - 1))] * 1e6; };
+        std::cerr << latencies.size() << " requests: min " << at(0) << " us, median " << at(0.5) << " us, p99 "
+                  << at(0.99) << " us, max " << at(1) << " us" << std::endl;
+    }
+    return status;
+}
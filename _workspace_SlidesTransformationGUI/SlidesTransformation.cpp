@@ -6,6 +6,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
+#include <functional>
+#include <filesystem>
 #include <algorithm>
 #include <random>
 #include <chrono>
@@ -14,7 +18,20 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <cctype>
+#include <cstdint>
 #include <memory>
+#include <string_view>
+#include <charconv>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
 
 // Platform detection
 #if defined(_WIN32) || defined(_WIN64)
@@ -30,6 +47,16 @@
     #include <X11/keysym.h>
     #include <unistd.h>
     #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/ioctl.h>
+    #include <fcntl.h>
+    #ifdef __linux__
+        #include <linux/fs.h>
+    #endif
     #include <pwd.h>
 #else
     #error "Unsupported platform"
@@ -588,10 +615,9 @@ struct SlideVariant {
     std::string description;
 };
 
-// NEW FUNCTION: Generate a random pool of slide variants for user selection
-std::vector<SlideVariant> generateRandomSlideVariantPool(int poolSize = 10) {
-    // Define the complete pool of slide variants
-    const std::vector<SlideVariant> allVariants = {
+// The complete pool of slide variants, in a fixed order
+const std::vector<SlideVariant>& allSlideVariants() {
+    static const std::vector<SlideVariant> allVariants = {
         // Basic STT variants (2-note patterns)
         {"STTM2m", "Slide note start m3 below principal note, then up a M2, and then resolve"},
         {"STTm2M", "Slide note start m3 below principal note, then up a m2, and then resolve"},
@@ -688,9 +714,13 @@ std::vector<SlideVariant> generateRandomSlideVariantPool(int poolSize = 10) {
         {"ITTSM2m2m", "Inverted Three tone Above Slide note starts M3 above principal note, then down a M2, then down a m2, and then resolve"},
         {"ITTSM2m3m", "Inverted Three tone Above Slide note starts A4 above principal note, then down a M2, then down a m3, and then resolve"}
     };
+    return allVariants;
+}
 
+// NEW FUNCTION: Generate a random pool of slide variants for user selection
+std::vector<SlideVariant> generateRandomSlideVariantPool(int poolSize = 10) {
     // Create a copy of all variants and shuffle it
-    std::vector<SlideVariant> shuffledVariants = allVariants;
+    std::vector<SlideVariant> shuffledVariants = allSlideVariants();
 
     // Use modern random number generation
     std::random_device rd;
@@ -736,15 +766,298 @@ bool shouldTransformLabel(double transformationPercentage) {
     return randomValue < transformationPercentage;
 }
 
-// Structure to represent a MIDI note event
-struct MidiEvent {
+// Random number draw of the note at position in a seeded run. It depends
+// only on the seed and the position, so the same note gets the same choices
+// however the input is split up or scheduled.
+uint64_t seededRandom(uint64_t seed, uint64_t position, uint64_t draw) {
+    uint64_t value = seed ^ (position * 0x9E3779B97F4A7C15ULL) ^ (draw * 0xD1B54A32D192ED03ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+// The variants transformed notes are drawn from, resolved once from a selection:
+// the selected names, or every variant for RANDOM or an empty selection
+struct VariantPool {
+    std::vector<std::string> selection;
+    std::vector<std::string> variants;
+    std::vector<std::string> unknown; // Selected names that are not variants
+};
+
+std::shared_ptr<const VariantPool> resolveVariantPool(const std::vector<std::string>& selection) {
+    auto pool = std::make_shared<VariantPool>();
+    pool->selection = selection;
+    if (selection.empty() || (selection.size() == 1 && selection[0] == "RANDOM")) {
+        for (const SlideVariant& variant : allSlideVariants()) {
+            pool->variants.push_back(variant.name);
+        }
+        return pool;
+    }
+    pool->variants = selection;
+    for (const std::string& name : selection) {
+        const auto& all = allSlideVariants();
+        if (std::none_of(all.begin(), all.end(), [&](const SlideVariant& variant) { return variant.name == name; })) {
+            pool->unknown.push_back(name);
+        }
+    }
+    return pool;
+}
+
+// A MIDI note event packed into 8 bytes, for tracks whose notes overlap. The
+// track is implicit in the list the event belongs to. Bits 8..40 hold the sort
+// key: the tick with its sign bit flipped, so it orders as unsigned, above the
+// on/off bit, so note-offs sort first on a tick. The low byte is the note number.
+typedef uint64_t MidiEvent;
+
+inline MidiEvent packMidiEvent(int time, bool isNoteOn, uint8_t noteNumber) {
+    uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(time) ^ 0x80000000u) << 1) | (isNoteOn ? 1u : 0u);
+    return (key << 8) | noteNumber;
+}
+
+inline int midiEventTime(MidiEvent event) {
+    return static_cast<int>(static_cast<uint32_t>(event >> 9) ^ 0x80000000u);
+}
+
+inline bool midiEventIsNoteOn(MidiEvent event) {
+    return ((event >> 8) & 1) != 0;
+}
+
+inline uint8_t midiEventNoteNumber(MidiEvent event) {
+    return static_cast<uint8_t>(event);
+}
+
+// The notes of one track as laid out by MidiNoteStore::finish(). Note i starts
+// at the sum of durations[0..i), so no start times are stored.
+struct MidiTrackView {
     int track;
-    int noteNumber;
-    int startTime;
-    int duration;
-    bool isNoteOn;
+    const uint8_t* pitches;
+    const int32_t* durations;
+    size_t count;
+    bool sequential; // All durations positive, so no two notes overlap
+};
+
+const size_t MIDI_NOTE_BYTES = 5; // Pitch and duration of a laid-out or spilled note
+
+// Notes collected for MIDI export. Each track number gets a dense slot on first
+// sight, and notes are appended in arrival order as 8-byte (slot, pitch,
+// duration) records. finish() groups them by slot with a counting sort into
+// flat pitch and duration arrays, 5 bytes per note with the track implicit.
+//
+// With a memory budget the records buffer is fixed at budget / 13 notes (the
+// record plus its laid-out 5 bytes). When it fills up, its notes are grouped
+// the same way and appended to one spill file per track, and the MIDI file is
+// later assembled by streaming those files in track order.
+struct MidiNoteStore {
+    static const int DENSE_TRACKS = 1 << 16; // Track numbers looked up by direct indexing
+
+    std::vector<uint64_t> pending;           // slot << 40 | pitch << 32 | duration
+    std::vector<int32_t> slotByTrack;        // Dense track number -> slot + 1, 0 if unseen
+    std::map<int, uint32_t> otherSlots;      // Negative or very large track numbers
+    std::vector<int> slotTracks;             // Track number of each slot
+    std::vector<uint64_t> slotCounts;
+    std::vector<uint8_t> slotSequential;
+
+    std::vector<uint8_t> pitches;
+    std::vector<int32_t> durations;
+    std::vector<MidiTrackView> tracks;       // In track number order once finished
+
+    size_t memoryBudget = 0;                 // Bytes for note buffers, 0 = unlimited
+    size_t pendingLimit = 0;
+    std::string spillBase;                   // Parent of the spill directory, empty = system temp
+    std::string spillDirectory;              // Created on the first spill
+    std::vector<uint64_t> slotSpilled;       // Notes of each slot in its spill file
+    uint64_t spilledNotes = 0;
+    size_t peakBytes = 0;                    // Largest note and I/O buffer total seen
+    std::string spillError;
+
+    MidiNoteStore() = default;
+    MidiNoteStore(const MidiNoteStore&) = delete;
+    MidiNoteStore& operator=(const MidiNoteStore&) = delete;
+
+    ~MidiNoteStore() {
+        if (!spillDirectory.empty()) {
+            std::error_code error;
+            std::filesystem::remove_all(spillDirectory, error);
+        }
+    }
+
+    void setMemoryBudget(size_t budget, const std::string& directory) {
+        memoryBudget = budget;
+        spillBase = directory;
+        pendingLimit = std::max<size_t>(1, budget / (sizeof(uint64_t) + MIDI_NOTE_BYTES));
+    }
+
+    void notePeak(size_t bytes) {
+        peakBytes = std::max(peakBytes, bytes);
+    }
+
+    std::string spillPath(size_t slot) const {
+        return spillDirectory + "/track-" + std::to_string(slot) + ".spill";
+    }
+
+    bool createSpillDirectory() {
+        static std::atomic<unsigned> counter{0};
+        std::error_code error;
+        std::filesystem::path base = spillBase.empty() ? std::filesystem::temp_directory_path(error)
+                                                       : std::filesystem::path(spillBase);
+        std::filesystem::path directory = base / ("slides-midi-" +
+            std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "-" +
+            std::to_string(counter++));
+        if (error || !std::filesystem::create_directories(directory, error)) {
+            spillError = "Error creating MIDI spill directory in " + base.string();
+            return false;
+        }
+        spillDirectory = directory.string();
+        return true;
+    }
+
+    // Append the buffered notes to their tracks' spill files, 5 bytes per note
+    // in native byte order (the files never leave this process)
+    bool spill() {
+        if (!spillError.empty() || (spillDirectory.empty() && !createSpillDirectory())) {
+            pending.clear();
+            return false;
+        }
+        std::vector<uint64_t> offsets(slotTracks.size() + 1, 0);
+        for (uint64_t record : pending) {
+            offsets[(record >> 40) + 1]++;
+        }
+        for (size_t slot = 0; slot < slotTracks.size(); ++slot) {
+            offsets[slot + 1] += offsets[slot];
+        }
+        std::vector<char> records(pending.size() * MIDI_NOTE_BYTES);
+        notePeak(pending.capacity() * sizeof(uint64_t) + records.size());
+        std::vector<uint64_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (uint64_t record : pending) {
+            char* out = records.data() + cursor[record >> 40]++ * MIDI_NOTE_BYTES;
+            out[0] = static_cast<char>(record >> 32);
+            uint32_t duration = static_cast<uint32_t>(record);
+            std::memcpy(out + 1, &duration, sizeof(duration));
+        }
+
+        slotSpilled.resize(slotTracks.size(), 0);
+        for (size_t slot = 0; slot < slotTracks.size(); ++slot) {
+            size_t count = offsets[slot + 1] - offsets[slot];
+            if (count == 0) {
+                continue;
+            }
+            FILE* file = std::fopen(spillPath(slot).c_str(), "ab");
+            bool written = file && std::fwrite(records.data() + offsets[slot] * MIDI_NOTE_BYTES,
+                                               MIDI_NOTE_BYTES, count, file) == count;
+            if (file && std::fclose(file) != 0) {
+                written = false;
+            }
+            if (!written) {
+                spillError = "Error writing MIDI spill file: " + spillPath(slot);
+                pending.clear();
+                return false;
+            }
+            slotSpilled[slot] += count;
+        }
+        spilledNotes += pending.size();
+        pending.clear();
+        return true;
+    }
+
+    uint32_t slotFor(int track) {
+        if (track >= 0 && track < DENSE_TRACKS) {
+            if (static_cast<size_t>(track) >= slotByTrack.size()) {
+                slotByTrack.resize(track + 1, 0);
+            }
+            if (slotByTrack[track] == 0) {
+                slotByTrack[track] = static_cast<int32_t>(addSlot(track)) + 1;
+            }
+            return static_cast<uint32_t>(slotByTrack[track] - 1);
+        }
+        auto found = otherSlots.find(track);
+        if (found == otherSlots.end()) {
+            found = otherSlots.emplace(track, addSlot(track)).first;
+        }
+        return found->second;
+    }
+
+    uint32_t addSlot(int track) {
+        slotTracks.push_back(track);
+        slotCounts.push_back(0);
+        slotSequential.push_back(1);
+        return static_cast<uint32_t>(slotTracks.size() - 1);
+    }
+
+    void add(int track, int noteNumber, int duration) {
+        uint32_t slot = slotFor(track);
+        slotCounts[slot]++;
+        slotSequential[slot] &= duration > 0 ? 1 : 0;
+        if (memoryBudget > 0 && pending.size() == pending.capacity()) {
+            // Grow the buffer by hand so its capacity never passes the limit
+            if (pending.size() >= pendingLimit) {
+                spill();
+            } else {
+                pending.reserve(std::min(pendingLimit, std::max<size_t>(1024, pending.capacity() * 2)));
+            }
+        }
+        pending.push_back(static_cast<uint64_t>(slot) << 40 |
+                          static_cast<uint64_t>(static_cast<uint8_t>(noteNumber)) << 32 |
+                          static_cast<uint32_t>(duration));
+    }
+
+    // Lay the notes out track by track and list the tracks in number order
+    void finish() {
+        std::vector<uint64_t> offsets(slotCounts.size() + 1, 0);
+        for (size_t slot = 0; slot < slotCounts.size(); ++slot) {
+            offsets[slot + 1] = offsets[slot] + slotCounts[slot];
+        }
+        pitches.resize(pending.size());
+        durations.resize(pending.size());
+        notePeak(pending.capacity() * sizeof(uint64_t) + pending.size() * MIDI_NOTE_BYTES);
+        std::vector<uint64_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (uint64_t record : pending) {
+            uint64_t at = cursor[record >> 40]++;
+            pitches[at] = static_cast<uint8_t>(record >> 32);
+            durations[at] = static_cast<int32_t>(static_cast<uint32_t>(record));
+        }
+        std::vector<uint64_t>().swap(pending);
+
+        tracks.clear();
+        for (size_t slot = 0; slot < slotTracks.size(); ++slot) {
+            tracks.push_back({slotTracks[slot], pitches.data() + offsets[slot], durations.data() + offsets[slot],
+                              slotCounts[slot], slotSequential[slot] != 0});
+        }
+        std::sort(tracks.begin(), tracks.end(),
+                  [](const MidiTrackView& a, const MidiTrackView& b) { return a.track < b.track; });
+    }
+};
+
+// Lets a job be stopped from another thread, or once its deadline passes. The
+// job checks the token every CANCEL_CHECK_LINES lines or notes and stops by
+// throwing JobCancelled, which the entry points turn into a "Cancelled: "
+// status message.
+struct CancellationToken {
+    std::atomic<bool> cancelled{false};
+    bool hasDeadline = false;
+    std::chrono::steady_clock::time_point deadline;
+
+    void cancel() {
+        cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    // Why the job has to stop, or nullptr while it may go on
+    const char* reason() const {
+        if (cancelled.load(std::memory_order_relaxed)) {
+            return "cancelled";
+        }
+        if (hasDeadline && std::chrono::steady_clock::now() >= deadline) {
+            return "deadline exceeded";
+        }
+        return nullptr;
+    }
+};
+
+struct JobCancelled : std::runtime_error {
+    using std::runtime_error::runtime_error;
 };
 
+const uint32_t CANCEL_CHECK_LINES = 1024;
+
 // Application state
 struct AppState {
     std::string inputFile;
@@ -755,22 +1068,98 @@ struct AppState {
     bool processingComplete = false;
     std::string statusMessage;
     std::string resultSummary;
-    int totalEligibleNotes = 0;
-    int transformedNotes = 0;
-    std::map<std::string, int> variantUsageCount;
+    uint64_t totalEligibleNotes = 0; // 64-bit: merged fleet and server totals pass 2^31
+    uint64_t transformedNotes = 0;
+    std::map<std::string, uint64_t> variantUsageCount;
+    std::map<std::string, std::pair<uint64_t, uint64_t>> labelCounts; // Notes and transformed notes per label
+    std::map<int, std::pair<uint64_t, uint64_t>> trackCounts;         // Notes and transformed notes per track
+    std::set<int> selectedTracks; // Empty means all tracks
+    bool useTrackIndex = false;   // Build and keep the sidecar index for track-filtered runs
+    int workerThreads = 0;        // Threads for parallel work, 0 = one per hardware thread
+    bool compactMidi = false;     // MIDI running status, note-off as note-on with velocity 0
+    int midiFormat = 1;           // 0 = all tracks merged into one, 1 = one MTrk per track
+    size_t midiMemoryBudget = 0;  // Bytes for MIDI export note buffers, 0 = unlimited
+    std::string spillDirectory;   // Where MIDI export spills notes, empty = system temp directory
+    std::string labelFile;        // Labels for MIDI input, one line per note; empty = meta events
+    bool midiTrackCache = false;  // Reuse unchanged tracks of the previous export of the same MIDI file
+    bool seeded = false;          // Draw random choices from seed and note position instead of rand()
+    uint64_t seed = 0;
+    uint64_t notePosition = 0;    // Input line (or MIDI note) being transformed, from 0
+    std::shared_ptr<const VariantPool> variantPool;                // Resolved selectedVariants, shared by jobs
+    std::shared_ptr<const std::vector<std::string>> labelTable;   // Preloaded labelFile lines, shared by jobs
+    std::shared_ptr<const CancellationToken> cancellation;         // Checked while transforming; may be empty
+    std::string resultCacheDirectory;   // Cache of seeded runs' outputs; empty for none
+    uint64_t resultCacheBudget = 1ULL << 30;
 };
 
-// Function to process file with GUI integration
-void processFile(const std::string& inputFile, const std::string& outputFile, AppState& state) {
-    std::ifstream input(inputFile);
-    std::ofstream output(outputFile);
+// Stop the job with JobCancelled if its token says so
+void throwIfCancelled(const AppState& state) {
+    const char* reason = state.cancellation ? state.cancellation->reason() : nullptr;
+    if (reason) {
+        throw JobCancelled(reason);
+    }
+}
 
-    if (!input.is_open() || !output.is_open()) {
-        state.statusMessage = "Error opening files.";
+// Called for every line or note: checks the token once every CANCEL_CHECK_LINES calls
+inline void checkCancellation(const AppState& state) {
+    static thread_local uint32_t countdown = 0;
+    if (state.cancellation && ++countdown % CANCEL_CHECK_LINES == 0) {
+        throwIfCancelled(state);
+    }
+}
+
+// Status messages stop growing past this size, so a long stream full of bad
+// notes cannot hold an unbounded error log in memory
+const size_t STATUS_MESSAGE_LIMIT = 64 * 1024;
+
+void appendStatus(AppState& state, const std::string& message) {
+    if (state.statusMessage.size() >= STATUS_MESSAGE_LIMIT) {
         return;
     }
+    state.statusMessage += message;
+    if (state.statusMessage.size() >= STATUS_MESSAGE_LIMIT) {
+        state.statusMessage += "Further messages suppressed.\n";
+    }
+}
+
+// Record that a job stopped early and remove the outputs it had begun writing, so
+// no truncated file is left under an output's name. Standard streams are kept.
+void reportCancelled(AppState& state, const JobCancelled& cancelled,
+                     std::initializer_list<std::string> startedOutputs = {}) {
+    state.statusMessage += std::string("Cancelled: ") + cancelled.what() + "\n";
+    state.processingComplete = false;
+    for (const std::string& output : startedOutputs) {
+        if (!output.empty() && output != "-") {
+            std::error_code ignored;
+            std::filesystem::remove(output, ignored);
+        }
+    }
+}
+
+// Labels eligible for slide transformation
+bool isEligibleLabel(std::string_view label) {
+    return label == "SAN" || label == "RLN" || label == "SMP" || label == "Mmd7" ||
+           label == "I8" || label == "U2R" || label == "HT" || label == "MmAug6" ||
+           label == "RDN" || label == "RN" || label == "MmAug4" || label == "Mmm3" ||
+           label == "LAD" || label == "DNW" || label == "LNSN" || label == "DBC" ||
+           label == "DDN" || label == "LNR" || label == "LNSAS" || label == "LNSAL" ||
+           label == "DI" || label == "SPCM" || label == "SPDM" || label == "SSN" ||
+           label == "SVN" || label == "ANS" || label == "ANL" || label == "FTB" ||
+           label == "CDB";
+}
 
-    // Write header to the output file
+// Receives the rows produced by the transformation, in output order.
+// noteName is empty for notes generated by a slide variant, and noteNumber is
+// -1 for original notes whose name has not been resolved yet.
+struct TransformSink {
+    virtual ~TransformSink() = default;
+    virtual void passthrough(const std::string& line) = 0;
+    virtual void note(int track, const std::string& noteName, int noteNumber, int duration,
+                      const std::string& label, const std::string& variant) = 0;
+};
+
+// Column headers of the padded text format
+void writeTextHeader(std::ostream& output) {
     output << std::left << std::setw(11) << "Track"
            << std::setw(11) << "Note"
            << std::setw(20) << "Duration"
@@ -778,107 +1167,317 @@ void processFile(const std::string& inputFile, const std::string& outputFile, Ap
            << std::setw(25) << "Slide_Variant"
            << "\n";
     output << "---------------------------------------------------------------------------------\n";
+}
+
+// One row of the padded text format, without the line ending: the columns of
+// writeTextHeader, left-aligned and padded with spaces, gathered in a buffer
+// and written with one call
+void writeNoteRow(std::ostream& output, int track, const std::string& noteName, int duration,
+                  std::string_view label, std::string_view variant) {
+    char row[160];
+    size_t size = 0;
+    auto column = [&](std::string_view text, size_t width) {
+        size_t padding = text.size() < width ? width - text.size() : 0;
+        if (size > 0 && size + text.size() + padding > sizeof(row)) {
+            output.write(row, static_cast<std::streamsize>(size));
+            size = 0;
+        }
+        if (text.size() > sizeof(row)) {
+            output.write(text.data(), static_cast<std::streamsize>(text.size()));
+            return;
+        }
+        std::memcpy(row + size, text.data(), text.size());
+        std::memset(row + size + text.size(), ' ', padding);
+        size += text.size() + padding;
+    };
+    char number[16];
+    column(std::string_view(number, std::to_chars(number, number + sizeof(number), track).ptr - number), 11);
+    column(noteName, 11);
+    column(std::string_view(number, std::to_chars(number, number + sizeof(number), duration).ptr - number), 20);
+    column(label, 20);
+    column(variant, 25);
+    output.write(row, static_cast<std::streamsize>(size));
+}
+
+// Writes rows in the padded text format read back by convertToMidi()
+struct TextOutputSink : TransformSink {
+    std::ostream& output;
+
+    // header is false for the second and later parts of a file written in parts
+    explicit TextOutputSink(std::ostream& out, bool header = true) : output(out) {
+        // Write header to the output file
+        if (header) {
+            writeTextHeader(output);
+        }
+    }
+
+    void passthrough(const std::string& line) override {
+        output << line << "\n";  // Handle malformed lines
+    }
+
+    void note(int track, const std::string& noteName, int noteNumber, int duration,
+              const std::string& label, const std::string& variant) override {
+        writeNoteRow(output, track, noteName.empty() ? getNoteName(noteNumber) : noteName, duration, label, variant);
+        output << "\n";
+    }
+};
+
+// Collects MIDI note events straight from the transformation, without a text round trip
+struct MidiEventSink : TransformSink {
+    MidiNoteStore notes;
+    AppState& state;
+    std::set<int> errorTracks; // Tracks with notes that could not be read
+
+    explicit MidiEventSink(AppState& appState) : state(appState) {
+        if (state.midiMemoryBudget > 0) {
+            notes.setMemoryBudget(state.midiMemoryBudget, state.spillDirectory);
+        }
+    }
+
+    void passthrough(const std::string&) override {}
+
+    void note(int track, const std::string& noteName, int noteNumber, int duration,
+              const std::string&, const std::string&) override {
+        try {
+            if (noteNumber < 0) {
+                noteNumber = getNoteNumber(noteName);
+            }
+            if (noteNumber < 0 || noteNumber > 127) {
+                // A MIDI note number is 7 bits; anything else corrupts the event
+                throw std::out_of_range("Note number out of MIDI range: " + std::to_string(noteNumber));
+            }
+            addNote(track, noteNumber, duration);
+        } catch (const std::exception& e) {
+            std::string name = !noteName.empty() ? noteName : noteNumber >= 0 ? getNoteName(noteNumber) : std::to_string(noteNumber);
+            appendStatus(state, "Error processing note '" + name + "': " + std::string(e.what()) + "\n");
+            errorTracks.insert(track);
+        }
+    }
+
+    void addNote(int track, int noteNumber, int duration) {
+        // Notes within a track are sequential: each starts where the previous one ends
+        notes.add(track, noteNumber, duration);
+    }
+};
 
-    // Reset statistics
+// Forwards every row to two sinks, used when both text and MIDI are produced
+struct TeeSink : TransformSink {
+    TransformSink& first;
+    TransformSink& second;
+
+    TeeSink(TransformSink& a, TransformSink& b) : first(a), second(b) {}
+
+    void passthrough(const std::string& line) override {
+        first.passthrough(line);
+        second.passthrough(line);
+    }
+
+    void note(int track, const std::string& noteName, int noteNumber, int duration,
+              const std::string& label, const std::string& variant) override {
+        first.note(track, noteName, noteNumber, duration, label, variant);
+        second.note(track, noteName, noteNumber, duration, label, variant);
+    }
+};
+
+// Reset the statistics gathered by transformLine()
+void resetStatistics(AppState& state) {
     state.totalEligibleNotes = 0;
     state.transformedNotes = 0;
     state.variantUsageCount.clear();
+    state.labelCounts.clear();
+    state.trackCounts.clear();
+    state.notePosition = 0;
+}
 
-    std::string line;
-    while (std::getline(input, line)) {
-        std::istringstream ss(line);
-
-        int track, duration;
-        std::string noteName, label;
+// The statistics of one or more runs in a form that merges: every field is a
+// count, and merging adds them field by field, so records combine the same in
+// any grouping and order. runs is the number of runs merged into the record.
+struct StatsRecord {
+    uint64_t runs = 0;
+    uint64_t eligible = 0;
+    uint64_t transformed = 0;
+    std::map<std::string, uint64_t> variants;                        // Transformed notes per variant
+    std::map<std::string, std::pair<uint64_t, uint64_t>> labels;     // Notes and transformed notes per label
+    std::map<int, std::pair<uint64_t, uint64_t>> tracks;             // Notes and transformed notes per track
 
-        // Parse line with Note in string format (e.g., "C4")
-        if (!(ss >> track >> noteName >> duration)) {
-            output << line << "\n";  // Handle malformed lines
-            continue;
+    void merge(const StatsRecord& other) {
+        runs += other.runs;
+        eligible += other.eligible;
+        transformed += other.transformed;
+        for (const auto& [variant, count] : other.variants) {
+            variants[variant] += count;
+        }
+        for (const auto& [label, counts] : other.labels) {
+            labels[label].first += counts.first;
+            labels[label].second += counts.second;
         }
+        for (const auto& [track, counts] : other.tracks) {
+            tracks[track].first += counts.first;
+            tracks[track].second += counts.second;
+        }
+    }
+};
 
-        std::getline(ss, label);
-        label.erase(0, label.find_first_not_of(" \t"));  // Trim leading whitespace
-        // Remove trailing carriage return and whitespace (Windows line endings)
-        label.erase(label.find_last_not_of(" \t\r\n") + 1);
-
-        // Check if this label is eligible for transformation
-        if (label == "SAN" || label == "RLN" || label == "SMP" || label == "Mmd7" ||
-            label == "I8" || label == "U2R" || label == "HT" || label == "MmAug6" ||
-            label == "RDN" || label == "RN" || label == "MmAug4" || label == "Mmm3" || 
-            label == "LAD" || label == "DNW" || label == "LNSN" || label == "DBC" || 
-            label == "DDN" || label == "LNR" || label == "LNSAS" || label == "LNSAL" || 
-            label == "DI" || label == "SPCM" || label == "SPDM" || label == "SSN" || 
-            label == "SVN" || label == "ANS" || label == "ANL" || label == "FTB" || 
-            label == "CDB") {
-
-            state.totalEligibleNotes++;
-
-            // Check if this note should be transformed based on percentage
-            if (shouldTransformLabel(state.transformationPercentage)) {
-                state.transformedNotes++;
-
-                try {
-                    // Convert note name to MIDI number
-                    int noteIndex = getNoteNumber(noteName);
-
-                    // Randomly select a variant from the user's choices
-                    std::string selectedVariant;
-                    if (state.selectedVariants.empty() || (state.selectedVariants.size() == 1 && state.selectedVariants[0] == "RANDOM")) {
-                        // Use a random variant from the complete list
-                        std::vector<SlideVariant> allVariants = generateRandomSlideVariantPool(100); // Get a large pool
-                        selectedVariant = allVariants[rand() % allVariants.size()].name;
-                    } else {
-                        // Use one of the user's selected variants randomly
-                        selectedVariant = state.selectedVariants[rand() % state.selectedVariants.size()];
-                    }
+// The statistics of the last run in state, as a record of one run
+StatsRecord statsOf(const AppState& state) {
+    StatsRecord stats;
+    stats.runs = 1;
+    stats.eligible = state.totalEligibleNotes;
+    stats.transformed = state.transformedNotes;
+    stats.variants.insert(state.variantUsageCount.begin(), state.variantUsageCount.end());
+    stats.labels = state.labelCounts;
+    stats.tracks = state.trackCounts;
+    return stats;
+}
 
-                    // Apply slide transformation
-                    auto transformed = applySlideVariants(noteIndex, duration, DUPLE, selectedVariant);
-
-                    // Track variant usage
-                    state.variantUsageCount[selectedVariant]++;
-
-                    // Output the transformed notes
-                    for (const auto& [transformedNote, transformedDuration] : transformed) {
-                        std::string transNote = getNoteName(transformedNote); // Convert MIDI to readable name
-                        output << std::left
-                               << std::setw(11) << track
-                               << std::setw(11) << transNote
-                               << std::setw(20) << transformedDuration
-                               << std::setw(20) << label
-                               << std::setw(25) << selectedVariant
-                               << "\n";
-                    }
-                } catch (const std::exception& e) {
-                    // Handle cases where getNoteNumber produces an error
-                    state.statusMessage += "Error processing note '" + noteName + "': " + e.what() + "\n";
+// Add a record to the statistics in state
+void addStats(AppState& state, const StatsRecord& stats) {
+    state.totalEligibleNotes += stats.eligible;
+    state.transformedNotes += stats.transformed;
+    for (const auto& [variant, count] : stats.variants) {
+        state.variantUsageCount[variant] += count;
+    }
+    for (const auto& [label, counts] : stats.labels) {
+        state.labelCounts[label].first += counts.first;
+        state.labelCounts[label].second += counts.second;
+    }
+    for (const auto& [track, counts] : stats.tracks) {
+        state.trackCounts[track].first += counts.first;
+        state.trackCounts[track].second += counts.second;
+    }
+}
+
+// Transform one note and hand the resulting rows to the sink. The pitch is
+// noteNumber, or the note name when noteNumber is -1.
+void transformNote(int track, const std::string& noteName, int noteNumber, int duration,
+                   const std::string& label, AppState& state, TransformSink& sink) {
+    const uint64_t position = state.notePosition++;
+    auto& labelCount = state.labelCounts[label];
+    auto& trackCount = state.trackCounts[track];
+    labelCount.first++;
+    trackCount.first++;
+
+    // Check if this label is eligible for transformation
+    if (isEligibleLabel(label)) {
+        state.totalEligibleNotes++;
+
+        // Check if this note should be transformed based on percentage
+        bool transform = state.seeded
+            ? static_cast<double>(seededRandom(state.seed, position, 0) >> 11) * 0x1.0p-53 * 100.0 < state.transformationPercentage
+            : shouldTransformLabel(state.transformationPercentage);
+        if (transform) {
+            state.transformedNotes++;
+            labelCount.second++;
+            trackCount.second++;
+
+            try {
+                // Convert note name to MIDI number
+                int noteIndex = noteNumber >= 0 ? noteNumber : getNoteNumber(noteName);
+
+                // Randomly select a variant from the user's choices, or from the complete list for RANDOM
+                if (!state.variantPool || state.variantPool->selection != state.selectedVariants) {
+                    state.variantPool = resolveVariantPool(state.selectedVariants);
                 }
-            } else {
-                // Output original data for notes not selected for transformation
-                output << std::left
-                       << std::setw(11) << track
-                       << std::setw(11) << noteName
-                       << std::setw(20) << duration
-                       << std::setw(20) << label
-                       << std::setw(25) << "ORIGINAL" // Mark as original
-                       << "\n";
+                const std::vector<std::string>& variants = state.variantPool->variants;
+                uint64_t pick = state.seeded ? seededRandom(state.seed, position, 1) : static_cast<uint64_t>(rand());
+                const std::string& selectedVariant = variants[pick % variants.size()];
+
+                // Apply slide transformation
+                auto transformed = applySlideVariants(noteIndex, duration, DUPLE, selectedVariant);
+
+                // Track variant usage
+                state.variantUsageCount[selectedVariant]++;
+
+                // Output the transformed notes
+                static const std::string generatedName;
+                for (const auto& [transformedNote, transformedDuration] : transformed) {
+                    sink.note(track, generatedName, transformedNote, transformedDuration, label, selectedVariant);
+                }
+            } catch (const std::exception& e) {
+                // Handle cases where getNoteNumber produces an error
+                appendStatus(state, "Error processing note '" + noteName + "': " + e.what() + "\n");
             }
         } else {
-            // Output original data for non-eligible labels
-            output << std::left
-                   << std::setw(11) << track
-                   << std::setw(11) << noteName
-                   << std::setw(20) << duration
-                   << std::setw(20) << label
-                   << std::setw(25) << "" // Empty variant column
-                   << "\n";
+            // Output original data for notes not selected for transformation
+            sink.note(track, noteName, noteNumber, duration, label, "ORIGINAL"); // Mark as original
         }
+    } else {
+        // Output original data for non-eligible labels
+        sink.note(track, noteName, noteNumber, duration, label, ""); // Empty variant column
     }
+}
 
-    input.close();
-    output.close();
+// Read "<track> <note> <duration> [label]" from a line the way
+// `stream >> track >> noteName >> duration` followed by getline would, without
+// building a stream for every line
+bool parseNoteLine(std::string_view line, int& track, std::string& noteName, int& duration, std::string& label) {
+    size_t at = 0;
+    auto skipSpace = [&] {
+        while (at < line.size() && std::isspace(static_cast<unsigned char>(line[at]))) at++;
+    };
+    auto readInt = [&](int& value) {
+        skipSpace();
+        bool negative = at < line.size() && line[at] == '-';
+        if (at < line.size() && (line[at] == '-' || line[at] == '+')) at++;
+        if (at >= line.size() || line[at] < '0' || line[at] > '9') return false;
+        long long number = 0;
+        for (; at < line.size() && line[at] >= '0' && line[at] <= '9'; ++at) {
+            number = std::min(number * 10 + (line[at] - '0'), 1LL << 32);
+        }
+        number = negative ? -number : number;
+        if (number > INT_MAX || number < INT_MIN) return false;
+        value = static_cast<int>(number);
+        return true;
+    };
+
+    if (!readInt(track)) return false;
+    skipSpace();
+    size_t start = at;
+    while (at < line.size() && !std::isspace(static_cast<unsigned char>(line[at]))) at++;
+    if (at == start) return false;
+    noteName.assign(line.data() + start, at - start);
+    if (!readInt(duration)) return false;
+
+    std::string_view rest = line.substr(at);
+    size_t first = rest.find_first_not_of(" \t");  // Trim leading whitespace
+    // Remove trailing carriage return and whitespace (Windows line endings)
+    size_t last = rest.find_last_not_of(" \t\r\n");
+    if (first == std::string_view::npos || last == std::string_view::npos || last < first) {
+        label.clear();
+    } else {
+        label.assign(rest.data() + first, last + 1 - first);
+    }
+    return true;
+}
+
+// Transform one input line and hand the resulting rows to the sink
+void transformLine(const std::string& line, AppState& state, TransformSink& sink) {
+    checkCancellation(state);
+    int track, duration;
+    std::string noteName, label;
+
+    // Parse line with Note in string format (e.g., "C4")
+    if (!parseNoteLine(line, track, noteName, duration, label)) {
+        state.notePosition++; // Positions count input lines
+        sink.passthrough(line);
+        return;
+    }
+
+    transformNote(track, noteName, -1, duration, label, state, sink);
+}
+
+// Transform every input line and hand the resulting rows to the sink
+void transformStream(std::istream& input, AppState& state, TransformSink& sink) {
+    resetStatistics(state);
+
+    std::string line;
+    while (std::getline(input, line)) {
+        transformLine(line, state, sink);
+    }
+}
 
+// Fill in the result summary once a transformation pass has finished
+void updateResultSummary(AppState& state, const std::string& destination) {
     // Calculate actual percentage
     double actualPercentage = state.totalEligibleNotes > 0 ?
         (static_cast<double>(state.transformedNotes) / state.totalEligibleNotes) * 100.0 : 0.0;
@@ -902,191 +1501,5806 @@ void processFile(const std::string& inputFile, const std::string& outputFile, Ap
         summary << "Variant selection: Random\n";
     }
 
-    summary << "Processing complete. Transformed results written to " << outputFile << "\n";
+    if (!state.selectedTracks.empty()) {
+        summary << "Tracks processed:";
+        for (int track : state.selectedTracks) {
+            summary << " " << track;
+        }
+        summary << "\n";
+    }
+
+    summary << "Processing complete. Transformed results written to " << destination << "\n";
     state.resultSummary = summary.str();
-    state.statusMessage = "Processing complete!";
-    state.processingComplete = true;
 }
 
-// Function to convert processed data to MIDI file with MIDI sync fix
-void convertToMidi(const std::string& inputFile, const std::string& outputFile, AppState& state) {
-    std::ifstream input(inputFile);
-    if (!input.is_open()) {
-        state.statusMessage += "Error opening input file: " + inputFile + "\n";
-        return;
+// Number of bytes in the MIDI variable-length encoding of value
+inline size_t midiVlqLength(uint32_t value) {
+    return 1 + (value >= (1u << 7)) + (value >= (1u << 14)) + (value >= (1u << 21)) + (value >= (1u << 28));
+}
+
+// Store value as a MIDI variable-length quantity without a loop over its bytes:
+// the 7-bit groups are spread into one word with the continuation bits preset,
+// and the word is stored big-endian. out needs 8 writable bytes.
+inline char* writeMidiVlq(char* out, uint32_t value) {
+    uint64_t x = value;
+    uint64_t groups = (x & 0x7F) | ((x << 1) & 0x7F00) | ((x << 2) & 0x7F0000) |
+                      ((x << 3) & 0x7F000000) | ((x << 4) & 0x7F00000000ull) | 0x8080808000ull;
+    size_t length = midiVlqLength(value);
+    uint64_t word = groups << (8 * (8 - length));
+    for (int i = 0; i < 8; ++i) {
+        out[i] = static_cast<char>(word >> (56 - 8 * i));
     }
+    return out + length;
+}
 
-    // Skip header lines
-    std::string line;
-    std::getline(input, line); // Skip column headers
-    std::getline(input, line); // Skip separator line
+inline char* writeBigEndian32(char* out, uint32_t value) {
+    out[0] = static_cast<char>(value >> 24);
+    out[1] = static_cast<char>(value >> 16);
+    out[2] = static_cast<char>(value >> 8);
+    out[3] = static_cast<char>(value);
+    return out + 4;
+}
 
-    // Parse the file and collect note events
-    std::map<int, std::vector<MidiEvent>> trackEvents;
-    std::map<int, int> trackPositions; // FIXED: Track positions for sequential notes within each track
+// Delta time between two events; events are in time order, so only a track
+// starting before tick 0 can go backwards, and that is written as no delay
+inline uint32_t midiDeltaTime(int time, int lastTime) {
+    return time > lastTime ? static_cast<uint32_t>(time - lastTime) : 0;
+}
 
-    while (std::getline(input, line)) {
-        std::istringstream ss(line);
-        int track;
-        std::string noteName;
-        int duration;
-        std::string label, variant;
+// MThd chunk with 1024 ticks per quarter note
+std::vector<char> encodeMidiHeader(size_t numTracks, int format = 1) {
+    std::vector<char> header(14);
+    char* out = header.data();
+    std::memcpy(out, "MThd", 4);
+    out = writeBigEndian32(out + 4, 6);  // Header length (always 6 bytes)
+    *out++ = 0;                          // Format 0: one merged track; 1: multiple tracks, same timebase
+    *out++ = static_cast<char>(format);
+    *out++ = static_cast<char>((numTracks >> 8) & 0xFF);
+    *out++ = static_cast<char>(numTracks & 0xFF);
+    *out++ = 0x04;                       // Division: 1024 in big-endian
+    *out++ = 0x00;
+    return header;
+}
 
-        // Skip lines that don't contain note data
-        if (line.empty() || line[0] == '-' || line.find("MIDI File Analyzed") != std::string::npos) {
-            continue;
-        }
+// Calls fn(pitch, duration) for each note of a laid-out track
+struct TrackViewNotes {
+    const MidiTrackView& track;
 
-        // Parse the line
-        if (!(ss >> track >> noteName >> duration)) {
-            continue; // Skip malformed lines
+    template <typename Fn>
+    void operator()(Fn&& fn) const {
+        for (size_t i = 0; i < track.count; ++i) {
+            fn(track.pitches[i], track.durations[i]);
         }
+    }
+};
 
-        // Skip header or non-note lines
-        if (noteName == "Note" || noteName == "Track") {
-            continue;
+// Note events of a sequential track in time order, generated straight from the
+// notes: each note-off falls on the tick where the next note-on starts, so the
+// stream is already ordered with note-offs first and needs no event list.
+template <typename ForEachNote, typename Fn>
+void forEachSequentialEvent(ForEachNote&& forEachNote, Fn&& fn) {
+    int time = 0;
+    forEachNote([&](uint8_t pitch, int32_t duration) {
+        fn(time, true, pitch);
+        time += duration;
+        fn(time, false, pitch);
+    });
+}
+
+// Note events of a track whose notes overlap (zero or negative durations), in
+// time order with note-offs before note-ons on the same tick. An LSD radix sort
+// on the packed key is stable, so equal keys keep their input order.
+template <typename ForEachNote>
+std::vector<MidiEvent> sortedMidiEvents(ForEachNote&& forEachNote, size_t noteCount) {
+    std::vector<MidiEvent> events;
+    events.reserve(noteCount * 2);
+    int time = 0;
+    forEachNote([&](uint8_t pitch, int32_t duration) {
+        events.push_back(packMidiEvent(time, true, pitch));
+        time += duration;
+        events.push_back(packMidiEvent(time, false, pitch));
+    });
+
+    std::vector<MidiEvent> scratch(events.size());
+    for (int shift = 8; shift <= 40; shift += 8) {
+        size_t offsets[257] = {};
+        for (MidiEvent event : events) {
+            offsets[((event >> shift) & 0xFF) + 1]++;
         }
+        if (std::find(std::begin(offsets), std::end(offsets), events.size()) != std::end(offsets)) {
+            continue;  // Every key has the same digit here
+        }
+        for (int digit = 0; digit < 256; ++digit) {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (MidiEvent event : events) {
+            scratch[offsets[(event >> shift) & 0xFF]++] = event;
+        }
+        events.swap(scratch);
+    }
+    return events;
+}
 
-        try {
-            int noteNumber = getNoteNumber(noteName);
+// Bytes of an MTrk chunk around its note events
+const char MIDI_PROGRAM_CHANGE[3] = {0x00, static_cast<char>(0xC0), 0x00}; // Delta time, command, program (piano)
+const char MIDI_END_OF_TRACK[4] = {0x00, static_cast<char>(0xFF), 0x2F, 0x00};
+const size_t MIDI_EVENT_SPACE = 16; // Writable bytes write() needs: an 8-byte VLQ store plus the event
+const std::string_view MIDI_TRACK_PROLOGUE(MIDI_PROGRAM_CHANGE, sizeof(MIDI_PROGRAM_CHANGE));
 
-            // FIXED: Use track-specific positioning for sequential notes within each track
-            int& trackPosition = trackPositions[track];
+// Encodes the note events of one track in order, keeping the previous tick and
+// status byte. compact writes note-offs as note-ons with velocity 0 and leaves
+// out status bytes that repeat the previous one (running status), so every
+// note event after the first is a delta time plus two data bytes.
+struct MidiEventWriter {
+    bool compact;
+    int lastTime = 0;
+    uint8_t runningStatus;
 
-            // Create note-on event at the track's current position
-            MidiEvent noteOn{track, noteNumber, trackPosition, duration, true};
-            trackEvents[track].push_back(noteOn);
+    // prologue: the events written before the notes, ending in a program change
+    MidiEventWriter(bool compactEncoding, std::string_view prologue)
+        : compact(compactEncoding), runningStatus(static_cast<uint8_t>(prologue[prologue.size() - 2])) {}
 
-            // Create note-off event
-            MidiEvent noteOff{track, noteNumber, trackPosition + duration, 0, false};
-            trackEvents[track].push_back(noteOff);
+    uint8_t statusOf(bool isNoteOn, int channel) const {
+        return static_cast<uint8_t>((isNoteOn || compact ? 0x90 : 0x80) | channel);
+    }
 
-            // Update the position for this track (notes within a track are sequential)
-            trackPosition += duration;
+    // Size of the next event, advancing as write() does
+    size_t measure(int time, bool isNoteOn, int channel) {
+        uint8_t status = statusOf(isNoteOn, channel);
+        size_t length = midiVlqLength(midiDeltaTime(time, lastTime)) + 2 + (!compact || status != runningStatus);
+        lastTime = time;
+        runningStatus = status;
+        return length;
+    }
 
-        } catch (const std::exception& e) {
-            state.statusMessage += "Error processing note '" + noteName + "': " + std::string(e.what()) + "\n";
+    // Store the next event; out needs MIDI_EVENT_SPACE writable bytes
+    char* write(char* out, int time, bool isNoteOn, int noteNumber, int channel) {
+        out = writeMidiVlq(out, midiDeltaTime(time, lastTime));
+        lastTime = time;
+        // Note on: 0x90, note, velocity 100; note off: 0x80 (or 0x90), note, velocity 0
+        uint8_t status = statusOf(isNoteOn, channel);
+        if (!compact || status != runningStatus) {
+            *out++ = static_cast<char>(status);
+            runningStatus = status;
         }
+        out[0] = static_cast<char>(noteNumber);
+        out[1] = static_cast<char>(isNoteOn ? 0x64 : 0x00);
+        return out + 2;
     }
+};
 
-    input.close();
+// Length field of the MTrk chunk holding the given events. Event sources call
+// fn(time, isNoteOn, noteNumber), adding the channel when it is not 0.
+template <typename ForEachEvent>
+size_t midiTrackLength(ForEachEvent&& forEachEvent, bool compact, std::string_view prologue) {
+    size_t trackLength = prologue.size() + sizeof(MIDI_END_OF_TRACK);
+    MidiEventWriter sizing(compact, prologue);
+    forEachEvent([&](int time, bool isNoteOn, int, int channel = 0) {
+        trackLength += sizing.measure(time, isNoteOn, channel);
+    });
+    return trackLength;
+}
 
-    // Write MIDI file
-    std::ofstream midiFile(outputFile, std::ios::binary);
-    if (!midiFile.is_open()) {
-        state.statusMessage += "Error opening output MIDI file: " + outputFile + "\n";
-        return;
-    }
+// Encode one whole MTrk chunk, header included, from a stream of note events in
+// time order. The chunk is sized exactly in a first pass, so its length is
+// written up front and the events are stored into one contiguous buffer.
+template <typename ForEachEvent>
+std::vector<char> encodeMidiEvents(ForEachEvent&& forEachEvent, bool compact,
+                                   std::string_view prologue = MIDI_TRACK_PROLOGUE) {
+    size_t trackLength = midiTrackLength(forEachEvent, compact, prologue);
 
-    // Write MIDI header
-    // Format: MThd + <length> + <format> + <tracks> + <division>
-    midiFile.write("MThd", 4); // Chunk type
-
-    // Header length (always 6 bytes)
-    char headerLength[4] = {0, 0, 0, 6};
-    midiFile.write(headerLength, 4);
-
-    // Format (0 = single track, 1 = multiple tracks, same timebase)
-    char format[2] = {0, 1};
-    midiFile.write(format, 2);
-
-    // Number of tracks
-    int numTracks = trackEvents.size();
-    char tracksCount[2] = {static_cast<char>((numTracks >> 8) & 0xFF),
-                          static_cast<char>(numTracks & 0xFF)};
-    midiFile.write(tracksCount, 2);
-
-    // Division (ticks per quarter note = 1024)
-    char division[2] = {0x04, 0x00}; // 1024 in big-endian
-    midiFile.write(division, 2);
-
-    // Write each track
-    for (const auto& [trackNum, events] : trackEvents) {
-        // Sort events by time
-        std::vector<MidiEvent> sortedEvents = events;
-        std::sort(sortedEvents.begin(), sortedEvents.end(),
-                 [](const MidiEvent& a, const MidiEvent& b) {
-                     return a.startTime < b.startTime ||
-                            (a.startTime == b.startTime && !a.isNoteOn && b.isNoteOn);
-                 });
-
-        // Write track header
-        midiFile.write("MTrk", 4);
-
-        // Placeholder for track length (will be filled in later)
-        long trackLengthPos = midiFile.tellp();
-        midiFile.write("\0\0\0\0", 4);
-
-        // Track start position
-        long trackStartPos = midiFile.tellp();
-
-        // Write track events
-        int lastTime = 0;
-
-        // Set instrument (program change) - using piano (0) as default
-        char programChange[3] = {0x00, static_cast<char>(0xC0), 0x00}; // Delta time, command, program number
-        midiFile.write(programChange, 3);
-
-        for (const auto& event : sortedEvents) {
-            // Write delta time (variable length)
-            int deltaTime = event.startTime - lastTime;
-            lastTime = event.startTime;
-
-            // Convert delta time to variable length quantity
-            std::vector<char> vlq;
-            if (deltaTime == 0) {
-                vlq.push_back(0);
-            } else {
-                while (deltaTime > 0) {
-                    char byte = deltaTime & 0x7F;
-                    deltaTime >>= 7;
-                    if (!vlq.empty()) {
-                        byte |= 0x80;
-                    }
-                    vlq.push_back(byte);
-                }
-                std::reverse(vlq.begin(), vlq.end());
-            }
+    // Spare bytes for the word-sized VLQ stores, trimmed afterwards
+    std::vector<char> chunk(8 + trackLength + MIDI_EVENT_SPACE);
+    char* out = chunk.data();
+    std::memcpy(out, "MTrk", 4);
+    out = writeBigEndian32(out + 4, static_cast<uint32_t>(trackLength));
+    std::memcpy(out, prologue.data(), prologue.size());
+    out += prologue.size();
 
-            for (char byte : vlq) {
-                midiFile.put(byte);
-            }
+    MidiEventWriter writer(compact, prologue);
+    forEachEvent([&](int time, bool isNoteOn, int noteNumber, int channel = 0) {
+        out = writer.write(out, time, isNoteOn, noteNumber, channel);
+    });
 
-            // Write note event
-            if (event.isNoteOn) {
-                // Note on: 0x90 | channel, note, velocity
-                midiFile.put(0x90);
-                midiFile.put(static_cast<char>(event.noteNumber));
-                midiFile.put(0x64); // Velocity (100)
-            } else {
-                // Note off: 0x80 | channel, note, velocity
-                midiFile.put(0x80);
-                midiFile.put(static_cast<char>(event.noteNumber));
-                midiFile.put(0x00); // Velocity (0)
-            }
+    std::memcpy(out, MIDI_END_OF_TRACK, sizeof(MIDI_END_OF_TRACK));
+    chunk.resize(8 + trackLength);
+    return chunk;
+}
+
+// Calls fn(time, isNoteOn, noteNumber) for each of a list of sorted events
+struct SortedEvents {
+    const std::vector<MidiEvent>& events;
+
+    template <typename Fn>
+    void operator()(Fn&& fn) const {
+        for (MidiEvent event : events) {
+            fn(midiEventTime(event), midiEventIsNoteOn(event), midiEventNoteNumber(event));
         }
+    }
+};
 
-        // Write end of track
-        midiFile.put(0x00); // Delta time
-        midiFile.put(0xFF); // Meta event
-        midiFile.put(0x2F); // End of track
-        midiFile.put(0x00); // Length
+// Encode the MTrk chunk of one track
+std::vector<char> encodeMidiTrack(const MidiTrackView& track, bool compact) {
+    if (track.sequential) {
+        return encodeMidiEvents([&](auto&& fn) { forEachSequentialEvent(TrackViewNotes{track}, fn); }, compact);
+    }
+    std::vector<MidiEvent> events = sortedMidiEvents(TrackViewNotes{track}, track.count);
+    return encodeMidiEvents(SortedEvents{events}, compact);
+}
 
-        // Calculate and write track length
-        long trackEndPos = midiFile.tellp();
-        long trackLength = trackEndPos - trackStartPos;
+// Writer for a file produced front to back through one fixed-size block, so its
+// memory does not grow with the file
+struct BlockFileWriter {
+    FILE* file = nullptr;
+    std::vector<char> block;
+    size_t used = 0;
+    bool failed = false;
 
-        midiFile.seekp(trackLengthPos);
-        char trackLengthBytes[4] = {
-            static_cast<char>((trackLength >> 24) & 0xFF),
-            static_cast<char>((trackLength >> 16) & 0xFF),
-            static_cast<char>((trackLength >> 8) & 0xFF),
-            static_cast<char>(trackLength & 0xFF)
-        };
-        midiFile.write(trackLengthBytes, 4);
-        midiFile.seekp(trackEndPos);
+    ~BlockFileWriter() {
+        if (file) {
+            std::fclose(file);
+        }
     }
 
-    midiFile.close();
-    state.statusMessage += "MIDI file created successfully: " + outputFile + "\n";
-}
\ No newline at end of file
+    bool open(const std::string& path, size_t blockSize) {
+        file = std::fopen(path.c_str(), "wb");
+        block.resize(blockSize);
+        return file != nullptr;
+    }
+
+    // Room for up to bytes (at most the block size) at the end of the block
+    char* reserve(size_t bytes) {
+        if (used + bytes > block.size()) {
+            flush();
+        }
+        return block.data() + used;
+    }
+
+    void commit(const char* end) {
+        used = end - block.data();
+    }
+
+    void write(const char* data, size_t size) {
+        char* out = reserve(size);
+        std::memcpy(out, data, size);
+        commit(out + size);
+    }
+
+    void flush() {
+        if (used > 0 && std::fwrite(block.data(), 1, used, file) != used) {
+            failed = true;
+        }
+        used = 0;
+    }
+
+    bool close() {
+        flush();
+        if (std::fclose(file) != 0) {
+            failed = true;
+        }
+        file = nullptr;
+        return !failed;
+    }
+};
+
+// Encode one MTrk chunk straight into the writer. The events are generated
+// twice, once to size the chunk and once to store it, so the chunk is never
+// held in memory.
+template <typename ForEachEvent>
+void streamMidiTrack(ForEachEvent&& forEachEvent, bool compact, BlockFileWriter& out,
+                     std::string_view prologue = MIDI_TRACK_PROLOGUE) {
+    char header[8];
+    std::memcpy(header, "MTrk", 4);
+    writeBigEndian32(header + 4, static_cast<uint32_t>(midiTrackLength(forEachEvent, compact, prologue)));
+    out.write(header, sizeof(header));
+    out.write(prologue.data(), prologue.size());
+
+    MidiEventWriter writer(compact, prologue);
+    forEachEvent([&](int time, bool isNoteOn, int noteNumber, int channel = 0) {
+        out.commit(writer.write(out.reserve(MIDI_EVENT_SPACE), time, isNoteOn, noteNumber, channel));
+    });
+    out.write(MIDI_END_OF_TRACK, sizeof(MIDI_END_OF_TRACK));
+}
+
+// Reads a track's spill file one note at a time through a fixed block
+struct SpillFileReader {
+    FILE* file = nullptr;
+    std::vector<char> block;
+    size_t available = 0;
+    size_t position = 0;
+    bool failed = false;
+
+    ~SpillFileReader() {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+
+    bool open(const std::string& path, size_t blockSize) {
+        if (file) {
+            std::fclose(file);
+        }
+        file = std::fopen(path.c_str(), "rb");
+        block.resize(std::max(blockSize / MIDI_NOTE_BYTES, size_t(1)) * MIDI_NOTE_BYTES);
+        available = position = 0;
+        failed = file == nullptr;
+        return !failed;
+    }
+
+    bool next(uint8_t& pitch, int32_t& duration) {
+        if (position == available) {
+            if (failed) {
+                return false;
+            }
+            available = std::fread(block.data(), MIDI_NOTE_BYTES, block.size() / MIDI_NOTE_BYTES, file);
+            position = 0;
+            if (available == 0) {
+                failed = std::ferror(file) != 0;
+                return false;
+            }
+        }
+        const char* record = block.data() + position++ * MIDI_NOTE_BYTES;
+        uint32_t bits;
+        std::memcpy(&bits, record + 1, sizeof(bits));
+        pitch = static_cast<uint8_t>(record[0]);
+        duration = static_cast<int32_t>(bits);
+        return true;
+    }
+};
+
+// Calls fn(pitch, duration) for each note of a track's spill file; ok turns
+// false on a read error
+struct SpilledNotes {
+    const std::string& path;
+    size_t blockSize;
+    bool& ok;
+
+    template <typename Fn>
+    void operator()(Fn&& fn) const {
+        SpillFileReader reader;
+        reader.open(path, blockSize);
+        uint8_t pitch;
+        int32_t duration;
+        while (reader.next(pitch, duration)) {
+            fn(pitch, duration);
+        }
+        if (reader.failed) {
+            ok = false;
+        }
+    }
+};
+
+// Write the buffers back to back into a new file: a single writev() on POSIX
+// (more only past IOV_MAX buffers or on a short write), one write per buffer elsewhere
+bool writeBuffers(const std::string& path, const std::vector<std::vector<char>>& buffers, std::string& error) {
+#ifdef PLATFORM_LINUX
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error = "Error opening output MIDI file: " + path;
+        return false;
+    }
+    std::vector<iovec> pending;
+    for (const auto& buffer : buffers) {
+        if (!buffer.empty()) {
+            pending.push_back({const_cast<char*>(buffer.data()), buffer.size()});
+        }
+    }
+    size_t first = 0;
+    while (first < pending.size()) {
+        int count = static_cast<int>(std::min<size_t>(pending.size() - first, IOV_MAX));
+        ssize_t written = ::writev(fd, pending.data() + first, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ::close(fd);
+            error = "Error writing output MIDI file: " + path;
+            return false;
+        }
+        // Drop the buffers written in full and trim a partly written one
+        size_t remaining = static_cast<size_t>(written);
+        while (remaining > 0 && remaining >= pending[first].iov_len) {
+            remaining -= pending[first].iov_len;
+            first++;
+        }
+        if (remaining > 0) {
+            pending[first].iov_base = static_cast<char*>(pending[first].iov_base) + remaining;
+            pending[first].iov_len -= remaining;
+        }
+    }
+    if (::close(fd) != 0) {
+        error = "Error writing output MIDI file: " + path;
+        return false;
+    }
+    return true;
+#else
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        error = "Error opening output MIDI file: " + path;
+        return false;
+    }
+    for (const auto& buffer : buffers) {
+        file.write(buffer.data(), buffer.size());
+    }
+    file.close();
+    if (!file) {
+        error = "Error writing output MIDI file: " + path;
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Number of worker threads to use for count independent tasks
+size_t workerThreadCount(const AppState& state, size_t count) {
+    size_t threads = state.workerThreads > 0 ? static_cast<size_t>(state.workerThreads)
+                                             : std::max(1u, std::thread::hardware_concurrency());
+    return std::max<size_t>(1, std::min(threads, count));
+}
+
+// Run task(0) .. task(count - 1) on up to threads threads. Each worker takes the
+// next unstarted index, so long tasks do not hold up the short ones behind them.
+void runParallel(size_t count, size_t threads, const std::function<void(size_t)>& task) {
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            task(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
+
+// Exports below this many notes are encoded on the calling thread alone
+const size_t PARALLEL_ENCODE_MIN_NOTES = 1 << 16;
+
+void writeMidiFileBounded(MidiNoteStore& notes, const std::string& outputFile, AppState& state);
+void writeMidiFileFormat0(MidiNoteStore& notes, const std::string& outputFile, AppState& state);
+
+// Write the collected notes as a format 1 MIDI file, one MTrk per track. The
+// tracks are encoded concurrently, each into its own buffer, and written in
+// track order.
+void writeMidiFile(MidiNoteStore& notes, const std::string& outputFile, AppState& state) {
+    if (state.midiFormat == 0) {
+        writeMidiFileFormat0(notes, outputFile, state);
+        return;
+    }
+    if (notes.memoryBudget > 0) {
+        writeMidiFileBounded(notes, outputFile, state);
+        return;
+    }
+    notes.finish();
+    const size_t trackCount = notes.tracks.size();
+    std::vector<std::vector<char>> chunks(trackCount + 1);
+    chunks[0] = encodeMidiHeader(trackCount);
+
+    size_t threads = notes.pitches.size() < PARALLEL_ENCODE_MIN_NOTES ? 1 : workerThreadCount(state, trackCount);
+    runParallel(trackCount, threads, [&](size_t i) {
+        chunks[i + 1] = encodeMidiTrack(notes.tracks[i], state.compactMidi);
+    });
+
+    std::string error;
+    if (!writeBuffers(outputFile, chunks, error)) {
+        state.statusMessage += error + "\n";
+        return;
+    }
+    state.statusMessage += "MIDI file created successfully: " + outputFile + "\n";
+}
+
+std::string formatMegabytes(uint64_t bytes) {
+    std::stringstream text;
+    text << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0) << " MB";
+    return text.str();
+}
+
+// Move every note to its final place before writing: once anything has been
+// spilled, the rest goes to the spill files too; otherwise the notes are laid
+// out in memory
+bool settleMidiNotes(MidiNoteStore& notes, AppState& state) {
+    if (notes.spilledNotes > 0) {
+        notes.spill();
+        std::vector<uint64_t>().swap(notes.pending);
+    } else {
+        notes.finish();
+    }
+    if (!notes.spillError.empty()) {
+        state.statusMessage += notes.spillError + "\n";
+        return false;
+    }
+    return true;
+}
+
+// Slots of the store in track number order, the order finish() lists tracks in
+std::vector<size_t> slotsInTrackOrder(const MidiNoteStore& notes) {
+    std::vector<size_t> order(notes.slotTracks.size());
+    for (size_t slot = 0; slot < order.size(); ++slot) {
+        order[slot] = slot;
+    }
+    std::sort(order.begin(), order.end(),
+              [&](size_t a, size_t b) { return notes.slotTracks[a] < notes.slotTracks[b]; });
+    return order;
+}
+
+void appendMidiMemoryStats(const MidiNoteStore& notes, AppState& state) {
+    std::stringstream stats;
+    stats << "MIDI memory: peak " << formatMegabytes(notes.peakBytes) << " of "
+          << formatMegabytes(notes.memoryBudget) << " budget; ";
+    if (notes.spilledNotes > 0) {
+        stats << notes.spilledNotes << " notes spilled to " << notes.slotTracks.size() << " track files\n";
+    } else {
+        stats << "no notes spilled\n";
+    }
+    state.statusMessage += stats.str();
+}
+
+// Write the MIDI file within the store's memory budget. Tracks are encoded one
+// at a time straight into a block writer, from the laid-out notes when nothing
+// was spilled and from the spill files otherwise. A track with overlapping
+// notes has to be sorted in memory and fails the export if that does not fit.
+void writeMidiFileBounded(MidiNoteStore& notes, const std::string& outputFile, AppState& state) {
+    const bool spilled = notes.spilledNotes > 0;
+    if (!settleMidiNotes(notes, state)) {
+        return;
+    }
+
+    const size_t blockSize = std::min<size_t>(std::max<size_t>(notes.memoryBudget / 8, 4096), 1 << 20);
+    const size_t baseBytes = (spilled ? blockSize : notes.pitches.size() * MIDI_NOTE_BYTES) + blockSize;
+    notes.notePeak(baseBytes);
+
+    BlockFileWriter out;
+    if (!out.open(outputFile, blockSize)) {
+        state.statusMessage += "Error opening output MIDI file: " + outputFile + "\n";
+        return;
+    }
+    bool readOk = true;
+
+    // Tracks in number order, each with its notes in memory or on disk
+    std::vector<size_t> order = slotsInTrackOrder(notes);
+
+    std::vector<char> header = encodeMidiHeader(order.size());
+    out.write(header.data(), header.size());
+    std::string error;
+    for (size_t i = 0; i < order.size() && error.empty(); ++i) {
+        const size_t slot = order[i];
+        const std::string path = spilled ? notes.spillPath(slot) : std::string();
+        auto encodeTrack = [&](auto&& forEachNote) {
+            if (notes.slotSequential[slot]) {
+                streamMidiTrack([&](auto&& fn) { forEachSequentialEvent(forEachNote, fn); }, state.compactMidi, out);
+                return;
+            }
+            const size_t count = notes.slotCounts[slot];
+            const size_t sortBytes = count * 4 * sizeof(MidiEvent); // Events plus radix scratch
+            if (baseBytes + sortBytes > notes.memoryBudget) {
+                error = "Track " + std::to_string(notes.slotTracks[slot]) + " has overlapping notes and needs " +
+                        formatMegabytes(sortBytes) + " to sort, more than the MIDI memory budget";
+                return;
+            }
+            notes.notePeak(baseBytes + sortBytes);
+            std::vector<MidiEvent> events = sortedMidiEvents(forEachNote, count);
+            streamMidiTrack(SortedEvents{events}, state.compactMidi, out);
+        };
+        if (spilled) {
+            encodeTrack(SpilledNotes{path, blockSize, readOk});
+        } else {
+            // finish() listed the laid-out tracks in the same number order
+            encodeTrack(TrackViewNotes{notes.tracks[i]});
+        }
+    }
+
+    bool written = out.close();
+    if (error.empty() && !readOk) {
+        error = "Error reading MIDI spill files in " + notes.spillDirectory;
+    } else if (error.empty() && !written) {
+        error = "Error writing output MIDI file: " + outputFile;
+    }
+    if (!error.empty()) {
+        std::remove(outputFile.c_str());
+        state.statusMessage += error + "\n";
+        return;
+    }
+
+    state.statusMessage += "MIDI file created successfully: " + outputFile + "\n";
+    appendMidiMemoryStats(notes, state);
+}
+
+// MIDI channels given to tracks in format 0, in track order. Channel 10 (index 9)
+// is left out because General MIDI plays it as percussion; past 15 tracks the
+// channels are shared.
+const uint8_t FORMAT0_CHANNELS[15] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 11, 12, 13, 14, 15};
+
+// Pull-style reader over the note events of one track in time order, from its
+// laid-out notes, its spill file or its list of sorted events
+struct TrackEventCursor {
+    int track = 0;
+    int channel = 0;
+    const MidiTrackView* view = nullptr; // Sequential notes in memory
+    std::string spillPath;               // Sequential notes on disk
+    size_t blockSize = 0;
+    std::vector<MidiEvent> events;       // Overlapping notes, sorted
+
+    SpillFileReader reader;
+    size_t index = 0;
+    int time = 0;
+    bool offPending = false;
+    uint8_t offPitch = 0;
+    MidiEvent current = 0;
+
+    void reset() {
+        index = 0;
+        time = 0;
+        offPending = false;
+        if (!spillPath.empty()) {
+            reader.open(spillPath, blockSize);
+        }
+    }
+
+    bool nextNote(uint8_t& pitch, int32_t& duration) {
+        if (!view) {
+            return reader.next(pitch, duration);
+        }
+        if (index == view->count) {
+            return false;
+        }
+        pitch = view->pitches[index];
+        duration = view->durations[index];
+        index++;
+        return true;
+    }
+
+    // Move current to the next event; false at the end of the track
+    bool advance() {
+        if (!view && spillPath.empty()) {
+            if (index == events.size()) {
+                return false;
+            }
+            current = events[index++];
+            return true;
+        }
+        if (offPending) {
+            current = packMidiEvent(time, false, offPitch);
+            offPending = false;
+            return true;
+        }
+        int32_t duration;
+        if (!nextNote(offPitch, duration)) {
+            return false;
+        }
+        current = packMidiEvent(time, true, offPitch);
+        time += duration;
+        offPending = true;
+        return true;
+    }
+};
+
+// The tracks' event streams merged into one in time order through a binary heap
+// holding the next event of each track, O(n log k) for k tracks. On one tick,
+// note-offs come before note-ons, and lower-numbered tracks go first.
+struct TrackEventMerge {
+    std::vector<std::unique_ptr<TrackEventCursor>>& cursors;
+    std::vector<uint64_t> heap; // The event's sort key above a 16-bit cursor index
+    TrackEventCursor* last = nullptr;
+    size_t lastIndex = 0;
+
+    explicit TrackEventMerge(std::vector<std::unique_ptr<TrackEventCursor>>& trackCursors) : cursors(trackCursors) {
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            cursors[i]->reset();
+            if (cursors[i]->advance()) {
+                heap.push_back(entry(cursors[i]->current, i));
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), std::greater<uint64_t>());
+    }
+
+    static uint64_t entry(MidiEvent event, size_t cursor) { return (event >> 8) << 16 | cursor; }
+
+    // Restore the heap order after the top entry changed
+    void siftDown() {
+        const size_t size = heap.size();
+        size_t i = 0;
+        uint64_t value = heap[0];
+        while (2 * i + 1 < size) {
+            size_t child = 2 * i + 1;
+            if (child + 1 < size && heap[child + 1] < heap[child]) {
+                child++;
+            }
+            if (value <= heap[child]) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = value;
+    }
+
+    // The cursor holding the next event in its current, or nullptr at the end.
+    // The previous event stays on top of the heap until then, so advancing its
+    // track replaces it in a single sift.
+    TrackEventCursor* next() {
+        if (last) {
+            if (last->advance()) {
+                heap[0] = entry(last->current, lastIndex);
+            } else {
+                heap[0] = heap.back();
+                heap.pop_back();
+            }
+            if (!heap.empty()) {
+                siftDown();
+            }
+        }
+        if (heap.empty()) {
+            last = nullptr;
+            return nullptr;
+        }
+        lastIndex = heap[0] & 0xFFFF;
+        last = cursors[lastIndex].get();
+        return last;
+    }
+};
+
+// Event source over the merged tracks, for the track encoders
+struct MergedTrackEvents {
+    std::vector<std::unique_ptr<TrackEventCursor>>& cursors;
+
+    template <typename Fn>
+    void operator()(Fn&& fn) const {
+        TrackEventMerge merge(cursors);
+        while (TrackEventCursor* cursor = merge.next()) {
+            fn(midiEventTime(cursor->current), midiEventIsNoteOn(cursor->current),
+               midiEventNoteNumber(cursor->current), cursor->channel);
+        }
+    }
+};
+
+// Cursors over the tracks of a settled store, in track number order. Tracks with
+// overlapping notes are sorted into event lists whose bytes are added to
+// memoryBytes; false when that goes over the store's memory budget.
+bool makeTrackEventCursors(MidiNoteStore& notes, const std::vector<size_t>& order, size_t readBlock,
+                           size_t& memoryBytes, std::vector<std::unique_ptr<TrackEventCursor>>& cursors,
+                           AppState& state) {
+    const bool bounded = notes.memoryBudget > 0;
+    const bool spilled = notes.spilledNotes > 0;
+    bool readOk = true;
+    for (size_t i = 0; i < order.size(); ++i) {
+        const size_t slot = order[i];
+        auto cursor = std::make_unique<TrackEventCursor>();
+        cursor->track = notes.slotTracks[slot];
+        if (!notes.slotSequential[slot]) {
+            const size_t count = notes.slotCounts[slot];
+            memoryBytes += count * 4 * sizeof(MidiEvent); // Events plus radix scratch
+            if (bounded && memoryBytes > notes.memoryBudget) {
+                state.statusMessage += "Track " + std::to_string(cursor->track) +
+                                       " has overlapping notes and does not fit the MIDI memory budget\n";
+                return false;
+            }
+            const std::string path = spilled ? notes.spillPath(slot) : std::string();
+            cursor->events = spilled ? sortedMidiEvents(SpilledNotes{path, readBlock, readOk}, count)
+                                     : sortedMidiEvents(TrackViewNotes{notes.tracks[i]}, count);
+        } else if (spilled) {
+            cursor->spillPath = notes.spillPath(slot);
+            cursor->blockSize = readBlock;
+        } else {
+            cursor->view = &notes.tracks[i];
+        }
+        cursors.push_back(std::move(cursor));
+    }
+    if (!readOk) {
+        state.statusMessage += "Error reading MIDI spill files in " + notes.spillDirectory + "\n";
+        return false;
+    }
+    return true;
+}
+
+// Write the collected notes as a format 0 MIDI file: every track is given a
+// channel and all tracks are merged into a single MTrk. The merge runs twice,
+// once to size the chunk and once to encode it, straight from the notes in
+// memory or on disk; only tracks with overlapping notes are sorted into lists.
+void writeMidiFileFormat0(MidiNoteStore& notes, const std::string& outputFile, AppState& state) {
+    const bool bounded = notes.memoryBudget > 0;
+    const bool spilled = notes.spilledNotes > 0;
+    if (!settleMidiNotes(notes, state)) {
+        return;
+    }
+    std::vector<size_t> order = slotsInTrackOrder(notes);
+    if (order.size() > 0xFFFF) {
+        state.statusMessage += "Too many tracks for a format 0 MIDI file: " + std::to_string(order.size()) + "\n";
+        return;
+    }
+
+    // One read block per spilled track, plus the write block
+    const size_t blockSize = std::min<size_t>(std::max<size_t>(notes.memoryBudget / 8, 4096), 1 << 20);
+    const size_t readBlock = std::max<size_t>(blockSize / std::max<size_t>(order.size(), 1), 512);
+    size_t memoryBytes = (spilled ? order.size() * readBlock : notes.pitches.size() * MIDI_NOTE_BYTES) + blockSize;
+
+    std::vector<std::unique_ptr<TrackEventCursor>> cursors;
+    if (!makeTrackEventCursors(notes, order, readBlock, memoryBytes, cursors, state)) {
+        return;
+    }
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        cursors[i]->channel = FORMAT0_CHANNELS[i % 15];
+    }
+    if (bounded && memoryBytes > notes.memoryBudget) {
+        state.statusMessage += "The MIDI memory budget is too small to merge " + std::to_string(order.size()) +
+                               " tracks\n";
+        return;
+    }
+    notes.notePeak(memoryBytes);
+
+    // A program change (piano) for every channel in use opens the track
+    std::string prologue;
+    for (size_t i = 0; i < std::max<size_t>(std::min<size_t>(order.size(), 15), 1); ++i) {
+        prologue += std::string{0x00, static_cast<char>(0xC0 | FORMAT0_CHANNELS[i]), 0x00};
+    }
+
+    std::string error;
+    MergedTrackEvents merged{cursors};
+    if (!bounded) {
+        std::vector<std::vector<char>> chunks;
+        chunks.push_back(encodeMidiHeader(1, 0));
+        chunks.push_back(encodeMidiEvents(merged, state.compactMidi, prologue));
+        if (!writeBuffers(outputFile, chunks, error)) {
+            state.statusMessage += error + "\n";
+            return;
+        }
+    } else {
+        BlockFileWriter out;
+        if (!out.open(outputFile, blockSize)) {
+            state.statusMessage += "Error opening output MIDI file: " + outputFile + "\n";
+            return;
+        }
+        std::vector<char> header = encodeMidiHeader(1, 0);
+        out.write(header.data(), header.size());
+        streamMidiTrack(merged, state.compactMidi, out, prologue);
+        if (!out.close()) {
+            error = "Error writing output MIDI file: " + outputFile;
+        }
+    }
+    bool readOk = true;
+    for (const auto& cursor : cursors) {
+        readOk = readOk && !cursor->reader.failed;
+    }
+    if (error.empty() && !readOk) {
+        error = "Error reading MIDI spill files in " + notes.spillDirectory;
+    }
+    if (!error.empty()) {
+        std::remove(outputFile.c_str());
+        state.statusMessage += error + "\n";
+        return;
+    }
+
+    state.statusMessage += "MIDI file created successfully: " + outputFile + " (format 0)\n";
+    if (order.size() > 15) {
+        state.statusMessage += std::to_string(order.size()) + " tracks share 15 MIDI channels\n";
+    }
+    if (bounded) {
+        appendMidiMemoryStats(notes, state);
+    }
+}
+
+// Read-only memory mapping of a whole file
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef PLATFORM_WINDOWS
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = NULL;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+#ifdef PLATFORM_WINDOWS
+        fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fileHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(fileHandle, &fileSize)) {
+            close();
+            return false;
+        }
+        if (fileSize.QuadPart > 0) {
+            mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+            data = mappingHandle ? static_cast<const char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+            if (data == nullptr) {
+                close();
+                return false;
+            }
+            size = static_cast<size_t>(fileSize.QuadPart);
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool mapped = openDescriptor(fd);
+        ::close(fd);
+        return mapped;
+#endif
+        return true;
+    }
+
+#ifndef PLATFORM_WINDOWS
+    // Map the whole of an open file; the descriptor stays open and owned by the caller
+    bool openDescriptor(int fd) {
+        close();
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+        if (st.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                return false;
+            }
+            data = static_cast<const char*>(mapping);
+            size = static_cast<size_t>(st.st_size);
+        }
+        return true;
+    }
+#endif
+
+    void close() {
+#ifdef PLATFORM_WINDOWS
+        if (data) UnmapViewOfFile(data);
+        if (mappingHandle) CloseHandle(mappingHandle);
+        if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+        mappingHandle = NULL;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap(const_cast<char*>(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// Standard MIDI file reading, for MIDI input and for checking exports. The file
+// is mapped and decoded in place, without copying its chunks.
+
+// Decode a variable-length quantity of at most 4 bytes
+inline bool readMidiVlq(const uint8_t*& in, const uint8_t* end, uint32_t& value) {
+    // Most delta times fit in one byte
+    if (in < end && *in < 0x80) {
+        value = *in++;
+        return true;
+    }
+    value = 0;
+    for (int i = 0; i < 4 && in < end; ++i) {
+        uint8_t byte = *in++;
+        value = (value << 7) | (byte & 0x7F);
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint32_t readBigEndian32(const uint8_t* in) {
+    return static_cast<uint32_t>(in[0]) << 24 | static_cast<uint32_t>(in[1]) << 16 |
+           static_cast<uint32_t>(in[2]) << 8 | in[3];
+}
+
+// The MThd header and the MTrk chunks of a standard MIDI file in memory
+struct SmfReader {
+    const uint8_t* end = nullptr;
+    const uint8_t* nextChunk = nullptr;
+    int format = 0;
+    size_t trackCount = 0;
+    int division = 0;
+
+    bool open(const char* bytes, size_t size, std::string& error) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes);
+        end = data + size;
+        if (size < 14 || std::memcmp(data, "MThd", 4) != 0) {
+            error = "not a standard MIDI file";
+            return false;
+        }
+        uint32_t length = readBigEndian32(data + 4);
+        if (length < 6 || length > size - 8) {
+            error = "bad MThd chunk";
+            return false;
+        }
+        format = data[8] << 8 | data[9];
+        trackCount = static_cast<size_t>(data[10] << 8 | data[11]);
+        division = data[12] << 8 | data[13];
+        nextChunk = data + 8 + length;
+        return true;
+    }
+
+    // The body of the next MTrk chunk, skipping chunks of other types; false at
+    // the end of the file, with error set if the file is truncated
+    bool nextTrack(const uint8_t*& begin, const uint8_t*& chunkEnd, std::string& error) {
+        while (end - nextChunk >= 8) {
+            uint32_t length = readBigEndian32(nextChunk + 4);
+            if (length > static_cast<size_t>(end - nextChunk - 8)) {
+                error = "truncated chunk";
+                return false;
+            }
+            const bool isTrack = std::memcmp(nextChunk, "MTrk", 4) == 0;
+            begin = nextChunk + 8;
+            nextChunk = begin + length;
+            if (isTrack) {
+                chunkEnd = nextChunk;
+                return true;
+            }
+        }
+        if (nextChunk != end) {
+            error = "truncated chunk";
+        }
+        return false;
+    }
+};
+
+// One channel event at its absolute tick
+struct SmfEvent {
+    uint32_t time;
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+};
+
+// Channel events of one MTrk chunk, following running status. System exclusive
+// events are skipped, and so are meta events unless reportMeta is set; the end
+// of track event is noted.
+struct SmfEventDecoder {
+    const uint8_t* in;
+    const uint8_t* end;
+    uint32_t time = 0;
+    uint8_t runningStatus = 0;
+    bool endOfTrack = false;
+    const char* error = nullptr;
+    bool reportMeta = false;     // Return meta events as status 0xFF with the type in data1
+    std::string_view metaData;   // Bytes of the last meta event returned, inside the chunk
+
+    SmfEventDecoder(const uint8_t* begin, const uint8_t* chunkEnd) : in(begin), end(chunkEnd) {}
+
+    // False at the end of the chunk, or with error set on a malformed event
+    bool next(SmfEvent& event) {
+        // Fast path: a note event, with or without status, away from the chunk end
+        if (end - in >= 7 && !endOfTrack) {
+            const uint8_t* p = in;
+            uint32_t delta = *p & 0x7F;
+            while (*p++ & 0x80 && p - in < 4) {
+                delta = (delta << 7) | (*p & 0x7F);
+            }
+            const bool hasStatus = *p & 0x80;
+            const uint8_t status = hasStatus ? *p : runningStatus;
+            if (p[-1] < 0x80 && (status & 0xE0) == 0x80) {
+                p += hasStatus;
+                time += delta;
+                runningStatus = status;
+                event.time = time;
+                event.status = status;
+                event.data1 = p[0];
+                event.data2 = p[1];
+                in = p + 2;
+                return true;
+            }
+        }
+        while (in < end) {
+            uint32_t delta;
+            if (endOfTrack) {
+                error = "events after the end of track";
+                return false;
+            }
+            if (!readMidiVlq(in, end, delta) || in == end) {
+                error = "truncated event";
+                return false;
+            }
+            time += delta;
+            uint8_t status = *in;
+            if (status == 0xFF || status == 0xF0 || status == 0xF7) {
+                in++;
+                uint8_t type = 0;
+                if (status == 0xFF && in < end) {
+                    type = *in++;
+                    endOfTrack = type == 0x2F;
+                }
+                uint32_t length;
+                if (!readMidiVlq(in, end, length) || length > static_cast<size_t>(end - in)) {
+                    error = "truncated meta or system exclusive event";
+                    return false;
+                }
+                const char* data = reinterpret_cast<const char*>(in);
+                in += length;
+                runningStatus = 0;
+                if (reportMeta && status == 0xFF && !endOfTrack) {
+                    event.time = time;
+                    event.status = status;
+                    event.data1 = type;
+                    event.data2 = 0;
+                    metaData = std::string_view(data, length);
+                    return true;
+                }
+                continue;
+            }
+            if (status >= 0xF0) {
+                error = "system message in a track";
+                return false;
+            }
+            if (status & 0x80) {
+                runningStatus = status;
+                in++;
+            } else if (runningStatus == 0) {
+                error = "data byte without a status";
+                return false;
+            }
+            // Program change and channel pressure carry one data byte, the others two
+            const size_t dataBytes = (runningStatus & 0xE0) == 0xC0 ? 1 : 2;
+            if (static_cast<size_t>(end - in) < dataBytes) {
+                error = "truncated event";
+                return false;
+            }
+            event.time = time;
+            event.status = runningStatus;
+            event.data1 = in[0];
+            event.data2 = dataBytes == 2 ? in[1] : 0;
+            in += dataBytes;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Note stream binary (.snb): a compact, versioned form of the transformed text.
+// Integers are little-endian and every section starts on an 8-byte boundary, so
+// a mapped file is used in place without parsing:
+//   SnbHeader
+//   SnbTrack[trackCount]      per-track offset table, ascending track number
+//   string tables             plan variants, labels, slide variants
+//   SnbRun[runCount]          order in which the tracks' rows appear in the text form
+//   SnbRawLine[rawCount]      text kept verbatim, followed by its bytes
+//   per track                 pitch u8[], duration i32[], label id u16[], variant id u16[]
+// A string table is a uint32 count, uint32 offsets[count + 1] and the string bytes.
+// The structs below are written and mapped as they are, so the host must store
+// integers little-endian (Windows targets always do)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error ".snb files are read and written in host byte order, which must be little-endian"
+#endif
+const char SNB_MAGIC[4] = {'S', 'N', 'B', 'F'};
+const uint32_t SNB_VERSION = 1;
+const uint32_t SNB_HAS_PLAN = 1;            // percentage and plan variants are set
+const uint32_t SNB_HAS_STATS = 2;           // note counts are set
+const uint32_t SNB_TEXT_HEADER = 4;         // text form starts with the column headers
+const uint32_t SNB_NO_FINAL_NEWLINE = 8;    // text form does not end with a newline
+const uint32_t SNB_SEEDED = 16;             // seed is set: the run drew its choices from it (--seed)
+const uint8_t SNB_UNRESOLVED_PITCH = 0xFF;  // invalid note name, the row text is an override
+
+struct SnbHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t trackCount;
+    uint64_t seed;
+    double transformationPercentage;
+    uint64_t totalEligibleNotes;
+    uint64_t transformedNotes;
+    uint64_t rowCount;
+    uint64_t trackTableOffset;
+    uint64_t planVariantsOffset;
+    uint64_t labelTableOffset;
+    uint64_t variantTableOffset;
+    uint64_t runTableOffset;
+    uint64_t runCount;
+    uint64_t rawTableOffset;
+    uint64_t rawCount;
+    uint64_t fileSize;
+};
+static_assert(sizeof(SnbHeader) == 128, "SnbHeader must keep its on-disk size");
+
+struct SnbTrack {
+    int32_t track;
+    uint32_t reserved;
+    uint64_t rowCount;
+    uint64_t pitchOffset;
+    uint64_t durationOffset;
+    uint64_t labelOffset;
+    uint64_t variantOffset;
+};
+
+struct SnbRun {
+    uint32_t trackIndex;
+    uint32_t rowCount;
+};
+
+// SNB_RAW_LINE entries are lines without note data, placed before note row `row`.
+// SNB_RAW_OVERRIDE entries replace the text of note row `row` when it does not
+// match the canonical padded format, which keeps text conversion lossless.
+const uint32_t SNB_RAW_LINE = 0;
+const uint32_t SNB_RAW_OVERRIDE = 1;
+
+struct SnbRawLine {
+    uint64_t row;
+    uint32_t kind;
+    uint32_t length;
+    uint64_t offset;
+};
+
+bool isSnbPath(const std::string& path) {
+    if (path.size() < 4) {
+        return false;
+    }
+    std::string extension = path.substr(path.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".snb";
+}
+
+// Check the magic bytes, so .snb input is recognised whatever its name
+bool isSnbFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4] = {0, 0, 0, 0};
+    file.read(magic, 4);
+    return file && std::memcmp(magic, SNB_MAGIC, 4) == 0;
+}
+
+// Collects rows for a .snb file and writes it once the transformation is done
+struct SnbOutputSink : TransformSink {
+    struct TrackColumns {
+        int track;
+        std::vector<uint8_t> pitches;
+        std::vector<int32_t> durations;
+        std::vector<uint16_t> labels;
+        std::vector<uint16_t> variants;
+    };
+    struct RawEntry {
+        uint64_t row;
+        uint32_t kind;
+        std::string text;
+    };
+
+    std::vector<TrackColumns> tracks;
+    std::unordered_map<int, uint32_t> trackSlots;
+    std::vector<SnbRun> runs;
+    std::vector<std::string> labelNames, variantNames;
+    std::unordered_map<std::string, uint16_t> labelIds, variantIds;
+    std::vector<RawEntry> rawLines;
+    uint64_t rowCount = 0;
+    uint32_t flags = SNB_TEXT_HEADER;
+    bool tooManyStrings = false;
+
+    void passthrough(const std::string& line) override {
+        rawLines.push_back({rowCount, SNB_RAW_LINE, line});
+    }
+
+    void note(int track, const std::string& noteName, int noteNumber, int duration,
+              const std::string& label, const std::string& variant) override {
+        bool resolved = true;
+        if (noteNumber < 0) {
+            try {
+                noteNumber = getNoteNumber(noteName);
+            } catch (const std::exception&) {
+                resolved = false;
+            }
+        }
+        if (!resolved || noteNumber < 0 || noteNumber > 127) {
+            // Keep the original spelling; convertToMidi reports it like the text path
+            std::ostringstream text;
+            writeNoteRow(text, track, !noteName.empty() ? noteName : noteNumber >= 0 ? getNoteName(noteNumber) : std::to_string(noteNumber), duration, label, variant);
+            std::string overrideText = text.str();
+            addRow(track, SNB_UNRESOLVED_PITCH, duration, label, variant, &overrideText);
+            return;
+        }
+        addRow(track, static_cast<uint8_t>(noteNumber), duration, label, variant, nullptr);
+    }
+
+    // overrideText is set when the row's text form must be kept verbatim
+    void addRow(int track, uint8_t pitch, int duration, const std::string& label,
+                const std::string& variant, const std::string* overrideText) {
+        auto slot = trackSlots.find(track);
+        if (slot == trackSlots.end()) {
+            slot = trackSlots.emplace(track, static_cast<uint32_t>(tracks.size())).first;
+            tracks.push_back({track, {}, {}, {}, {}});
+        }
+        TrackColumns& columns = tracks[slot->second];
+        columns.pitches.push_back(pitch);
+        columns.durations.push_back(duration);
+        columns.labels.push_back(intern(labelNames, labelIds, label));
+        columns.variants.push_back(intern(variantNames, variantIds, variant));
+
+        if (!runs.empty() && runs.back().trackIndex == slot->second && runs.back().rowCount < UINT32_MAX) {
+            runs.back().rowCount++;
+        } else {
+            runs.push_back({slot->second, 1});
+        }
+        if (overrideText) {
+            rawLines.push_back({rowCount, SNB_RAW_OVERRIDE, *overrideText});
+        }
+        rowCount++;
+    }
+
+    uint16_t intern(std::vector<std::string>& names, std::unordered_map<std::string, uint16_t>& ids, const std::string& value) {
+        auto it = ids.find(value);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        if (names.size() >= 0xFFFF) {
+            tooManyStrings = true;
+            return 0;
+        }
+        uint16_t id = static_cast<uint16_t>(names.size());
+        names.push_back(value);
+        ids.emplace(value, id);
+        return id;
+    }
+
+    // Write the file; state supplies the plan and statistics when it is not null
+    bool write(std::ostream& output, const AppState* state, std::string& error) {
+        if (tooManyStrings) {
+            error = "Too many distinct labels or variants for the .snb format";
+            return false;
+        }
+
+        auto align8 = [](std::string& buffer) { buffer.resize((buffer.size() + 7) & ~size_t(7), '\0'); };
+        auto append = [](std::string& buffer, const void* bytes, size_t length) {
+            buffer.append(static_cast<const char*>(bytes), length);
+        };
+
+        // Tracks are listed in ascending track number, like convertToMidi() orders them
+        std::vector<uint32_t> order(tracks.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return tracks[a].track < tracks[b].track; });
+        std::vector<uint32_t> tableIndex(tracks.size());
+        for (uint32_t i = 0; i < order.size(); ++i) tableIndex[order[i]] = i;
+
+        SnbHeader header = {};
+        std::memcpy(header.magic, SNB_MAGIC, 4);
+        header.version = SNB_VERSION;
+        header.flags = flags;
+        header.trackCount = static_cast<uint32_t>(tracks.size());
+        header.rowCount = rowCount;
+        if (state) {
+            header.flags |= SNB_HAS_PLAN | SNB_HAS_STATS;
+            header.transformationPercentage = state->transformationPercentage;
+            header.totalEligibleNotes = state->totalEligibleNotes;
+            header.transformedNotes = state->transformedNotes;
+            if (state->seeded) {
+                header.flags |= SNB_SEEDED;
+                header.seed = state->seed;
+            }
+        }
+        header.trackTableOffset = sizeof(SnbHeader);
+
+        // Everything between the track table and the columns
+        uint64_t metadataStart = header.trackTableOffset + tracks.size() * sizeof(SnbTrack);
+        std::string metadata;
+        auto appendStringTable = [&](const std::vector<std::string>& strings) {
+            uint64_t offset = metadataStart + metadata.size();
+            uint32_t count = static_cast<uint32_t>(strings.size());
+            append(metadata, &count, 4);
+            uint32_t position = 0;
+            for (const auto& value : strings) {
+                append(metadata, &position, 4);
+                position += static_cast<uint32_t>(value.size());
+            }
+            append(metadata, &position, 4);
+            for (const auto& value : strings) {
+                metadata += value;
+            }
+            align8(metadata);
+            return offset;
+        };
+        static const std::vector<std::string> noVariants;
+        header.planVariantsOffset = appendStringTable(state ? state->selectedVariants : noVariants);
+        header.labelTableOffset = appendStringTable(labelNames);
+        header.variantTableOffset = appendStringTable(variantNames);
+
+        header.runTableOffset = metadataStart + metadata.size();
+        header.runCount = runs.size();
+        for (SnbRun run : runs) {
+            run.trackIndex = tableIndex[run.trackIndex];
+            append(metadata, &run, sizeof(run));
+        }
+
+        header.rawTableOffset = metadataStart + metadata.size();
+        header.rawCount = rawLines.size();
+        uint64_t rawBytes = header.rawTableOffset + rawLines.size() * sizeof(SnbRawLine);
+        for (const auto& raw : rawLines) {
+            SnbRawLine entry = {raw.row, raw.kind, static_cast<uint32_t>(raw.text.size()), rawBytes};
+            append(metadata, &entry, sizeof(entry));
+            rawBytes += raw.text.size();
+        }
+        for (const auto& raw : rawLines) {
+            metadata += raw.text;
+        }
+        align8(metadata);
+
+        // Column offsets follow the metadata
+        std::vector<SnbTrack> table(tracks.size());
+        uint64_t position = metadataStart + metadata.size();
+        auto padded = [](uint64_t bytes) { return (bytes + 7) & ~uint64_t(7); };
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            const TrackColumns& columns = tracks[order[i]];
+            uint64_t rows = columns.pitches.size();
+            SnbTrack& entry = table[i];
+            entry.track = columns.track;
+            entry.rowCount = rows;
+            entry.pitchOffset = position;
+            position += padded(rows);
+            entry.durationOffset = position;
+            position += padded(rows * 4);
+            entry.labelOffset = position;
+            position += padded(rows * 2);
+            entry.variantOffset = position;
+            position += padded(rows * 2);
+        }
+        header.fileSize = position;
+
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnbTrack));
+        output.write(metadata.data(), metadata.size());
+        static const char zeros[8] = {0};
+        auto writeColumn = [&](const void* bytes, uint64_t length) {
+            output.write(static_cast<const char*>(bytes), length);
+            output.write(zeros, padded(length) - length);
+        };
+        for (uint32_t slot : order) {
+            const TrackColumns& columns = tracks[slot];
+            uint64_t rows = columns.pitches.size();
+            writeColumn(columns.pitches.data(), rows);
+            writeColumn(columns.durations.data(), rows * 4);
+            writeColumn(columns.labels.data(), rows * 2);
+            writeColumn(columns.variants.data(), rows * 2);
+        }
+        output.flush();
+        if (!output) {
+            error = "Error writing .snb output";
+            return false;
+        }
+        return true;
+    }
+};
+
+// A mapped .snb file. open() checks the section bounds once; the accessors then
+// point straight into the mapping.
+struct SnbReader {
+    MappedFile file;
+    const SnbHeader* header = nullptr;
+    const SnbTrack* tracks = nullptr;
+    const SnbRun* runs = nullptr;
+    const SnbRawLine* rawLines = nullptr;
+
+    bool open(const std::string& path, std::string& error) {
+        if (!file.open(path)) {
+            error = "Error opening input file: " + path;
+            return false;
+        }
+        if (file.size < sizeof(SnbHeader) || std::memcmp(file.data, SNB_MAGIC, 4) != 0) {
+            error = "Not a .snb file: " + path;
+            return false;
+        }
+        header = reinterpret_cast<const SnbHeader*>(file.data);
+        if (header->version != SNB_VERSION) {
+            error = "Unsupported .snb version " + std::to_string(header->version) + ": " + path;
+            return false;
+        }
+        if (header->fileSize != file.size ||
+            !inBounds(header->trackTableOffset, uint64_t(header->trackCount) * sizeof(SnbTrack)) ||
+            !inBounds(header->runTableOffset, header->runCount * sizeof(SnbRun)) ||
+            !inBounds(header->rawTableOffset, header->rawCount * sizeof(SnbRawLine)) ||
+            !validStringTable(header->planVariantsOffset) ||
+            !validStringTable(header->labelTableOffset) ||
+            !validStringTable(header->variantTableOffset)) {
+            error = "Corrupt .snb file: " + path;
+            return false;
+        }
+        tracks = reinterpret_cast<const SnbTrack*>(file.data + header->trackTableOffset);
+        runs = reinterpret_cast<const SnbRun*>(file.data + header->runTableOffset);
+        rawLines = reinterpret_cast<const SnbRawLine*>(file.data + header->rawTableOffset);
+
+        uint64_t rows = 0;
+        for (uint32_t i = 0; i < header->trackCount; ++i) {
+            const SnbTrack& track = tracks[i];
+            if (!inBounds(track.pitchOffset, track.rowCount) ||
+                !inBounds(track.durationOffset, track.rowCount * 4) ||
+                !inBounds(track.labelOffset, track.rowCount * 2) ||
+                !inBounds(track.variantOffset, track.rowCount * 2) ||
+                (track.durationOffset | track.labelOffset | track.variantOffset) % 8 != 0) {
+                error = "Corrupt .snb file: " + path;
+                return false;
+            }
+            rows += track.rowCount;
+        }
+        for (uint64_t i = 0; i < header->runCount; ++i) {
+            if (runs[i].trackIndex >= header->trackCount) {
+                error = "Corrupt .snb file: " + path;
+                return false;
+            }
+        }
+        for (uint64_t i = 0; i < header->rawCount; ++i) {
+            if (!inBounds(rawLines[i].offset, rawLines[i].length)) {
+                error = "Corrupt .snb file: " + path;
+                return false;
+            }
+        }
+        if (rows != header->rowCount) {
+            error = "Corrupt .snb file: " + path;
+            return false;
+        }
+        return true;
+    }
+
+    bool inBounds(uint64_t offset, uint64_t length) const {
+        return offset <= file.size && length <= file.size - offset;
+    }
+
+    bool validStringTable(uint64_t offset) const {
+        if (offset % 4 != 0 || !inBounds(offset, 4)) {
+            return false;
+        }
+        uint32_t count = *reinterpret_cast<const uint32_t*>(file.data + offset);
+        if (!inBounds(offset + 4, (uint64_t(count) + 1) * 4)) {
+            return false;
+        }
+        const uint32_t* offsets = reinterpret_cast<const uint32_t*>(file.data + offset + 4);
+        return inBounds(offset + 4 + (uint64_t(count) + 1) * 4, offsets[count]);
+    }
+
+    uint32_t stringCount(uint64_t tableOffset) const {
+        return *reinterpret_cast<const uint32_t*>(file.data + tableOffset);
+    }
+
+    std::string_view tableString(uint64_t tableOffset, uint32_t id) const {
+        uint32_t count = stringCount(tableOffset);
+        if (id >= count) {
+            return std::string_view();
+        }
+        const uint32_t* offsets = reinterpret_cast<const uint32_t*>(file.data + tableOffset + 4);
+        const char* bytes = file.data + tableOffset + 4 + (uint64_t(count) + 1) * 4;
+        if (offsets[id] > offsets[id + 1] || offsets[id + 1] > offsets[count]) {
+            return std::string_view();
+        }
+        return std::string_view(bytes + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    std::string_view label(uint16_t id) const { return tableString(header->labelTableOffset, id); }
+    std::string_view variant(uint16_t id) const { return tableString(header->variantTableOffset, id); }
+    std::string_view rawText(const SnbRawLine& raw) const { return std::string_view(file.data + raw.offset, raw.length); }
+
+    const uint8_t* pitches(const SnbTrack& track) const { return reinterpret_cast<const uint8_t*>(file.data + track.pitchOffset); }
+    const int32_t* durations(const SnbTrack& track) const { return reinterpret_cast<const int32_t*>(file.data + track.durationOffset); }
+    const uint16_t* labels(const SnbTrack& track) const { return reinterpret_cast<const uint16_t*>(file.data + track.labelOffset); }
+    const uint16_t* variants(const SnbTrack& track) const { return reinterpret_cast<const uint16_t*>(file.data + track.variantOffset); }
+
+    // Note names of the rows with override text, by track index and row within
+    // the track. One pass over the run table and the sorted override rows, so an
+    // export with many unresolved rows stays linear.
+    std::vector<std::unordered_map<uint64_t, std::string>> overrideNoteNames() const {
+        std::vector<std::unordered_map<uint64_t, std::string>> names(header->trackCount);
+        std::vector<std::pair<uint64_t, const SnbRawLine*>> overrides;
+        for (uint64_t r = 0; r < header->rawCount; ++r) {
+            if (rawLines[r].kind == SNB_RAW_OVERRIDE) {
+                overrides.emplace_back(rawLines[r].row, &rawLines[r]);
+            }
+        }
+        std::sort(overrides.begin(), overrides.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        std::vector<uint64_t> seen(header->trackCount, 0);
+        uint64_t row = 0;
+        size_t next = 0;
+        for (uint64_t i = 0; i < header->runCount && next < overrides.size(); ++i) {
+            const SnbRun& run = runs[i];
+            for (; next < overrides.size() && overrides[next].first < row + run.rowCount; ++next) {
+                if (overrides[next].first < row) {
+                    continue;
+                }
+                std::istringstream ss{std::string(rawText(*overrides[next].second))};
+                int track;
+                std::string noteName;
+                ss >> track >> noteName;
+                names[run.trackIndex][seen[run.trackIndex] + overrides[next].first - row] = noteName;
+            }
+            seen[run.trackIndex] += run.rowCount;
+            row += run.rowCount;
+        }
+        return names;
+    }
+};
+
+// Parse a row of the padded text format. Returns false for lines convertToMidi()
+// skips; canonical is set when writeNoteRow() reproduces the line byte for byte.
+bool parseTextRow(const std::string& line, int& track, std::string& noteName, int& duration,
+                  std::string& label, std::string& variant, bool& canonical) {
+    if (line.empty() || line[0] == '-' || line.find("MIDI File Analyzed") != std::string::npos) {
+        return false;
+    }
+    std::istringstream ss(line);
+    if (!(ss >> track >> noteName >> duration) || noteName == "Note" || noteName == "Track") {
+        return false;
+    }
+
+    std::vector<std::string> rest;
+    std::string token;
+    while (ss >> token) {
+        rest.push_back(token);
+    }
+
+    // Label and variant may each be empty, so try every split the padding allows
+    std::vector<std::pair<std::string, std::string>> candidates;
+    if (rest.empty()) {
+        candidates.push_back({"", ""});
+    } else if (rest.size() == 1) {
+        candidates.push_back({rest[0], ""});
+        candidates.push_back({"", rest[0]});
+    } else if (rest.size() == 2) {
+        candidates.push_back({rest[0], rest[1]});
+    } else {
+        candidates.push_back({rest[0], rest.back()});
+    }
+
+    for (const auto& [candidateLabel, candidateVariant] : candidates) {
+        std::ostringstream formatted;
+        writeNoteRow(formatted, track, noteName, duration, candidateLabel, candidateVariant);
+        if (formatted.str() == line) {
+            label = candidateLabel;
+            variant = candidateVariant;
+            canonical = true;
+            return true;
+        }
+    }
+    label = candidates[0].first;
+    variant = candidates[0].second;
+    canonical = false;
+    return true;
+}
+
+// Lossless text to .snb conversion; lines that are not canonical rows are kept verbatim
+void convertTextToSnb(const std::string& inputFile, const std::string& outputFile, AppState& state) {
+    MappedFile input;
+    if (!input.open(inputFile)) {
+        state.statusMessage += "Error opening input file: " + inputFile + "\n";
+        return;
+    }
+    std::ofstream output(outputFile, std::ios::binary);
+    if (!output.is_open()) {
+        state.statusMessage += "Error opening output file: " + outputFile + "\n";
+        return;
+    }
+
+    SnbOutputSink snbSink;
+    snbSink.flags = 0;
+    if (input.size > 0 && input.data[input.size - 1] != '\n') {
+        snbSink.flags |= SNB_NO_FINAL_NEWLINE;
+    }
+
+    std::ostringstream headerText;
+    writeTextHeader(headerText);
+    const std::string expectedHeader = headerText.str();
+    size_t position = 0;
+    if (input.size >= expectedHeader.size() && std::memcmp(input.data, expectedHeader.data(), expectedHeader.size()) == 0) {
+        snbSink.flags |= SNB_TEXT_HEADER;
+        position = expectedHeader.size();
+    }
+
+    // convertToMidi() always skips the first two lines, so without the header they stay raw
+    int forcedRawLines = (snbSink.flags & SNB_TEXT_HEADER) ? 0 : 2;
+    std::string line, noteName, label, variant;
+    while (position < input.size) {
+        const char* start = input.data + position;
+        const char* end = static_cast<const char*>(std::memchr(start, '\n', input.size - position));
+        size_t length = end ? static_cast<size_t>(end - start) : input.size - position;
+        line.assign(start, length);
+        position += length + 1;
+
+        int track, duration;
+        bool canonical = false;
+        if (forcedRawLines > 0) {
+            forcedRawLines--;
+            snbSink.passthrough(line);
+        } else if (!parseTextRow(line, track, noteName, duration, label, variant, canonical)) {
+            snbSink.passthrough(line);
+        } else {
+            int noteNumber = -1;
+            try {
+                noteNumber = getNoteNumber(noteName);
+                canonical = canonical && getNoteName(noteNumber) == noteName;
+            } catch (const std::exception&) {
+                canonical = false;
+            }
+            if (noteNumber > 127) {
+                noteNumber = -1; // Not a MIDI pitch: keep the row text and report it on export
+            }
+            uint8_t pitch = noteNumber < 0 ? SNB_UNRESOLVED_PITCH : static_cast<uint8_t>(noteNumber);
+            snbSink.addRow(track, pitch, duration, label, variant, noteNumber >= 0 && canonical ? nullptr : &line);
+        }
+    }
+
+    std::string error;
+    if (!snbSink.write(output, nullptr, error)) {
+        state.statusMessage += error + "\n";
+        return;
+    }
+    state.statusMessage += "Binary note stream created: " + outputFile + "\n";
+}
+
+// Write the text form of a .snb file, byte for byte what the text path produces
+void convertSnbToText(const std::string& inputFile, const std::string& outputFile, AppState& state) {
+    SnbReader reader;
+    std::string error;
+    if (!reader.open(inputFile, error)) {
+        state.statusMessage += error + "\n";
+        return;
+    }
+    std::ofstream output(outputFile, std::ios::binary);
+    if (!output.is_open()) {
+        state.statusMessage += "Error opening output file: " + outputFile + "\n";
+        return;
+    }
+
+    const SnbHeader& header = *reader.header;
+    if (header.flags & SNB_TEXT_HEADER) {
+        writeTextHeader(output);
+    }
+
+    // Newlines are written lazily so the last line can go without one
+    std::vector<uint64_t> cursor(header.trackCount, 0);
+    uint64_t raw = 0, row = 0;
+    bool pendingNewline = false;
+    auto beginLine = [&]() {
+        if (pendingNewline) {
+            output << "\n";
+        }
+        pendingNewline = true;
+    };
+    auto emitRawLinesBefore = [&](uint64_t target) {
+        while (raw < header.rawCount && reader.rawLines[raw].row == target && reader.rawLines[raw].kind == SNB_RAW_LINE) {
+            beginLine();
+            output << reader.rawText(reader.rawLines[raw]);
+            raw++;
+        }
+    };
+
+    for (uint64_t r = 0; r < header.runCount; ++r) {
+        const SnbRun& run = reader.runs[r];
+        const SnbTrack& track = reader.tracks[run.trackIndex];
+        const uint8_t* pitches = reader.pitches(track);
+        const int32_t* durations = reader.durations(track);
+        const uint16_t* labels = reader.labels(track);
+        const uint16_t* variants = reader.variants(track);
+        for (uint32_t i = 0; i < run.rowCount; ++i, ++row) {
+            emitRawLinesBefore(row);
+            uint64_t index = cursor[run.trackIndex]++;
+            beginLine();
+            if (raw < header.rawCount && reader.rawLines[raw].row == row && reader.rawLines[raw].kind == SNB_RAW_OVERRIDE) {
+                output << reader.rawText(reader.rawLines[raw]);
+                raw++;
+            } else {
+                writeNoteRow(output, track.track, getNoteName(pitches[index]), durations[index],
+                             reader.label(labels[index]), reader.variant(variants[index]));
+            }
+        }
+    }
+    emitRawLinesBefore(row);
+
+    if (pendingNewline && !(header.flags & SNB_NO_FINAL_NEWLINE)) {
+        output << "\n";
+    }
+    output.close();
+    state.statusMessage += "Text file created: " + outputFile + "\n";
+}
+
+// Feed the notes of a .snb file, in the selected tracks, to a MIDI sink. The
+// pitch and duration columns are read in place from the mapped file.
+bool collectSnbNotes(const std::string& inputFile, MidiEventSink& midiSink, AppState& state) {
+    SnbReader reader;
+    std::string error;
+    if (!reader.open(inputFile, error)) {
+        state.statusMessage += error + "\n";
+        return false;
+    }
+
+    // Built on the first unresolved row: most files have none
+    std::unique_ptr<std::vector<std::unordered_map<uint64_t, std::string>>> overrideNames;
+    for (uint32_t t = 0; t < reader.header->trackCount; ++t) {
+        const SnbTrack& track = reader.tracks[t];
+        if (!state.selectedTracks.empty() && state.selectedTracks.count(track.track) == 0) {
+            continue;
+        }
+        const uint8_t* pitches = reader.pitches(track);
+        const int32_t* durations = reader.durations(track);
+        for (uint64_t i = 0; i < track.rowCount; ++i) {
+            checkCancellation(state);
+            if (pitches[i] == SNB_UNRESOLVED_PITCH) {
+                if (!overrideNames) {
+                    overrideNames = std::make_unique<std::vector<std::unordered_map<uint64_t, std::string>>>(
+                        reader.overrideNoteNames());
+                }
+                auto name = (*overrideNames)[t].find(i);
+                // The sink reports the invalid name or out-of-range pitch
+                midiSink.note(track.track, name != (*overrideNames)[t].end() ? name->second : "?", -1,
+                              durations[i], "", "");
+                continue;
+            }
+            midiSink.addNote(track.track, pitches[i], durations[i]);
+        }
+    }
+    return true;
+}
+
+// Sidecar index (<file>.idx) for text note files. It lists the runs of
+// consecutive lines of each track (see lineTrack) with their byte extent and
+// eligible-note count, plus the byte offset of every NOTE_INDEX_STRIDE-th line. The index
+// records the size and modification time of the file it describes and is
+// rebuilt when either no longer matches.
+const char NOTE_INDEX_MAGIC[4] = {'S', 'N', 'I', 'X'};
+const uint32_t NOTE_INDEX_VERSION = 2;
+const uint32_t NOTE_INDEX_STRIDE = 4096;
+
+struct NoteIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t fileTime;
+    uint32_t lineStride;
+    uint32_t reserved;
+    uint64_t lineCount;
+    uint64_t rangeCount;
+    uint64_t strideCount;
+};
+
+// A run of consecutive lines that belong to one track
+struct NoteIndexRange {
+    int32_t track;
+    uint32_t reserved;
+    uint64_t firstLine;
+    uint64_t lineCount;
+    uint64_t byteOffset;
+    uint64_t byteLength;
+    uint64_t eligibleNotes;
+};
+
+struct NoteIndex {
+    NoteIndexHeader header = {};
+    std::vector<NoteIndexRange> ranges;
+    std::vector<uint64_t> strideOffsets;
+
+    // Byte offset of the closest stride line at or before `line`, which is stored in strideLine
+    uint64_t seekOffset(uint64_t line, uint64_t& strideLine) const {
+        if (strideOffsets.empty()) {
+            strideLine = 0;
+            return 0;
+        }
+        uint64_t stride = std::min<uint64_t>(line / header.lineStride, strideOffsets.size() - 1);
+        strideLine = stride * header.lineStride;
+        return strideOffsets[stride];
+    }
+};
+
+std::string noteIndexPath(const std::string& path) {
+    return path + ".idx";
+}
+
+// Leading integer of a line, accepting what `stream >> int` accepts
+bool parseLeadingInt(std::string_view text, int& value) {
+    size_t i = 0;
+    while (i < text.size() && (text[i] == ' ' || text[i] == '\t')) i++;
+    bool negative = false;
+    if (i < text.size() && (text[i] == '-' || text[i] == '+')) {
+        negative = text[i] == '-';
+        i++;
+    }
+    if (i >= text.size() || text[i] < '0' || text[i] > '9') {
+        return false;
+    }
+    long long number = 0;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+        number = number * 10 + (text[i] - '0');
+        if (number > INT32_MAX) return false;
+        i++;
+    }
+    value = static_cast<int>(negative ? -number : number);
+    return true;
+}
+
+// Split a line on spaces and tabs; returns the number of fields found, up to maxFields
+size_t splitFields(std::string_view line, std::string_view* fields, size_t maxFields) {
+    size_t count = 0, i = 0;
+    while (count < maxFields) {
+        while (i < line.size() && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) i++;
+        if (i >= line.size()) break;
+        size_t start = i;
+        while (i < line.size() && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') i++;
+        fields[count++] = line.substr(start, i - start);
+    }
+    return count;
+}
+
+// The track a line belongs to when tracks are selected: its leading integer.
+// Lines without one (headers, separators) belong to no track. Every track
+// filter uses this, so a selection keeps the same lines with or without an index.
+bool lineTrack(std::string_view line, int& track) {
+    return parseLeadingInt(line, track);
+}
+
+// Classify one line for the index: returns true for the lines of a track and
+// reports the track and whether the line is a note with an eligible label, in
+// either the input or output layout
+bool classifyNoteLine(std::string_view line, int& track, bool& eligible) {
+    if (!lineTrack(line, track)) {
+        return false;
+    }
+    std::string_view fields[6];
+    size_t count = splitFields(line, fields, 6);
+    int duration;
+    // Input rows carry only the label; output rows add the slide variant column
+    eligible = (count == 4 || count == 5) && parseLeadingInt(fields[2], duration) &&
+               fields[1] != "Note" && fields[1] != "Track" && isEligibleLabel(fields[3]);
+    return true;
+}
+
+// File size and modification time the index is tied to
+bool noteIndexStamp(const std::string& path, uint64_t& fileSize, int64_t& fileTime) {
+    std::error_code error;
+    fileSize = std::filesystem::file_size(path, error);
+    if (error) {
+        return false;
+    }
+    fileTime = static_cast<int64_t>(std::filesystem::last_write_time(path, error).time_since_epoch().count());
+    return !error;
+}
+
+bool buildNoteIndex(const std::string& path, NoteIndex& index) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+
+    index = NoteIndex();
+    std::memcpy(index.header.magic, NOTE_INDEX_MAGIC, 4);
+    index.header.version = NOTE_INDEX_VERSION;
+    index.header.lineStride = NOTE_INDEX_STRIDE;
+    if (!noteIndexStamp(path, index.header.fileSize, index.header.fileTime) || index.header.fileSize != file.size) {
+        return false;
+    }
+
+    uint64_t line = 0;
+    size_t position = 0;
+    bool inRange = false;
+    while (position < file.size) {
+        if (line % NOTE_INDEX_STRIDE == 0) {
+            index.strideOffsets.push_back(position);
+        }
+        const char* start = file.data + position;
+        const char* end = static_cast<const char*>(std::memchr(start, '\n', file.size - position));
+        size_t length = end ? static_cast<size_t>(end - start) + 1 : file.size - position;
+
+        int track;
+        bool eligible = false;
+        if (classifyNoteLine(std::string_view(start, end ? length - 1 : length), track, eligible)) {
+            if (!inRange || index.ranges.back().track != track) {
+                index.ranges.push_back({track, 0, line, 0, position, 0, 0});
+                inRange = true;
+            }
+            NoteIndexRange& range = index.ranges.back();
+            range.lineCount++;
+            range.byteLength += length;
+            range.eligibleNotes += eligible ? 1 : 0;
+        } else {
+            inRange = false;  // Ranges only hold the lines of a track
+        }
+        position += length;
+        line++;
+    }
+
+    index.header.lineCount = line;
+    index.header.rangeCount = index.ranges.size();
+    index.header.strideCount = index.strideOffsets.size();
+    return true;
+}
+
+bool writeNoteIndex(const std::string& indexPath, const NoteIndex& index) {
+    std::ofstream output(indexPath, std::ios::binary);
+    output.write(reinterpret_cast<const char*>(&index.header), sizeof(index.header));
+    output.write(reinterpret_cast<const char*>(index.ranges.data()), index.ranges.size() * sizeof(NoteIndexRange));
+    output.write(reinterpret_cast<const char*>(index.strideOffsets.data()), index.strideOffsets.size() * sizeof(uint64_t));
+    return static_cast<bool>(output);
+}
+
+// Read the sidecar index; fails when it is missing, corrupt or stale
+bool readNoteIndex(const std::string& path, NoteIndex& index) {
+    std::ifstream input(noteIndexPath(path), std::ios::binary);
+    if (!input.read(reinterpret_cast<char*>(&index.header), sizeof(index.header)) ||
+        std::memcmp(index.header.magic, NOTE_INDEX_MAGIC, 4) != 0 ||
+        index.header.version != NOTE_INDEX_VERSION || index.header.lineStride == 0) {
+        return false;
+    }
+
+    uint64_t fileSize;
+    int64_t fileTime;
+    if (!noteIndexStamp(path, fileSize, fileTime) ||
+        fileSize != index.header.fileSize || fileTime != index.header.fileTime ||
+        index.header.rangeCount > fileSize || index.header.strideCount > fileSize + 1) {
+        return false;
+    }
+
+    index.ranges.resize(index.header.rangeCount);
+    index.strideOffsets.resize(index.header.strideCount);
+    if (!input.read(reinterpret_cast<char*>(index.ranges.data()), index.ranges.size() * sizeof(NoteIndexRange)) ||
+        !input.read(reinterpret_cast<char*>(index.strideOffsets.data()), index.strideOffsets.size() * sizeof(uint64_t))) {
+        return false;
+    }
+    for (const auto& range : index.ranges) {
+        if (range.byteOffset > fileSize || range.byteLength > fileSize - range.byteOffset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Use the sidecar index when it is current, otherwise rebuild it and write it back
+bool loadNoteIndex(const std::string& path, NoteIndex& index, AppState& state) {
+    if (readNoteIndex(path, index)) {
+        return true;
+    }
+    if (!buildNoteIndex(path, index)) {
+        state.statusMessage += "Error indexing file: " + path + "\n";
+        return false;
+    }
+    if (!writeNoteIndex(noteIndexPath(path), index)) {
+        // The index still serves this run; it is rebuilt next time
+        state.statusMessage += "Could not write index: " + noteIndexPath(path) + "\n";
+    }
+    return true;
+}
+
+// Call fn with the number (from 0) and text of every line of the selected tracks,
+// seeking straight to their byte ranges through the index. Ranges are read in
+// file order and in bounded pieces.
+bool forEachIndexedLine(const std::string& path, const NoteIndex& index, const std::set<int>& tracks,
+                        const std::function<void(uint64_t, const std::string&)>& fn) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input.is_open()) {
+        return false;
+    }
+
+    const uint64_t pieceSize = 1 << 20;
+    std::vector<char> buffer;
+    std::string line;
+    for (const auto& range : index.ranges) {
+        if (tracks.count(range.track) == 0) {
+            continue;
+        }
+        input.seekg(static_cast<std::streamoff>(range.byteOffset));
+        uint64_t remaining = range.byteLength;
+        uint64_t lineNumber = range.firstLine;
+        line.clear();
+        while (remaining > 0) {
+            size_t piece = static_cast<size_t>(std::min(remaining, pieceSize));
+            buffer.resize(piece);
+            if (!input.read(buffer.data(), piece)) {
+                return false;
+            }
+            remaining -= piece;
+            size_t start = 0;
+            for (size_t i = 0; i < piece; ++i) {
+                if (buffer[i] == '\n') {
+                    line.append(buffer.data() + start, i - start);
+                    fn(lineNumber++, line);
+                    line.clear();
+                    start = i + 1;
+                }
+            }
+            line.append(buffer.data() + start, piece - start);
+        }
+        if (!line.empty()) {
+            fn(lineNumber, line);  // Last line of the file without a newline
+        }
+    }
+    return true;
+}
+
+// Call fn for every line of the selected tracks. A current sidecar index (or one
+// built on request with useTrackIndex) lets the read seek straight to those tracks'
+// byte ranges; without one, the file is scanned and other tracks' lines are
+// dropped on a cheap first-field check, before any parsing. state.notePosition is
+// set to each line's number first, so seeded choices match a run over all tracks.
+bool forEachSelectedTrackLine(const std::string& path, AppState& state,
+                              const std::function<void(const std::string&)>& fn) {
+    NoteIndex index;
+    if (state.useTrackIndex ? loadNoteIndex(path, index, state) : readNoteIndex(path, index)) {
+        return forEachIndexedLine(path, index, state.selectedTracks, [&](uint64_t lineNumber, const std::string& line) {
+            state.notePosition = lineNumber;
+            fn(line);
+        });
+    }
+
+    std::ifstream input(path);
+    if (!input.is_open()) {
+        return false;
+    }
+    std::string line;
+    int track;
+    for (uint64_t lineNumber = 0; std::getline(input, line); ++lineNumber) {
+        if (lineTrack(line, track) && state.selectedTracks.count(track) != 0) {
+            state.notePosition = lineNumber;
+            fn(line);
+        }
+    }
+    return true;
+}
+
+// Streams named "-" (stdin/stdout) are read and written in fixed-size blocks, so
+// a pipeline run holds at most one input block, one line and one output block
+// regardless of the stream length. Writes block while the reader downstream is
+// slow, which in turn stops reads from stdin: backpressure reaches the producer.
+const size_t STREAM_BLOCK_SIZE = 1 << 20;
+const size_t MAX_LINE_LENGTH = 1 << 20;  // Longer lines cannot be note rows and are skipped
+
+bool isStandardStream(const std::string& path) {
+    return path == "-";
+}
+
+// Call fn for every line of a C stream; returns the number of overlong lines skipped
+uint64_t forEachStreamLine(FILE* input, const std::function<void(const std::string&)>& fn) {
+    std::vector<char> block(STREAM_BLOCK_SIZE);
+    std::string line;
+    bool overlong = false;
+    uint64_t skipped = 0;
+    size_t bytesRead;
+    while ((bytesRead = std::fread(block.data(), 1, block.size(), input)) > 0) {
+        const char* data = block.data();
+        const char* end = data + bytesRead;
+        while (data < end) {
+            const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+            const char* pieceEnd = newline ? newline : end;
+            if (!overlong) {
+                if (line.size() + (pieceEnd - data) > MAX_LINE_LENGTH) {
+                    overlong = true;
+                    line.clear();
+                    line.shrink_to_fit();
+                } else {
+                    line.append(data, pieceEnd);
+                }
+            }
+            if (!newline) {
+                break;
+            }
+            if (overlong) {
+                skipped++;
+                overlong = false;
+            } else {
+                fn(line);
+                line.clear();
+            }
+            data = newline + 1;
+        }
+    }
+    if (overlong) {
+        skipped++;
+    } else if (!line.empty()) {
+        fn(line);  // Last line without a newline
+    }
+    return skipped;
+}
+
+// Fixed-size output buffer over a C stream, flushed with blocking writes
+struct FileOutputBuffer : std::streambuf {
+    FILE* file;
+    std::vector<char> buffer;
+
+    explicit FileOutputBuffer(FILE* out) : file(out), buffer(STREAM_BLOCK_SIZE) {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~FileOutputBuffer() override {
+        sync();
+    }
+
+    bool flushBuffer() {
+        size_t pending = pptr() - pbase();
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return pending == 0 || std::fwrite(buffer.data(), 1, pending, file) == pending;
+    }
+
+    int overflow(int ch) override {
+        if (!flushBuffer()) {
+            return traits_type::eof();
+        }
+        if (ch != traits_type::eof()) {
+            *pptr() = static_cast<char>(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        return flushBuffer() && std::fflush(file) == 0 ? 0 : -1;
+    }
+};
+
+// Where the transformed rows go: a file, or stdout for "-"
+struct OutputDestination {
+    std::ofstream file;
+    std::unique_ptr<FileOutputBuffer> stdoutBuffer;
+    std::unique_ptr<std::ostream> stdoutStream;
+
+    bool open(const std::string& path, bool binary) {
+        if (isStandardStream(path)) {
+            stdoutBuffer = std::make_unique<FileOutputBuffer>(stdout);
+            stdoutStream = std::make_unique<std::ostream>(stdoutBuffer.get());
+            return true;
+        }
+        file.open(path, binary ? std::ios::binary : std::ios::out);
+        return file.is_open();
+    }
+
+    bool isOpen() const {
+        return stdoutStream != nullptr || file.is_open();
+    }
+
+    std::ostream& stream() {
+        return stdoutStream ? *stdoutStream : file;
+    }
+
+    void close() {
+        if (stdoutStream) {
+            stdoutStream->flush();
+        } else {
+            file.close();
+        }
+    }
+};
+
+// Standard MIDI files as transformation input, decoded in place from the
+// mapped file. Note-on and note-off events are paired per channel and pitch,
+// and the notes are handed on in order of their start, MTrk by MTrk. A note's
+// duration is its length in ticks, rescaled to the 1024 ticks per quarter note
+// of the export; rests between notes are not kept. In a format 1 file the
+// MTrk chunks are tracks 1, 2, ...; a format 0 file is split by channel, MIDI
+// channel n becoming track n. A text, lyric or marker event labels the next
+// note started in its MTrk, unless a label file gives the labels, one line per
+// note in the order they are read.
+bool isMidiFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4] = {0, 0, 0, 0};
+    file.read(magic, 4);
+    return file && std::memcmp(magic, "MThd", 4) == 0;
+}
+
+const uint8_t MIDI_META_TEXT = 0x01;
+const uint8_t MIDI_META_LYRIC = 0x05;
+const uint8_t MIDI_META_MARKER = 0x06;
+
+// A note read from a MIDI file, waiting for its note-off or for the notes
+// started before it to be handed on
+struct MidiInputNote {
+    uint32_t start;
+    uint32_t end;
+    int track;
+    uint8_t pitch;
+    bool open;
+    std::string_view label;
+};
+
+// Transform a standard MIDI file held in memory; inputFile is its name in messages
+bool transformMidiData(const char* data, size_t size, const std::string& inputFile, AppState& state,
+                       TransformSink& sink) {
+    SmfReader reader;
+    std::string error;
+    if (!reader.open(data, size, error)) {
+        return false;
+    }
+    resetStatistics(state);
+
+    std::ifstream labelInput;
+    const std::vector<std::string>* labelTable = state.labelTable.get();
+    if (!state.labelFile.empty() && labelTable == nullptr) {
+        labelInput.open(state.labelFile);
+        if (!labelInput.is_open()) {
+            state.statusMessage += "Error opening label file: " + state.labelFile + "\n";
+            return false;
+        }
+    }
+
+    // Ticks are rescaled to the export's 1024 per quarter note; SMPTE timing is kept as is
+    const bool rescale = reader.division > 0 && reader.division < 0x8000 && reader.division != 1024;
+    auto exportTicks = [&](uint32_t tick) -> int64_t {
+        return rescale ? (static_cast<int64_t>(tick) * 1024 + reader.division / 2) / reader.division : tick;
+    };
+
+    uint64_t noteIndex = 0;
+    bool labelsExhausted = false;
+    std::string label;
+    static const std::string generatedName;
+    auto handOn = [&](const MidiInputNote& note) {
+        if (labelTable != nullptr) {
+            label.clear();
+            if (noteIndex < labelTable->size()) {
+                label = (*labelTable)[noteIndex];
+            } else {
+                labelsExhausted = true;
+            }
+        } else if (labelInput.is_open()) {
+            // The label file is read in step with the notes, selected or not
+            if (!std::getline(labelInput, label)) {
+                label.clear();
+                labelsExhausted = true;
+            }
+            label.erase(label.find_last_not_of(" \t\r\n") + 1);
+        } else {
+            label.assign(note.label);
+        }
+        state.notePosition = noteIndex++; // Unselected notes keep their positions
+        checkCancellation(state);
+        if (!state.selectedTracks.empty() && state.selectedTracks.count(note.track) == 0) {
+            return;
+        }
+        int duration = static_cast<int>(exportTicks(note.end) - exportTicks(note.start));
+        transformNote(note.track, generatedName, note.pitch, duration, label, state, sink);
+    };
+
+    // Notes by start in the current MTrk; the ids of open notes per channel and pitch, oldest first
+    std::deque<MidiInputNote> pending;
+    uint64_t firstId = 0;
+    std::vector<std::vector<uint64_t>> openNotes(16 * 128);
+    auto flush = [&]() {
+        while (!pending.empty() && !pending.front().open) {
+            handOn(pending.front());
+            pending.pop_front();
+            firstId++;
+        }
+    };
+
+    const uint8_t* begin;
+    const uint8_t* end;
+    int chunkTrack = 0;
+    while (reader.nextTrack(begin, end, error)) {
+        chunkTrack++;
+        // Without a label file, unselected tracks of a format 1 file need not be paired
+        // into notes; their note-ons are only counted, so unselected notes keep their positions
+        if (reader.format != 0 && !labelInput.is_open() && labelTable == nullptr && !state.selectedTracks.empty() &&
+            state.selectedTracks.count(chunkTrack) == 0) {
+            SmfEventDecoder counter(begin, end);
+            SmfEvent event;
+            while (counter.next(event)) {
+                if ((event.status & 0xF0) == 0x90 && event.data2 > 0) {
+                    noteIndex++;
+                }
+            }
+            continue;
+        }
+
+        SmfEventDecoder decoder(begin, end);
+        decoder.reportMeta = true;
+        std::string_view nextLabel;
+        SmfEvent event;
+        while (decoder.next(event)) {
+            if (event.status == 0xFF) {
+                if (event.data1 == MIDI_META_TEXT || event.data1 == MIDI_META_LYRIC || event.data1 == MIDI_META_MARKER) {
+                    nextLabel = decoder.metaData;
+                }
+                continue;
+            }
+            const uint8_t kind = event.status & 0xF0;
+            if (kind != 0x80 && kind != 0x90) {
+                continue;
+            }
+            const int channel = event.status & 0x0F;
+            std::vector<uint64_t>& open = openNotes[channel * 128 + (event.data1 & 0x7F)];
+            if (kind == 0x90 && event.data2 > 0) {
+                open.push_back(firstId + pending.size());
+                pending.push_back({event.time, event.time, reader.format == 0 ? channel + 1 : chunkTrack,
+                                   static_cast<uint8_t>(event.data1 & 0x7F), true, nextLabel});
+                nextLabel = std::string_view();
+            } else if (!open.empty()) {
+                // A note-off ends the oldest open note of its pitch
+                MidiInputNote& note = pending[open.front() - firstId];
+                note.end = event.time;
+                note.open = false;
+                open.erase(open.begin());
+                flush();
+            }
+        }
+        if (decoder.error) {
+            appendStatus(state, "Error reading MIDI file " + inputFile + ": " + decoder.error + "\n");
+        }
+
+        // Notes still sounding at the end of the track end there
+        for (MidiInputNote& note : pending) {
+            if (note.open) {
+                note.end = decoder.time;
+                note.open = false;
+            }
+        }
+        for (auto& open : openNotes) {
+            open.clear();
+        }
+        flush();
+    }
+    if (!error.empty()) {
+        appendStatus(state, "Error reading MIDI file " + inputFile + ": " + error + "\n");
+    }
+    if ((labelTable != nullptr && (labelsExhausted || noteIndex < labelTable->size())) ||
+        (labelInput.is_open() && (labelsExhausted || std::getline(labelInput, label)))) {
+        appendStatus(state, "Label file " + state.labelFile + " does not have one line per note (" +
+                            std::to_string(noteIndex) + " notes)\n");
+    }
+    return true;
+}
+
+bool transformMidiFile(const std::string& inputFile, AppState& state, TransformSink& sink) {
+    MappedFile mapped;
+    return mapped.open(inputFile) && transformMidiData(mapped.data, mapped.size, inputFile, state, sink);
+}
+
+// Feed the input file through the transformation, or only the selected tracks of it
+bool transformInputFile(const std::string& inputFile, AppState& state, TransformSink& sink) {
+    if (!isStandardStream(inputFile) && isMidiFile(inputFile)) {
+        return transformMidiFile(inputFile, state, sink);
+    }
+    if (isStandardStream(inputFile)) {
+        // stdin cannot seek, so a track selection is applied with the first-field check.
+        // Dropped lines still count, so seeded choices match a run over all tracks.
+        resetStatistics(state);
+        int track;
+        uint64_t lineNumber = 0;
+        uint64_t skipped = forEachStreamLine(stdin, [&](const std::string& line) {
+            if (state.selectedTracks.empty()) {
+                transformLine(line, state, sink);
+            } else if (lineTrack(line, track) && state.selectedTracks.count(track) != 0) {
+                state.notePosition = lineNumber;
+                transformLine(line, state, sink);
+            }
+            lineNumber++;
+        });
+        if (skipped > 0) {
+            appendStatus(state, "Skipped " + std::to_string(skipped) + " line(s) longer than " +
+                                std::to_string(MAX_LINE_LENGTH) + " bytes\n");
+        }
+        return true;
+    }
+
+    if (state.selectedTracks.empty()) {
+        std::ifstream input(inputFile);
+        if (!input.is_open()) {
+            return false;
+        }
+        transformStream(input, state, sink);
+        return true;
+    }
+
+    resetStatistics(state);
+    return forEachSelectedTrackLine(inputFile, state,
+                                    [&](const std::string& line) { transformLine(line, state, sink); });
+}
+
+// Build or refresh the sidecar index of a file and describe it
+void indexNoteFile(const std::string& inputFile, AppState& state) {
+    NoteIndex index;
+    if (!loadNoteIndex(inputFile, index, state)) {
+        return;
+    }
+
+    std::map<int, std::pair<uint64_t, uint64_t>> trackTotals; // lines, eligible notes
+    std::map<int, int> trackRanges;
+    for (const auto& range : index.ranges) {
+        trackTotals[range.track].first += range.lineCount;
+        trackTotals[range.track].second += range.eligibleNotes;
+        trackRanges[range.track]++;
+    }
+
+    std::stringstream summary;
+    summary << "Index " << noteIndexPath(inputFile) << ": " << index.header.lineCount << " lines, "
+            << trackTotals.size() << " tracks\n";
+    for (const auto& [track, totals] : trackTotals) {
+        summary << "  Track " << track << ": " << totals.first << " lines in " << trackRanges[track]
+                << " range(s), " << totals.second << " eligible\n";
+    }
+    state.resultSummary = summary.str();
+}
+
+bool serveCachedResult(const std::string& inputFile, const std::string& textOutputFile,
+                       const std::string& midiOutputFile, AppState& state, std::string& key);
+void storeCachedResult(const std::string& key, const std::string& textOutputFile, const std::string& midiOutputFile,
+                       const AppState& state);
+
+// Function to process file with GUI integration
+void processFile(const std::string& inputFile, const std::string& outputFile, AppState& state) {
+    std::string cacheKey;
+    if (serveCachedResult(inputFile, outputFile, "", state, cacheKey)) {
+        return;
+    }
+    const bool binaryOutput = isSnbPath(outputFile);
+    OutputDestination destination;
+
+    if (!destination.open(outputFile, binaryOutput)) {
+        state.statusMessage = "Error opening files.";
+        return;
+    }
+    std::ostream& output = destination.stream();
+
+    state.statusMessage.clear();
+    try {
+        throwIfCancelled(state);
+        if (binaryOutput) {
+            // Compact binary note stream instead of padded text rows
+            SnbOutputSink snbSink;
+            if (!transformInputFile(inputFile, state, snbSink)) {
+                state.statusMessage = "Error opening files.";
+                return;
+            }
+            std::string error;
+            if (!snbSink.write(output, &state, error)) {
+                state.statusMessage = error;
+                return;
+            }
+        } else {
+            TextOutputSink textSink(output);
+            if (!transformInputFile(inputFile, state, textSink)) {
+                state.statusMessage = "Error opening files.";
+                return;
+            }
+        }
+    } catch (const JobCancelled& cancelled) {
+        destination.close();
+        reportCancelled(state, cancelled, {outputFile});
+        return;
+    }
+
+    destination.close();
+    if (!output) {
+        state.statusMessage += "Error writing output: " + outputFile;
+        return;
+    }
+
+    updateResultSummary(state, isStandardStream(outputFile) ? "stdout" : outputFile);
+    state.statusMessage += "Processing complete!";
+    state.processingComplete = true;
+    storeCachedResult(cacheKey, outputFile, "", state);
+}
+
+// Single-pass transform straight to MIDI. The transformed notes go into the
+// MIDI encoder in memory; the text output is only written when textOutputFile
+// is not empty.
+void processFileToMidi(const std::string& inputFile, const std::string& textOutputFile,
+                       const std::string& midiOutputFile, AppState& state) {
+    std::string cacheKey;
+    if (serveCachedResult(inputFile, textOutputFile, midiOutputFile, state, cacheKey)) {
+        return;
+    }
+    const bool binaryOutput = isSnbPath(textOutputFile);
+    OutputDestination destination;
+    if (!textOutputFile.empty() && !destination.open(textOutputFile, binaryOutput)) {
+        state.statusMessage = "Error opening files.";
+        return;
+    }
+    std::ostream& output = destination.stream();
+
+    state.statusMessage.clear();
+    MidiEventSink midiSink(state);
+    bool inputOpened;
+    try {
+        throwIfCancelled(state);
+        if (destination.isOpen() && binaryOutput) {
+            SnbOutputSink snbSink;
+            TeeSink both(snbSink, midiSink);
+            inputOpened = transformInputFile(inputFile, state, both);
+            std::string error;
+            if (inputOpened && !snbSink.write(output, &state, error)) {
+                state.statusMessage += error + "\n";
+            }
+            destination.close();
+        } else if (destination.isOpen()) {
+            TextOutputSink textSink(output);
+            TeeSink both(textSink, midiSink);
+            inputOpened = transformInputFile(inputFile, state, both);
+            destination.close();
+        } else {
+            inputOpened = transformInputFile(inputFile, state, midiSink);
+        }
+        // The MIDI file is not started for a job cancelled by now
+        throwIfCancelled(state);
+    } catch (const JobCancelled& cancelled) {
+        destination.close();
+        reportCancelled(state, cancelled, {textOutputFile});
+        return;
+    }
+    if (!inputOpened) {
+        state.statusMessage += "Error opening files.";
+        return;
+    }
+    state.statusMessage += "Processing complete!\n";
+
+    updateResultSummary(state, textOutputFile.empty() ? midiOutputFile : textOutputFile + " and " + midiOutputFile);
+    state.processingComplete = !textOutputFile.empty();
+
+    writeMidiFile(midiSink.notes, midiOutputFile, state);
+    if (state.statusMessage.find("MIDI file created successfully") != std::string::npos) {
+        storeCachedResult(cacheKey, textOutputFile, midiOutputFile, state);
+    }
+}
+
+// Parse one line of a processed text file and feed its note to a MIDI sink
+void collectTextNoteLine(const std::string& line, MidiEventSink& midiSink) {
+    std::istringstream ss(line);
+    int track;
+    std::string noteName;
+    int duration;
+
+    // Skip lines that don't contain note data
+    if (line.empty() || line[0] == '-' || line.find("MIDI File Analyzed") != std::string::npos) {
+        return;
+    }
+
+    // Parse the line
+    if (!(ss >> track >> noteName >> duration)) {
+        return; // Skip malformed lines
+    }
+
+    // Skip header or non-note lines
+    if (noteName == "Note" || noteName == "Track") {
+        return;
+    }
+
+    midiSink.note(track, noteName, -1, duration, "", "");
+}
+
+// Feed the notes of a processed text file, in the selected tracks, to a MIDI sink
+bool collectTextNotes(const std::string& inputFile, MidiEventSink& midiSink, AppState& state) {
+    auto collectLine = [&](const std::string& line) { collectTextNoteLine(line, midiSink); };
+
+    if (!state.selectedTracks.empty()) {
+        // Only the selected tracks are read and parsed
+        if (!forEachSelectedTrackLine(inputFile, state, collectLine)) {
+            state.statusMessage += "Error opening input file: " + inputFile + "\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::ifstream input(inputFile);
+    if (!input.is_open()) {
+        state.statusMessage += "Error opening input file: " + inputFile + "\n";
+        return false;
+    }
+
+    // Skip header lines
+    std::string line;
+    std::getline(input, line); // Skip column headers
+    std::getline(input, line); // Skip separator line
+
+    while (std::getline(input, line)) {
+        checkCancellation(state);
+        collectLine(line);
+    }
+
+    input.close();
+    return true;
+}
+
+// Feed the notes of a processed file, text or .snb, to a MIDI sink
+bool collectMidiNotes(const std::string& inputFile, MidiEventSink& midiSink, AppState& state) {
+    // Binary note streams need no parsing
+    if (isSnbFile(inputFile)) {
+        return collectSnbNotes(inputFile, midiSink, state);
+    }
+    return collectTextNotes(inputFile, midiSink, state);
+}
+
+// Track cache for repeated exports of a text file to the same MIDI file, kept
+// in <file.mid>.tcache. For each MTrk of the MIDI file it holds a hash of the
+// text lines of its track and where the chunk lies in the file, and it is tied
+// to the MIDI file's size and modification time like the note index. A repeat
+// export hashes every track's lines in one pass over the mapped text, parses
+// and encodes only the tracks whose hash is not in the cache, and copies the
+// other chunks from the previous file.
+const char MIDI_TRACK_CACHE_MAGIC[4] = {'S', 'M', 'T', 'C'};
+const uint32_t MIDI_TRACK_CACHE_VERSION = 1;
+
+struct MidiTrackCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t fileTime;
+    uint32_t compact;       // The chunks use the compact encoding
+    uint32_t reserved;
+    uint64_t entryCount;
+};
+
+struct MidiTrackCacheEntry {
+    uint64_t hash;
+    uint64_t offset;        // Start of the MTrk chunk, its header included
+    uint64_t length;
+};
+
+std::string midiTrackCachePath(const std::string& midiPath) {
+    return midiPath + ".tcache";
+}
+
+// Fast 64-bit hash of a byte run, chained through seed. Not cryptographic.
+uint64_t hashBytes(const char* data, size_t size, uint64_t seed) {
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    uint64_t hash = seed ^ (size * multiplier);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * multiplier;
+    hash ^= hash >> 32;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 29);
+}
+
+// Calls fn(line) for each line of data[begin, end), without the line ending
+template <typename Fn>
+void forEachLineInRange(const char* data, size_t begin, size_t end, Fn&& fn) {
+    size_t position = begin;
+    while (position < end) {
+        const char* start = data + position;
+        const char* lineEnd = static_cast<const char*>(std::memchr(start, '\n', end - position));
+        size_t length = lineEnd ? static_cast<size_t>(lineEnd - start) : end - position;
+        fn(std::string_view(start, length));
+        position += length + 1;
+    }
+}
+
+// Start of the line after the first line break at or after position, or size
+size_t nextLineStart(const char* data, size_t size, size_t position) {
+    const void* newline = position < size ? std::memchr(data + position, '\n', size - position) : nullptr;
+    return newline ? static_cast<size_t>(static_cast<const char*>(newline) - data) + 1 : size;
+}
+
+// Calls fn(line) for each line of a mapped file, without the line ending
+template <typename Fn>
+void forEachMappedLine(const MappedFile& file, Fn&& fn) {
+    forEachLineInRange(file.data, 0, file.size, fn);
+}
+
+// Read the cache of a MIDI file; fails when it is missing, corrupt, stale or
+// made with the other encoding
+bool readMidiTrackCache(const std::string& midiPath, bool compact,
+                        std::unordered_map<uint64_t, MidiTrackCacheEntry>& entries) {
+    std::ifstream input(midiTrackCachePath(midiPath), std::ios::binary);
+    MidiTrackCacheHeader header;
+    if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, MIDI_TRACK_CACHE_MAGIC, 4) != 0 ||
+        header.version != MIDI_TRACK_CACHE_VERSION || header.compact != (compact ? 1u : 0u)) {
+        return false;
+    }
+
+    uint64_t fileSize;
+    int64_t fileTime;
+    if (!noteIndexStamp(midiPath, fileSize, fileTime) || fileSize != header.fileSize ||
+        fileTime != header.fileTime || header.entryCount > fileSize) {
+        return false;
+    }
+
+    std::vector<MidiTrackCacheEntry> list(header.entryCount);
+    if (!input.read(reinterpret_cast<char*>(list.data()), list.size() * sizeof(MidiTrackCacheEntry))) {
+        return false;
+    }
+    for (const auto& entry : list) {
+        if (entry.offset > fileSize || entry.length > fileSize - entry.offset) {
+            return false;
+        }
+        entries[entry.hash] = entry;
+    }
+    return true;
+}
+
+bool writeMidiTrackCache(const std::string& midiPath, bool compact, const std::vector<MidiTrackCacheEntry>& entries) {
+    MidiTrackCacheHeader header = {};
+    std::memcpy(header.magic, MIDI_TRACK_CACHE_MAGIC, 4);
+    header.version = MIDI_TRACK_CACHE_VERSION;
+    header.compact = compact ? 1 : 0;
+    header.entryCount = entries.size();
+    if (!noteIndexStamp(midiPath, header.fileSize, header.fileTime)) {
+        return false;
+    }
+    std::ofstream output(midiTrackCachePath(midiPath), std::ios::binary);
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(MidiTrackCacheEntry));
+    return static_cast<bool>(output);
+}
+
+// Export a processed text file through the track cache of the MIDI file
+void convertToMidiCached(const std::string& inputFile, const std::string& outputFile, AppState& state) {
+    MappedFile text;
+    if (!text.open(inputFile)) {
+        state.statusMessage += "Error opening input file: " + inputFile + "\n";
+        return;
+    }
+
+    // Hash each track's lines in file order; like convertToMidi, skip the two header lines
+    std::map<int, uint64_t> trackHashes;
+    uint64_t lineNumber = 0;
+    int lastTrack = 0;
+    uint64_t* lastHash = nullptr;
+    forEachMappedLine(text, [&](std::string_view line) {
+        int track;
+        if (lineNumber++ < 2 || !lineTrack(line, track)) {
+            return;
+        }
+        if (!lastHash || track != lastTrack) {
+            lastHash = &trackHashes[track];
+            lastTrack = track;
+        }
+        *lastHash = hashBytes(line.data(), line.size(), *lastHash);
+    });
+
+    std::unordered_map<uint64_t, MidiTrackCacheEntry> cached;
+    MappedFile previous;
+    if (!readMidiTrackCache(outputFile, state.compactMidi, cached) || !previous.open(outputFile)) {
+        cached.clear();
+    }
+
+    // Parse and encode the tracks that are not in the cache
+    std::set<int> changed;
+    for (const auto& [track, hash] : trackHashes) {
+        if (cached.count(hash) == 0) {
+            changed.insert(track);
+        }
+    }
+    MidiEventSink midiSink(state);
+    if (!changed.empty()) {
+        lineNumber = 0;
+        forEachMappedLine(text, [&](std::string_view line) {
+            int track;
+            checkCancellation(state);
+            if (lineNumber++ >= 2 && lineTrack(line, track) && changed.count(track) != 0) {
+                collectTextNoteLine(std::string(line), midiSink);
+            }
+        });
+    }
+    throwIfCancelled(state);
+    MidiNoteStore& notes = midiSink.notes;
+    notes.finish();
+    std::vector<std::vector<char>> encoded(notes.tracks.size());
+    size_t threads = notes.pitches.size() < PARALLEL_ENCODE_MIN_NOTES ? 1 : workerThreadCount(state, encoded.size());
+    runParallel(encoded.size(), threads, [&](size_t i) {
+        encoded[i] = encodeMidiTrack(notes.tracks[i], state.compactMidi);
+    });
+
+    // Splice cached and new chunks in track order; tracks whose notes could not
+    // all be read stay out of the cache, so their errors are reported every time
+    std::vector<std::vector<char>> chunks(1);
+    std::vector<MidiTrackCacheEntry> entries;
+    uint64_t offset = 14;
+    size_t reused = 0, next = 0;
+    for (const auto& [track, hash] : trackHashes) {
+        auto hit = cached.find(hash);
+        if (hit != cached.end()) {
+            const char* chunk = previous.data + hit->second.offset;
+            chunks.emplace_back(chunk, chunk + hit->second.length);
+            reused++;
+        } else if (next < notes.tracks.size() && notes.tracks[next].track == track) {
+            chunks.push_back(std::move(encoded[next++]));
+        } else {
+            continue; // No notes
+        }
+        if (midiSink.errorTracks.count(track) == 0) {
+            entries.push_back({hash, offset, chunks.back().size()});
+        }
+        offset += chunks.back().size();
+    }
+    chunks[0] = encodeMidiHeader(chunks.size() - 1);
+    previous.close();
+
+    // The previous file is read until the new one is complete, so write beside it
+    const std::string temporaryFile = outputFile + ".tmp";
+    std::string error;
+    std::error_code renameError;
+    if (!writeBuffers(temporaryFile, chunks, error)) {
+        std::remove(temporaryFile.c_str());
+        state.statusMessage += error + "\n";
+        return;
+    }
+    std::filesystem::rename(temporaryFile, outputFile, renameError);
+    if (renameError) {
+        std::remove(temporaryFile.c_str());
+        state.statusMessage += "Error writing output MIDI file: " + outputFile + "\n";
+        return;
+    }
+    state.statusMessage += "MIDI file created successfully: " + outputFile + "\n";
+    state.statusMessage += "MIDI track cache: " + std::to_string(reused) + " of " + std::to_string(chunks.size() - 1) +
+                           " tracks reused, " + std::to_string(chunks.size() - 1 - reused) + " encoded\n";
+    if (!writeMidiTrackCache(outputFile, state.compactMidi, entries)) {
+        state.statusMessage += "Could not write the MIDI track cache " + midiTrackCachePath(outputFile) + "\n";
+    }
+}
+
+// Function to convert processed data to MIDI file with MIDI sync fix
+void convertToMidi(const std::string& inputFile, const std::string& outputFile, AppState& state) {
+    try {
+        throwIfCancelled(state);
+        // Whole-file format 1 exports of text can reuse the tracks of the previous export
+        if (state.midiTrackCache && state.midiFormat == 1 && state.midiMemoryBudget == 0 &&
+            state.selectedTracks.empty() && !isStandardStream(inputFile) && !isSnbFile(inputFile)) {
+            convertToMidiCached(inputFile, outputFile, state);
+            return;
+        }
+
+        // Parse the file and collect note events
+        MidiEventSink midiSink(state);
+        if (collectMidiNotes(inputFile, midiSink, state)) {
+            throwIfCancelled(state); // Not started for a job cancelled by now
+            writeMidiFile(midiSink.notes, outputFile, state);
+        }
+    } catch (const JobCancelled& cancelled) {
+        reportCancelled(state, cancelled);
+    }
+}
+
+std::string describeMidiEvent(bool isNoteOn, int noteNumber, uint32_t tick, int channel) {
+    return std::string(isNoteOn ? "note-on " : "note-off ") + getNoteName(noteNumber) + " at tick " +
+           std::to_string(tick) + " on channel " + std::to_string(channel + 1);
+}
+
+// Check the note events of one MTrk chunk against the merged events of the
+// tracks it holds, tick for tick. Other channel events, the program changes,
+// are skipped. On a difference, mismatch describes the first one.
+bool verifyMidiTrack(SmfEventDecoder& decoder, std::vector<std::unique_ptr<TrackEventCursor>>& cursors,
+                     uint64_t& noteCount, std::string& mismatch) {
+    TrackEventMerge merge(cursors);
+    std::vector<uint64_t> notesSeen(cursors.size()); // Note-ons so far, per track
+    int lastTime = 0;
+    uint32_t tick = 0;
+    SmfEvent event = {};
+    while (true) {
+        bool haveEvent;
+        do {
+            haveEvent = decoder.next(event);
+        } while (haveEvent && (event.status & 0xE0) != 0x80);
+        if (decoder.error) {
+            mismatch = decoder.error;
+            return false;
+        }
+
+        TrackEventCursor* cursor = merge.next();
+        if (!cursor) {
+            if (haveEvent) {
+                mismatch = "extra " + describeMidiEvent((event.status & 0xF0) == 0x90 && event.data2 > 0,
+                                                        event.data1, event.time, event.status & 0x0F) +
+                           " after the last note";
+            } else if (!decoder.endOfTrack) {
+                mismatch = "missing end of track";
+            }
+            return mismatch.empty();
+        }
+
+        const bool isNoteOn = midiEventIsNoteOn(cursor->current);
+        const int noteNumber = midiEventNoteNumber(cursor->current);
+        tick += midiDeltaTime(midiEventTime(cursor->current), lastTime);
+        lastTime = midiEventTime(cursor->current);
+        uint64_t& note = notesSeen[merge.lastIndex];
+        note += isNoteOn;
+        auto expected = [&]() {
+            return "Track " + std::to_string(cursor->track) + ", note " + std::to_string(note) + ": expected " +
+                   describeMidiEvent(isNoteOn, noteNumber, tick, cursor->channel);
+        };
+        if (!haveEvent) {
+            mismatch = expected() + ", the track ends";
+            return false;
+        }
+
+        // Note-ons with velocity 0 are note-offs
+        const bool foundNoteOn = (event.status & 0xF0) == 0x90 && event.data2 > 0;
+        if (foundNoteOn != isNoteOn || event.data1 != noteNumber || event.time != tick ||
+            (event.status & 0x0F) != cursor->channel) {
+            mismatch = expected() + ", found " + describeMidiEvent(foundNoteOn, event.data1, event.time, event.status & 0x0F);
+            return false;
+        }
+        noteCount += isNoteOn;
+    }
+}
+
+// Decode a MIDI export and check it note for note against the processed file,
+// text or .snb, it was made from: every track's pitches in order, each starting
+// and ending on the tick the durations give. Format 1 exports hold one MTrk per
+// track in track number order; format 0 exports merge the tracks on
+// FORMAT0_CHANNELS. The track selection and memory budget apply as in export.
+void verifyMidiFile(const std::string& sourceFile, const std::string& midiFile, AppState& state) {
+    auto started = std::chrono::steady_clock::now();
+    MidiEventSink midiSink(state);
+    MidiNoteStore& notes = midiSink.notes;
+    if (!collectMidiNotes(sourceFile, midiSink, state) || !settleMidiNotes(notes, state)) {
+        return;
+    }
+    std::vector<size_t> order = slotsInTrackOrder(notes);
+    const size_t blockSize = std::min<size_t>(std::max<size_t>(notes.memoryBudget / 8, 4096), 1 << 20);
+    const size_t readBlock = std::max<size_t>(blockSize / std::max<size_t>(order.size(), 1), 512);
+    size_t memoryBytes = 0;
+    std::vector<std::unique_ptr<TrackEventCursor>> cursors;
+    if (!makeTrackEventCursors(notes, order, readBlock, memoryBytes, cursors, state)) {
+        return;
+    }
+    auto sourceRead = std::chrono::steady_clock::now();
+
+    MappedFile mapped;
+    if (!mapped.open(midiFile)) {
+        state.statusMessage += "Error opening MIDI file: " + midiFile + "\n";
+        return;
+    }
+    SmfReader reader;
+    std::string error;
+    if (!reader.open(mapped.data, mapped.size, error)) {
+        state.statusMessage += "Error reading MIDI file " + midiFile + ": " + error + "\n";
+        return;
+    }
+    if (reader.format > 1) {
+        state.statusMessage += "Error reading MIDI file " + midiFile + ": format " + std::to_string(reader.format) +
+                               " is not written by this tool\n";
+        return;
+    }
+    if (reader.format == 0 && order.size() > 0xFFFF) {
+        state.statusMessage += "Too many tracks for a format 0 MIDI file: " + std::to_string(order.size()) + "\n";
+        return;
+    }
+
+    // Format 0: the one MTrk holds every track; format 1: one MTrk per track
+    const size_t expectedChunks = reader.format == 0 ? 1 : order.size();
+    uint64_t noteCount = 0;
+    size_t chunks = 0, failedChunks = 0;
+    bool readOk = true;
+    const uint8_t* begin;
+    const uint8_t* end;
+    while (reader.nextTrack(begin, end, error)) {
+        if (chunks >= expectedChunks) {
+            chunks++;
+            continue;
+        }
+        std::vector<std::unique_ptr<TrackEventCursor>> chunkCursors;
+        if (reader.format == 0) {
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                cursors[i]->channel = FORMAT0_CHANNELS[i % 15];
+            }
+            chunkCursors = std::move(cursors);
+        } else {
+            chunkCursors.push_back(std::move(cursors[chunks]));
+        }
+        SmfEventDecoder decoder(begin, end);
+        std::string mismatch;
+        if (!verifyMidiTrack(decoder, chunkCursors, noteCount, mismatch)) {
+            appendStatus(state, "MTrk " + std::to_string(chunks + 1) + ": " + mismatch + "\n");
+            failedChunks++;
+        }
+        for (const auto& cursor : chunkCursors) {
+            readOk = readOk && !cursor->reader.failed;
+        }
+        chunks++;
+    }
+    if (!readOk) {
+        state.statusMessage += "Error reading MIDI spill files in " + notes.spillDirectory + "\n";
+        return;
+    }
+    if (!error.empty()) {
+        state.statusMessage += "Error reading MIDI file " + midiFile + ": " + error + "\n";
+        return;
+    }
+    if (chunks != expectedChunks || reader.trackCount != expectedChunks) {
+        state.statusMessage += "MIDI file has " + std::to_string(chunks) + " MTrk chunks (header: " +
+                               std::to_string(reader.trackCount) + "), the source needs " +
+                               std::to_string(expectedChunks) + "\n";
+        failedChunks++;
+    }
+    auto finished = std::chrono::steady_clock::now();
+
+    if (failedChunks > 0) {
+        state.statusMessage += "MIDI file " + midiFile + " does not match " + sourceFile + "\n";
+        return;
+    }
+    double sourceSeconds = std::chrono::duration<double>(sourceRead - started).count();
+    double verifySeconds = std::chrono::duration<double>(finished - sourceRead).count();
+    std::stringstream summary;
+    summary << std::fixed << std::setprecision(1);
+    summary << "MIDI file " << midiFile << " matches " << sourceFile << ": " << noteCount << " notes in "
+            << order.size() << " tracks (format " << reader.format << ")\n";
+    summary << "Source read in " << sourceSeconds * 1000 << " ms; " << formatMegabytes(mapped.size)
+            << " of MIDI decoded and compared in " << verifySeconds * 1000 << " ms ("
+            << (verifySeconds > 0 ? mapped.size / verifySeconds / (1 << 20) : 0.0) << " MB/s)\n";
+    state.resultSummary = summary.str();
+}
+
+// Batch mode: many input files run with the same options in one process. The
+// work is scheduled on a pool of worker threads that steal from each other:
+// large files are split at line boundaries into chunks, small files are
+// grouped, and every piece is a task in one of the workers' queues.
+
+// Whether a wildcard pattern with * and ? matches the whole name
+bool matchesWildcard(std::string_view pattern, std::string_view name) {
+    size_t p = 0, n = 0, starP = std::string_view::npos, starN = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starN = n;
+        } else if (starP != std::string_view::npos) {
+            p = starP + 1;
+            n = ++starN;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+// The input files named by a batch argument, sorted: the files of a directory,
+// the files matching a wildcard in the file name part (e.g. scores/*.txt), the
+// paths listed one per line in @list, or a single file
+bool expandBatchInputs(const std::string& spec, std::vector<std::string>& inputs, std::string& error) {
+    namespace fs = std::filesystem;
+    std::error_code code;
+    if (!spec.empty() && spec[0] == '@') {
+        std::ifstream list(spec.substr(1));
+        if (!list.is_open()) {
+            error = "Error opening file list: " + spec.substr(1);
+            return false;
+        }
+        std::string line;
+        while (std::getline(list, line)) {
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (!line.empty()) {
+                inputs.push_back(line);
+            }
+        }
+        return true;
+    }
+
+    fs::path directory = spec;
+    std::string pattern = "*";
+    if (spec.find_first_of("*?") != std::string::npos) {
+        directory = fs::path(spec).parent_path();
+        pattern = fs::path(spec).filename().string();
+        if (directory.empty()) {
+            directory = ".";
+        }
+    } else if (!fs::is_directory(directory, code)) {
+        inputs.push_back(spec);
+        return true;
+    }
+
+    for (fs::directory_iterator entry(directory, code), end; !code && entry != end; entry.increment(code)) {
+        if (entry->is_regular_file(code) && matchesWildcard(pattern, entry->path().filename().string())) {
+            inputs.push_back(entry->path().string());
+        }
+    }
+    if (code) {
+        error = "Error reading directory: " + directory.string();
+        return false;
+    }
+    std::sort(inputs.begin(), inputs.end());
+    return true;
+}
+
+// Output path for one input of a batch, from a template with {name} (the input's
+// file name), {stem} (the file name without its extension) and {index} (the
+// input's position in the batch, from 1)
+std::string expandOutputTemplate(const std::string& pattern, const std::string& input, size_t index) {
+    const std::filesystem::path path(input);
+    const std::pair<const char*, std::string> fields[] = {
+        {"{name}", path.filename().string()},
+        {"{stem}", path.stem().string()},
+        {"{index}", std::to_string(index + 1)},
+    };
+    std::string result = pattern;
+    for (const auto& [field, value] : fields) {
+        for (size_t at = result.find(field); at != std::string::npos; at = result.find(field, at + value.size())) {
+            result.replace(at, std::strlen(field), value);
+        }
+    }
+    return result;
+}
+
+bool hasOutputTemplateField(const std::string& pattern) {
+    return pattern.find("{name}") != std::string::npos || pattern.find("{stem}") != std::string::npos ||
+           pattern.find("{index}") != std::string::npos;
+}
+
+// What one batch job reports back
+struct BatchJobResult {
+    bool ok = false;
+    bool cancelled = false;   // Stopped by its cancellation token; ok is false
+    std::string message;
+    StatsRecord stats;
+    double seconds = 0;
+};
+
+// Run one input of a batch with its own copy of the options
+BatchJobResult runBatchJob(const std::string& input, const std::string& textOutput, const std::string& midiOutput,
+                           const AppState& options) {
+    auto started = std::chrono::steady_clock::now();
+    AppState job = options;
+    job.inputFile = input;
+    job.outputFile = textOutput;
+    job.midiOutputFile = midiOutput;
+    job.statusMessage.clear();
+    job.resultSummary.clear();
+    job.processingComplete = false;
+    job.workerThreads = 1; // The batch already keeps every thread busy
+
+    BatchJobResult result;
+    for (const std::string& output : {textOutput, midiOutput}) {
+        std::filesystem::path parent = std::filesystem::path(output).parent_path();
+        std::error_code ignored;
+        if (!output.empty() && !parent.empty()) {
+            std::filesystem::create_directories(parent, ignored);
+        }
+    }
+    if (midiOutput.empty()) {
+        processFile(input, textOutput, job);
+        result.ok = job.processingComplete;
+    } else {
+        processFileToMidi(input, textOutput, midiOutput, job);
+        result.ok = job.statusMessage.find("MIDI file created successfully") != std::string::npos;
+    }
+    result.message = job.statusMessage;
+    result.cancelled = job.statusMessage.find("Cancelled: ") != std::string::npos;
+    result.stats = statsOf(job);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+// Files larger than two chunks are split at line boundaries into chunks of
+// about BATCH_CHUNK_BYTES; files smaller than BATCH_GROUP_BYTES are packed into
+// tasks of up to BATCH_GROUP_BYTES
+const uint64_t BATCH_CHUNK_BYTES = 16 << 20;
+const uint64_t BATCH_GROUP_BYTES = 1 << 20;
+
+// Whether a batch input can be transformed in independent line ranges: a text
+// file read as a whole, written as text and/or MIDI with all notes in memory.
+// With a result cache every file runs whole, so that it is cached as a whole.
+bool canSplitBatchInput(const std::string& input, const std::string& textOutput, const AppState& options) {
+    return options.selectedTracks.empty() && options.midiMemoryBudget == 0 && options.resultCacheDirectory.empty() &&
+           !isStandardStream(input) && !isStandardStream(textOutput) && !isSnbPath(textOutput) && !isMidiFile(input);
+}
+
+// One line range of a split input and what transforming it produced
+struct BatchChunk {
+    size_t begin = 0;
+    size_t end = 0;
+    uint64_t firstLine = 0;         // Position of the chunk's first line in the file
+    std::string partPath;           // Text rows of the chunk, joined into the output at the end
+    std::vector<uint64_t> notes;    // MidiNoteStore::pending entries of the chunk
+    std::vector<int> slotTracks;    // Track number of each slot in notes
+    BatchJobResult result;
+};
+
+// An input split into chunks. The worker that finishes its last chunk joins
+// the parts into the outputs.
+struct BatchSplitFile {
+    size_t input = 0;
+    MappedFile file;
+    std::vector<BatchChunk> chunks;
+    std::atomic<size_t> remaining{0};
+};
+
+// Transform one chunk of a split input into its part file and note list
+void runBatchChunk(BatchSplitFile& split, size_t index, bool textOutput, bool midiOutput, const AppState& options) {
+    auto started = std::chrono::steady_clock::now();
+    BatchChunk& chunk = split.chunks[index];
+    AppState job = options;
+    job.statusMessage.clear();
+    job.workerThreads = 1;
+    resetStatistics(job);
+    job.notePosition = chunk.firstLine;
+
+    std::ofstream part;
+    std::unique_ptr<TextOutputSink> textSink;
+    std::unique_ptr<MidiEventSink> midiSink;
+    std::unique_ptr<TeeSink> both;
+    if (textOutput) {
+        part.open(chunk.partPath);
+        if (!part.is_open()) {
+            chunk.result.message = "Error opening files.";
+            return;
+        }
+        textSink = std::make_unique<TextOutputSink>(part, index == 0);
+    }
+    if (midiOutput) {
+        midiSink = std::make_unique<MidiEventSink>(job);
+    }
+    if (textSink && midiSink) {
+        both = std::make_unique<TeeSink>(*textSink, *midiSink);
+    }
+    TransformSink& sink = both ? static_cast<TransformSink&>(*both)
+                        : textSink ? static_cast<TransformSink&>(*textSink) : *midiSink;
+
+    std::string line;
+    bool cancelled = false;
+    try {
+        forEachLineInRange(split.file.data, chunk.begin, chunk.end, [&](std::string_view text) {
+            line.assign(text);
+            transformLine(line, job, sink);
+        });
+    } catch (const JobCancelled& stopped) {
+        reportCancelled(job, stopped);
+        cancelled = true;
+    }
+
+    part.close();
+    chunk.result.ok = !cancelled && (!textOutput || part);
+    chunk.result.message = chunk.result.ok || cancelled ? job.statusMessage : "Error writing output: " + chunk.partPath;
+    chunk.result.stats = statsOf(job);
+    if (midiSink) {
+        chunk.notes = std::move(midiSink->notes.pending);
+        chunk.slotTracks = std::move(midiSink->notes.slotTracks);
+    }
+    chunk.result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Join the chunks of a split input into its outputs, in line order
+BatchJobResult finishBatchSplitFile(BatchSplitFile& split, const std::string& textOutput,
+                                    const std::string& midiOutput, const AppState& options) {
+    auto started = std::chrono::steady_clock::now();
+    split.file.close();
+    AppState job = options;
+    job.statusMessage.clear();
+    job.workerThreads = 1;
+    resetStatistics(job);
+
+    BatchJobResult result;
+    result.ok = true;
+    for (BatchChunk& chunk : split.chunks) {
+        appendStatus(job, chunk.result.message);
+        result.ok = result.ok && chunk.result.ok;
+        addStats(job, chunk.result.stats);
+        result.seconds += chunk.result.seconds;
+    }
+
+    if (!textOutput.empty()) {
+        std::error_code code;
+        if (result.ok) {
+            std::filesystem::rename(split.chunks[0].partPath, textOutput, code);
+        }
+        std::ofstream output;
+        if (result.ok && !code) {
+            output.open(textOutput, std::ios::app);
+        }
+        for (size_t i = 0; i < split.chunks.size(); ++i) {
+            if (i > 0 && output.is_open()) {
+                std::ifstream part(split.chunks[i].partPath);
+                if (part.peek() != std::ifstream::traits_type::eof()) {
+                    output << part.rdbuf();
+                }
+            }
+            std::error_code ignored;
+            std::filesystem::remove(split.chunks[i].partPath, ignored);
+        }
+        output.close();
+        if (result.ok && (code || !output)) {
+            result.ok = false;
+            appendStatus(job, "Error writing output: " + textOutput);
+        }
+    }
+
+    if (result.ok && !midiOutput.empty()) {
+        MidiNoteStore notes;
+        for (BatchChunk& chunk : split.chunks) {
+            for (uint64_t entry : chunk.notes) {
+                notes.add(chunk.slotTracks[entry >> 40], static_cast<int>((entry >> 32) & 0xFF),
+                          static_cast<int32_t>(static_cast<uint32_t>(entry)));
+            }
+            std::vector<uint64_t>().swap(chunk.notes);
+        }
+        appendStatus(job, "Processing complete!\n");
+        writeMidiFile(notes, midiOutput, job);
+        result.ok = job.statusMessage.find("MIDI file created successfully") != std::string::npos;
+    }
+
+    result.message = job.statusMessage;
+    result.stats = statsOf(job);
+    result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+// How one worker of a work-stealing run spent its time
+struct WorkerStats {
+    double busySeconds = 0;
+    double idleSeconds = 0;
+    size_t tasks = 0;
+    size_t stolen = 0;
+};
+
+// Run task(i) for every index in the queues, one worker thread per queue. A
+// worker takes tasks from the front of its own queue and, once that is empty,
+// steals from the back of the others', so no worker idles while another still
+// has work queued. Tasks add no tasks, so a worker stops when a full round
+// finds every queue empty.
+std::vector<WorkerStats> runWorkStealing(std::vector<std::deque<size_t>> queues,
+                                         const std::function<void(size_t)>& task) {
+    const size_t threads = queues.size();
+    std::vector<std::mutex> locks(threads);
+    std::vector<WorkerStats> stats(threads);
+    auto take = [&](size_t queue, bool own, size_t& index) {
+        std::lock_guard<std::mutex> lock(locks[queue]);
+        if (queues[queue].empty()) {
+            return false;
+        }
+        index = own ? queues[queue].front() : queues[queue].back();
+        own ? queues[queue].pop_front() : queues[queue].pop_back();
+        return true;
+    };
+    auto worker = [&](size_t self) {
+        size_t index;
+        for (;;) {
+            bool found = take(self, true, index);
+            bool stolen = false;
+            for (size_t offset = 1; !found && offset < threads; ++offset) {
+                found = stolen = take((self + offset) % threads, false, index);
+            }
+            if (!found) {
+                break;
+            }
+            auto started = std::chrono::steady_clock::now();
+            task(index);
+            stats[self].busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            stats[self].tasks++;
+            stats[self].stolen += stolen ? 1 : 0;
+        }
+    };
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t) {
+        workers.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    for (WorkerStats& worker : stats) {
+        worker.idleSeconds = std::max(0.0, seconds - worker.busySeconds);
+    }
+    return stats;
+}
+
+// Priority classes of queued jobs, most urgent first
+enum JobPriority { PRIORITY_INTERACTIVE, PRIORITY_NORMAL, PRIORITY_BULK, PRIORITY_CLASSES };
+const char* const JOB_PRIORITY_NAMES[PRIORITY_CLASSES] = {"interactive", "normal", "bulk"};
+
+bool parseJobPriority(const std::string& name, JobPriority& priority) {
+    for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+        if (name == JOB_PRIORITY_NAMES[c]) {
+            priority = static_cast<JobPriority>(c);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Latencies counted in power-of-two buckets of microseconds: bucket b holds
+// those under 2^b us and at least 2^(b-1) us, the last bucket everything longer
+struct LatencyHistogram {
+    static const int BUCKETS = 36;
+    uint64_t buckets[BUCKETS] = {};
+    uint64_t count = 0;
+    double totalSeconds = 0;
+    double maxSeconds = 0;
+
+    void add(double seconds) {
+        const double micros = std::max(0.0, seconds * 1e6);
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && micros >= static_cast<double>(uint64_t(1) << bucket)) {
+            bucket++;
+        }
+        buckets[bucket]++;
+        count++;
+        totalSeconds += seconds;
+        maxSeconds = std::max(maxSeconds, seconds);
+    }
+
+    // Upper bound in seconds of the bucket holding the given fraction of the latencies
+    double quantile(double fraction) const {
+        const double rank = std::max(1.0, fraction * static_cast<double>(count));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += buckets[bucket];
+            if (static_cast<double>(seen) >= rank) {
+                return std::min(maxSeconds, static_cast<double>(uint64_t(1) << bucket) / 1e6);
+            }
+        }
+        return maxSeconds;
+    }
+};
+
+void writeLatencyHistogramJson(std::ostream& output, const LatencyHistogram& histogram) {
+    output << std::fixed << std::setprecision(3);
+    output << "{\"count\":" << histogram.count << ",\"mean_ms\":"
+           << (histogram.count > 0 ? histogram.totalSeconds * 1e3 / histogram.count : 0.0)
+           << ",\"p50_ms\":" << histogram.quantile(0.5) * 1e3 << ",\"p99_ms\":" << histogram.quantile(0.99) * 1e3
+           << ",\"max_ms\":" << histogram.maxSeconds * 1e3 << ",\"buckets_us\":{";
+    const char* separator = "";
+    for (int bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket) {
+        if (histogram.buckets[bucket] > 0) {
+            output << separator << "\"";
+            if (bucket < LatencyHistogram::BUCKETS - 1) {
+                output << "<" << (uint64_t(1) << bucket);
+            } else {
+                output << ">=" << (uint64_t(1) << (bucket - 1));
+            }
+            output << "\":" << histogram.buckets[bucket];
+            separator = ",";
+        }
+    }
+    output << "}}";
+}
+
+// Queue waits and run times of the jobs of one priority class. Jobs dropped
+// before they started, cancelled or past their deadline, count in wait only.
+struct PriorityClassStats {
+    LatencyHistogram wait;
+    LatencyHistogram service;
+    uint64_t dropped = 0;
+    uint64_t cancelled = 0;   // Stopped while running
+};
+
+// Worker threads running submitted jobs by priority class; within a class the
+// job with the earliest deadline goes first, then the one submitted first. A
+// job's token is checked before it starts: a job cancelled or past its deadline
+// by then is not run, and run() is called with the reason instead. Destroying
+// the queue runs the jobs still queued and joins the workers.
+struct PriorityJobQueue {
+    using Clock = std::chrono::steady_clock;
+    // run(waitSeconds, dropped): dropped is nullptr for a job that is to run now.
+    // It returns true for a job that was cancelled while running.
+    using Job = std::function<bool(double waitSeconds, const char* dropped)>;
+
+    struct Entry {
+        std::shared_ptr<CancellationToken> token;
+        Job run;
+        Clock::time_point queued;
+    };
+
+    std::mutex lock;                  // Guards everything below
+    std::condition_variable ready;    // A job was queued, or the queue is stopping
+    std::condition_variable finished; // pending dropped to 0
+    std::map<std::pair<Clock::time_point, uint64_t>, Entry> queued[PRIORITY_CLASSES];
+    uint64_t submitted = 0;
+    size_t pending = 0;               // Queued or running
+    bool stopping = false;
+    PriorityClassStats stats[PRIORITY_CLASSES];
+    std::vector<std::thread> workers;
+
+    explicit PriorityJobQueue(size_t threads) {
+        for (size_t t = 0; t < std::max<size_t>(threads, 1); ++t) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    PriorityJobQueue(const PriorityJobQueue&) = delete;
+    PriorityJobQueue& operator=(const PriorityJobQueue&) = delete;
+
+    ~PriorityJobQueue() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void submit(JobPriority priority, std::shared_ptr<CancellationToken> token, Job run) {
+        Entry entry{std::move(token), std::move(run), Clock::now()};
+        const Clock::time_point deadline = entry.token && entry.token->hasDeadline ? entry.token->deadline
+                                                                                   : Clock::time_point::max();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queued[priority].emplace(std::make_pair(deadline, submitted++), std::move(entry));
+            pending++;
+        }
+        ready.notify_one();
+    }
+
+    // Block until every job submitted so far has finished
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&] { return pending == 0; });
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            int priority = 0;
+            ready.wait(guard, [&] {
+                for (priority = 0; priority < PRIORITY_CLASSES && queued[priority].empty(); ++priority) {
+                }
+                return priority < PRIORITY_CLASSES || stopping;
+            });
+            if (priority == PRIORITY_CLASSES) {
+                return;
+            }
+            Entry entry = std::move(queued[priority].begin()->second);
+            queued[priority].erase(queued[priority].begin());
+            guard.unlock();
+
+            const Clock::time_point started = Clock::now();
+            const double waitSeconds = std::chrono::duration<double>(started - entry.queued).count();
+            const char* dropped = entry.token ? entry.token->reason() : nullptr;
+            const bool cancelled = entry.run(waitSeconds, dropped);
+            const double serviceSeconds = std::chrono::duration<double>(Clock::now() - started).count();
+
+            guard.lock();
+            PriorityClassStats& classStats = stats[priority];
+            classStats.wait.add(waitSeconds);
+            if (dropped) {
+                classStats.dropped++;
+            } else {
+                classStats.service.add(serviceSeconds);
+                classStats.cancelled += cancelled ? 1 : 0;
+            }
+            if (--pending == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+// The queue's latency histograms as JSON: wait and service per priority class
+void writeQueueLatencyJson(std::ostream& output, PriorityJobQueue& queue) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    output << "{";
+    for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+        const PriorityClassStats& stats = queue.stats[c];
+        output << (c > 0 ? "," : "") << "\"" << JOB_PRIORITY_NAMES[c] << "\":{\"dropped\":" << stats.dropped
+               << ",\"cancelled\":" << stats.cancelled << ",\"wait\":";
+        writeLatencyHistogramJson(output, stats.wait);
+        output << ",\"service\":";
+        writeLatencyHistogramJson(output, stats.service);
+        output << "}";
+    }
+    output << "}";
+}
+
+// One summary line per priority class that had jobs
+std::string describeQueueLatency(PriorityJobQueue& queue) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    std::stringstream text;
+    text << std::fixed << std::setprecision(2);
+    for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+        const PriorityClassStats& stats = queue.stats[c];
+        if (stats.wait.count == 0) {
+            continue;
+        }
+        text << "  " << JOB_PRIORITY_NAMES[c] << ": " << stats.wait.count << " jobs, " << stats.dropped
+             << " dropped, " << stats.cancelled << " cancelled; wait p50 " << stats.wait.quantile(0.5) * 1e3
+             << " ms, p99 " << stats.wait.quantile(0.99) * 1e3 << " ms; service p50 "
+             << stats.service.quantile(0.5) * 1e3 << " ms, p99 " << stats.service.quantile(0.99) * 1e3 << " ms\n";
+    }
+    return text.str();
+}
+
+// Write the queue's latency histograms to a JSON file, or stdout for "-"
+bool writeQueueLatencyFile(const std::string& path, PriorityJobQueue& queue, std::string& error) {
+    if (isStandardStream(path)) {
+        writeQueueLatencyJson(std::cout, queue);
+        std::cout << std::endl;
+        return static_cast<bool>(std::cout);
+    }
+    std::ofstream file(path);
+    writeQueueLatencyJson(file, queue);
+    file << "\n";
+    file.close();
+    if (!file) {
+        error = "Error writing latency file: " + path;
+        return false;
+    }
+    return true;
+}
+
+// Whether a batch input belongs to shard (from 1) of shardCount. The shard is
+// chosen by a hash of the path as listed, so a file keeps its shard whatever
+// else is in the list and every machine agrees on it.
+bool isInBatchShard(const std::string& input, int shard, int shardCount) {
+    return shardCount <= 0 || hashBytes(input.data(), input.size(), 0) % shardCount == static_cast<uint64_t>(shard - 1);
+}
+
+// A unit of batch work: a group of whole files, or one chunk of a split file
+struct BatchTask {
+    std::vector<size_t> inputs;
+    size_t split = SIZE_MAX;
+    size_t chunk = 0;
+    uint64_t bytes = 0;
+};
+
+// Process every input with the same options on a pool of state.workerThreads
+// threads (or one per hardware thread) that steal work from each other. Files
+// over two chunks are split at line boundaries; small files are grouped. Tasks
+// are dealt out largest first. Outputs are named by the
+// templates; an empty text template skips the text output, an empty MIDI
+// template the MIDI output. A failed file is reported and the batch goes on.
+// With shardCount > 0 only the inputs of that shard are run; {index} still
+// counts every input. The totals of all files are left in state and described
+// in resultSummary.
+void runBatch(const std::vector<std::string>& inputs, const std::string& textTemplate,
+              const std::string& midiTemplate, AppState& state, int shard, int shardCount) {
+    state.statusMessage.clear();
+    if (inputs.size() > 1 && ((!textTemplate.empty() && !hasOutputTemplateField(textTemplate)) ||
+                              (!midiTemplate.empty() && !hasOutputTemplateField(midiTemplate)))) {
+        state.statusMessage = "Error: output templates need {name}, {stem} or {index} for more than one input\n";
+        return;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::string> textOutputs(inputs.size());
+    std::vector<std::string> midiOutputs(inputs.size());
+    std::vector<BatchTask> tasks;
+    std::vector<std::unique_ptr<BatchSplitFile>> splits;
+    BatchTask group;
+    size_t groupedFiles = 0;
+    size_t groups = 0;
+    auto closeGroup = [&]() {
+        if (!group.inputs.empty()) {
+            groupedFiles += group.inputs.size();
+            groups++;
+            tasks.push_back(std::move(group));
+            group = BatchTask();
+        }
+    };
+    std::vector<size_t> selected;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (!isInBatchShard(inputs[i], shard, shardCount)) {
+            continue;
+        }
+        selected.push_back(i);
+        if (!textTemplate.empty()) {
+            textOutputs[i] = expandOutputTemplate(textTemplate, inputs[i], i);
+        }
+        if (!midiTemplate.empty()) {
+            midiOutputs[i] = expandOutputTemplate(midiTemplate, inputs[i], i);
+        }
+        std::error_code code;
+        uint64_t size = std::filesystem::file_size(inputs[i], code);
+        if (code) {
+            size = 0; // Left to the job to report
+        }
+
+        auto split = std::make_unique<BatchSplitFile>();
+        if (size > 2 * BATCH_CHUNK_BYTES && canSplitBatchInput(inputs[i], textOutputs[i], state) &&
+            split->file.open(inputs[i])) {
+            // Chunk boundaries go just past the first line break after each multiple of the chunk size
+            const size_t chunkCount = static_cast<size_t>((size + BATCH_CHUNK_BYTES - 1) / BATCH_CHUNK_BYTES);
+            size_t begin = 0;
+            for (size_t c = 1; c <= chunkCount && begin < split->file.size; ++c) {
+                size_t end = split->file.size;
+                size_t target = static_cast<size_t>(static_cast<uint64_t>(split->file.size) * c / chunkCount);
+                if (c < chunkCount && target > begin) {
+                    end = nextLineStart(split->file.data, split->file.size, target);
+                } else if (c < chunkCount) {
+                    continue;
+                }
+                BatchChunk chunk;
+                chunk.begin = begin;
+                chunk.end = end;
+                chunk.firstLine = split->chunks.empty() ? 0 : split->chunks.back().firstLine +
+                    std::count(split->file.data + split->chunks.back().begin, split->file.data + begin, '\n');
+                chunk.partPath = textOutputs[i] + ".part" + std::to_string(split->chunks.size());
+                split->chunks.push_back(std::move(chunk));
+                begin = end;
+            }
+            for (const std::string& output : {textOutputs[i], midiOutputs[i]}) {
+                std::filesystem::path parent = std::filesystem::path(output).parent_path();
+                std::error_code ignored;
+                if (!output.empty() && !parent.empty()) {
+                    std::filesystem::create_directories(parent, ignored);
+                }
+            }
+            split->input = i;
+            split->remaining = split->chunks.size();
+            for (size_t c = 0; c < split->chunks.size(); ++c) {
+                BatchTask task;
+                task.split = splits.size();
+                task.chunk = c;
+                task.bytes = split->chunks[c].end - split->chunks[c].begin;
+                tasks.push_back(std::move(task));
+            }
+            splits.push_back(std::move(split));
+        } else if (size < BATCH_GROUP_BYTES) {
+            if (group.bytes + size > BATCH_GROUP_BYTES) {
+                closeGroup();
+            }
+            group.inputs.push_back(i);
+            group.bytes += size;
+        } else {
+            BatchTask task;
+            task.inputs.push_back(i);
+            task.bytes = size;
+            tasks.push_back(std::move(task));
+        }
+    }
+    closeGroup();
+
+    // Largest tasks first, dealt round robin, so each queue starts with its longest work
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const BatchTask& a, const BatchTask& b) { return a.bytes > b.bytes; });
+    const size_t threads = workerThreadCount(state, tasks.size());
+    std::vector<std::deque<size_t>> queues(threads);
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        queues[t % threads].push_back(t);
+    }
+
+    std::vector<BatchJobResult> results(inputs.size());
+    std::vector<WorkerStats> workers = runWorkStealing(std::move(queues), [&](size_t t) {
+        const BatchTask& task = tasks[t];
+        if (task.split == SIZE_MAX) {
+            for (size_t i : task.inputs) {
+                results[i] = runBatchJob(inputs[i], textOutputs[i], midiOutputs[i], state);
+            }
+            return;
+        }
+        BatchSplitFile& split = *splits[task.split];
+        const size_t i = split.input;
+        runBatchChunk(split, task.chunk, !textOutputs[i].empty(), !midiOutputs[i].empty(), state);
+        if (--split.remaining == 0) {
+            results[i] = finishBatchSplitFile(split, textOutputs[i], midiOutputs[i], state);
+        }
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    resetStatistics(state);
+    size_t failed = 0;
+    double jobSeconds = 0;
+    for (size_t i : selected) {
+        const BatchJobResult& result = results[i];
+        addStats(state, result.stats);
+        jobSeconds += result.seconds;
+        if (!result.ok) {
+            failed++;
+            std::string message = result.message;
+            message.erase(message.find_last_not_of("\n") + 1);
+            appendStatus(state, "Failed: " + inputs[i] + ": " + message + "\n");
+        }
+    }
+
+    updateResultSummary(state, std::to_string(selected.size() - failed) + " of " + std::to_string(selected.size()) +
+                                   " files");
+    std::stringstream batch;
+    batch << std::fixed << std::setprecision(2);
+    batch << "Batch: " << selected.size() << " files on " << threads << " threads, " << failed << " failed, "
+          << seconds << " s (" << jobSeconds << " s of file processing)\n";
+    if (shardCount > 0) {
+        batch << "Shard " << shard << "/" << shardCount << ": " << selected.size() << " of " << inputs.size()
+              << " listed files\n";
+    }
+    size_t chunks = 0;
+    for (const auto& split : splits) {
+        chunks += split->chunks.size();
+    }
+    batch << "Scheduler: " << tasks.size() << " tasks; " << splits.size() << " files split into " << chunks
+          << " chunks, " << groupedFiles << " small files in " << groups << " groups\n";
+    for (size_t w = 0; w < workers.size(); ++w) {
+        batch << "  Worker " << w + 1 << ": busy " << workers[w].busySeconds << " s, idle "
+              << workers[w].idleSeconds << " s, " << workers[w].tasks << " tasks, " << workers[w].stolen
+              << " stolen\n";
+    }
+    state.resultSummary += batch.str();
+    state.processingComplete = failed == 0;
+}
+
+// Manifest mode: a list of jobs, each with its own input, outputs, percentage,
+// variants and seed, run concurrently in one process. A job is one line of the
+// manifest, either a JSON object such as
+//   {"input": "a.txt", "output": "a.out", "midi": "a.mid", "pct": 50, "variants": ["STTM2m", "TTSM2m2M"], "seed": 7}
+// or tab-separated columns in the order input, output, midi, pct, variants,
+// seed, labels, with the variants separated by commas. Blank lines, lines
+// starting with # and a TSV header line starting with "input" are skipped.
+
+// Quote a string for a JSON document
+std::string jsonQuote(std::string_view text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        switch (c) {
+        case '"': quoted += "\\\""; break;
+        case '\\': quoted += "\\\\"; break;
+        case '\n': quoted += "\\n"; break;
+        case '\r': quoted += "\\r"; break;
+        case '\t': quoted += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned char>(c));
+                quoted += escape;
+            } else {
+                quoted += c;
+            }
+        }
+    }
+    return quoted + "\"";
+}
+
+// The members of a flat JSON object as strings: numbers and literals as written,
+// null as empty, and arrays of strings or numbers joined with commas
+bool parseJsonObjectLine(std::string_view text, std::map<std::string, std::string>& fields, std::string& error) {
+    size_t at = 0;
+    auto skipSpace = [&]() {
+        while (at < text.size() && std::isspace(static_cast<unsigned char>(text[at]))) at++;
+    };
+    auto parseString = [&](std::string& value) {
+        value.clear();
+        if (at >= text.size() || text[at] != '"') {
+            return false;
+        }
+        for (at++; at < text.size() && text[at] != '"'; at++) {
+            if (text[at] != '\\') {
+                value += text[at];
+                continue;
+            }
+            if (++at >= text.size()) {
+                return false;
+            }
+            switch (text[at]) {
+            case 'n': value += '\n'; break;
+            case 'r': value += '\r'; break;
+            case 't': value += '\t'; break;
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'u': {
+                unsigned code = 0;
+                if (at + 4 >= text.size() ||
+                    std::sscanf(std::string(text.substr(at + 1, 4)).c_str(), "%4x", &code) != 1) {
+                    return false;
+                }
+                at += 4;
+                // UTF-8; surrogate pairs are not combined
+                if (code < 0x80) {
+                    value += static_cast<char>(code);
+                } else if (code < 0x800) {
+                    value += static_cast<char>(0xC0 | code >> 6);
+                    value += static_cast<char>(0x80 | (code & 0x3F));
+                } else {
+                    value += static_cast<char>(0xE0 | code >> 12);
+                    value += static_cast<char>(0x80 | (code >> 6 & 0x3F));
+                    value += static_cast<char>(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default: value += text[at]; break;
+            }
+        }
+        if (at >= text.size()) {
+            return false;
+        }
+        at++;
+        return true;
+    };
+    auto parseScalar = [&](std::string& value) {
+        skipSpace();
+        if (at < text.size() && text[at] == '"') {
+            return parseString(value);
+        }
+        size_t start = at;
+        while (at < text.size() && (std::isalnum(static_cast<unsigned char>(text[at])) || text[at] == '-' ||
+                                    text[at] == '+' || text[at] == '.')) {
+            at++;
+        }
+        value.assign(text.substr(start, at - start));
+        if (value == "null") {
+            value.clear();
+        }
+        return at > start;
+    };
+
+    skipSpace();
+    if (at >= text.size() || text[at++] != '{') {
+        error = "expected a JSON object";
+        return false;
+    }
+    skipSpace();
+    if (at < text.size() && text[at] == '}') {
+        at++;
+    } else {
+        for (;;) {
+            std::string key, value;
+            skipSpace();
+            if (!parseString(key)) {
+                error = "expected a member name";
+                return false;
+            }
+            skipSpace();
+            if (at >= text.size() || text[at++] != ':') {
+                error = "expected ':' after \"" + key + "\"";
+                return false;
+            }
+            skipSpace();
+            if (at < text.size() && text[at] == '[') {
+                at++;
+                skipSpace();
+                if (at < text.size() && text[at] == ']') {
+                    at++;
+                } else {
+                    for (;;) {
+                        std::string item;
+                        if (!parseScalar(item)) {
+                            error = "bad array element in \"" + key + "\"";
+                            return false;
+                        }
+                        value += (value.empty() ? "" : ",") + item;
+                        skipSpace();
+                        if (at < text.size() && text[at] == ',') {
+                            at++;
+                        } else if (at < text.size() && text[at] == ']') {
+                            at++;
+                            break;
+                        } else {
+                            error = "expected ',' or ']' in \"" + key + "\"";
+                            return false;
+                        }
+                    }
+                }
+            } else if (!parseScalar(value)) {
+                error = "bad value for \"" + key + "\"";
+                return false;
+            }
+            fields[key] = value;
+            skipSpace();
+            if (at < text.size() && text[at] == ',') {
+                at++;
+            } else if (at < text.size() && text[at] == '}') {
+                at++;
+                break;
+            } else {
+                error = "expected ',' or '}'";
+                return false;
+            }
+        }
+    }
+    skipSpace();
+    if (at != text.size()) {
+        error = "unexpected text after the object";
+        return false;
+    }
+    return true;
+}
+
+// One job of a manifest
+struct ManifestJob {
+    size_t line = 0;
+    std::string input;
+    std::string output;
+    std::string midi;
+    std::string labels;
+    double percentage = 50.0;
+    std::vector<std::string> variants;
+    bool seeded = false;
+    uint64_t seed = 0;
+    std::string id;                                           // Names the job for cancel requests
+    JobPriority priority = PRIORITY_NORMAL;
+    double deadlineSeconds = 0;                               // From submission; 0 for none
+    std::string error;                                        // Why the job cannot run
+    std::shared_ptr<const VariantPool> variantPool;
+    std::shared_ptr<const std::vector<std::string>> labelTable;
+    std::shared_ptr<CancellationToken> token = std::make_shared<CancellationToken>();
+};
+
+// Fill in a job from the fields of a manifest line
+void readManifestJob(std::map<std::string, std::string>& fields, ManifestJob& job) {
+    if (fields.count("percentage") != 0 && fields.count("pct") == 0) {
+        fields["pct"] = fields["percentage"];
+    }
+    job.input = fields["input"];
+    job.output = fields["output"];
+    job.midi = fields["midi"];
+    job.labels = fields["labels"];
+    job.id = fields["id"];
+    if (!fields["priority"].empty() && !parseJobPriority(fields["priority"], job.priority)) {
+        job.error = "Unknown priority: " + fields["priority"];
+    }
+    std::stringstream variants(fields["variants"]);
+    std::string variant;
+    while (std::getline(variants, variant, ',')) {
+        variant.erase(0, variant.find_first_not_of(" \t"));
+        variant.erase(variant.find_last_not_of(" \t") + 1);
+        if (!variant.empty()) {
+            job.variants.push_back(variant);
+        }
+    }
+    if (job.variants.empty()) {
+        job.variants.push_back("RANDOM");
+    }
+    try {
+        if (!fields["pct"].empty()) {
+            job.percentage = std::stod(fields["pct"]);
+        }
+        if (!fields["seed"].empty()) {
+            job.seed = std::stoull(fields["seed"]);
+            job.seeded = true;
+        }
+        if (!fields["deadline_ms"].empty()) {
+            job.deadlineSeconds = std::stod(fields["deadline_ms"]) / 1000.0;
+        }
+    } catch (const std::exception&) {
+        job.error = "Invalid pct, seed or deadline_ms";
+    }
+    if (job.error.empty() && job.input.empty()) {
+        job.error = "No input";
+    } else if (job.error.empty() && job.output.empty() && job.midi.empty()) {
+        job.error = "No output or midi";
+    }
+}
+
+// Read one manifest line into job; false for lines that hold no job
+bool parseManifestLine(std::string_view line, ManifestJob& job) {
+    while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+        line.remove_suffix(1);
+    }
+    size_t first = line.find_first_not_of(" \t");
+    if (first == std::string_view::npos || line[first] == '#') {
+        return false;
+    }
+
+    std::map<std::string, std::string> fields;
+    if (line[first] == '{') {
+        if (!parseJsonObjectLine(line, fields, job.error)) {
+            job.error = "Invalid JSON: " + job.error;
+            return true;
+        }
+    } else {
+        static const char* const columns[] = {"input",  "output", "midi",     "pct",        "variants",
+                                              "seed",   "labels", "priority", "deadline_ms"};
+        size_t column = 0;
+        for (size_t start = 0; start <= line.size() && column < std::size(columns); ++column) {
+            size_t tab = std::min(line.find('\t', start), line.size());
+            fields[columns[column]] = std::string(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        if (fields["input"] == "input") {
+            return false; // Header line
+        }
+    }
+    readManifestJob(fields, job);
+    return true;
+}
+
+// Variant pools and label tables resolved for jobs, each shared by every job
+// with the same variant selection or label file
+struct JobCatalog {
+    std::mutex lock;
+    std::map<std::vector<std::string>, std::shared_ptr<const VariantPool>> variantPools;
+    std::map<std::string, std::shared_ptr<const std::vector<std::string>>> labelTables;
+};
+
+// Give a job its variant pool and label table from the catalog, resolving them
+// on first use; a job that cannot have them gets an error instead
+void resolveJobResources(ManifestJob& job, JobCatalog& catalog) {
+    if (!job.error.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(catalog.lock);
+    auto& pool = catalog.variantPools[job.variants];
+    if (!pool) {
+        pool = resolveVariantPool(job.variants);
+    }
+    job.variantPool = pool;
+    if (!pool->unknown.empty()) {
+        job.error = "Unknown slide variant: " + pool->unknown[0];
+        return;
+    }
+    if (job.labels.empty()) {
+        return;
+    }
+    auto found = catalog.labelTables.find(job.labels);
+    if (found == catalog.labelTables.end()) {
+        std::ifstream labelInput(job.labels);
+        if (!labelInput.is_open()) {
+            job.error = "Error opening label file: " + job.labels;
+            return;
+        }
+        auto labels = std::make_shared<std::vector<std::string>>();
+        for (std::string label; std::getline(labelInput, label);) {
+            label.erase(label.find_last_not_of(" \t\r\n") + 1);
+            labels->push_back(std::move(label));
+        }
+        found = catalog.labelTables.emplace(job.labels, std::move(labels)).first;
+    }
+    job.labelTable = found->second;
+}
+
+// The options of state with the job's own percentage, variants, labels and seed
+AppState manifestJobOptions(const ManifestJob& job, const AppState& state) {
+    AppState options = state;
+    options.transformationPercentage = job.percentage;
+    options.selectedVariants = job.variants;
+    options.variantPool = job.variantPool;
+    options.labelFile = job.labels;
+    options.labelTable = job.labelTable;
+    options.seeded = job.seeded;
+    options.seed = job.seed;
+    options.cancellation = job.token;
+    return options;
+}
+
+// Run one resolved job with the other options of state
+BatchJobResult runManifestJob(const ManifestJob& job, const AppState& state) {
+    if (!job.error.empty()) {
+        BatchJobResult outcome;
+        outcome.message = job.error;
+        return outcome;
+    }
+    return runBatchJob(job.input, job.output, job.midi, manifestJobOptions(job, state));
+}
+
+// Start the clock of a job's deadline_ms, if it has one
+void setJobDeadline(ManifestJob& job, std::chrono::steady_clock::time_point submitted) {
+    if (job.deadlineSeconds > 0) {
+        job.token->hasDeadline = true;
+        job.token->deadline = submitted + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                              std::chrono::duration<double>(job.deadlineSeconds));
+    }
+}
+
+// The JSON result line of a job
+std::string manifestResultJson(const ManifestJob& job, const BatchJobResult& outcome, double waitSeconds) {
+    std::stringstream record;
+    record << std::fixed << std::setprecision(3);
+    record << "{\"line\":" << job.line << ",\"input\":" << jsonQuote(job.input)
+           << ",\"status\":" << (outcome.ok ? "\"ok\"" : outcome.cancelled ? "\"cancelled\"" : "\"failed\"")
+           << ",\"priority\":\"" << JOB_PRIORITY_NAMES[job.priority] << "\"";
+    if (!job.id.empty()) {
+        record << ",\"id\":" << jsonQuote(job.id);
+    }
+    record << ",\"eligible\":" << outcome.stats.eligible << ",\"transformed\":" << outcome.stats.transformed
+           << ",\"variants\":{";
+    const char* separator = "";
+    for (const auto& [variant, count] : outcome.stats.variants) {
+        record << separator << jsonQuote(variant) << ":" << count;
+        separator = ",";
+    }
+    std::string message = outcome.message;
+    message.erase(message.find_last_not_of("\n") + 1);
+    record << "},\"wait_seconds\":" << waitSeconds << ",\"seconds\":" << outcome.seconds
+           << ",\"message\":" << jsonQuote(message) << "}\n";
+    return record.str();
+}
+
+// Run the jobs of a manifest on a priority queue of state.workerThreads
+// threads, with the other options of state, and write one JSON result line per
+// job to results as each one finishes. Interactive jobs start before normal ones
+// and normal ones before bulk ones; a job's deadline_ms counts from the start of
+// the run, and a job past it stops (or never starts) with status "cancelled".
+// Jobs with the same variant selection share one resolved variant pool, and jobs
+// with the same label file one label table. The totals of all jobs are left in
+// state and described in resultSummary, and the queue wait and service time
+// histograms of each priority class are written to latencyFile unless it is empty.
+void runManifest(const std::string& manifestPath, std::ostream& results, AppState& state,
+                 const std::string& latencyFile) {
+    state.statusMessage.clear();
+    std::ifstream file;
+    if (!isStandardStream(manifestPath)) {
+        file.open(manifestPath);
+        if (!file.is_open()) {
+            state.statusMessage = "Error opening manifest: " + manifestPath + "\n";
+            return;
+        }
+    }
+    std::istream& manifest = isStandardStream(manifestPath) ? std::cin : file;
+
+    std::vector<ManifestJob> jobs;
+    std::string line;
+    for (size_t number = 1; std::getline(manifest, line); ++number) {
+        ManifestJob job;
+        job.percentage = state.transformationPercentage;
+        if (parseManifestLine(line, job)) {
+            job.line = number;
+            jobs.push_back(std::move(job));
+        }
+    }
+
+    // Resolve each distinct variant selection and label file once
+    JobCatalog catalog;
+    for (ManifestJob& job : jobs) {
+        resolveJobResources(job, catalog);
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    const size_t threads = workerThreadCount(state, jobs.size());
+    std::vector<BatchJobResult> outcomes(jobs.size());
+    std::mutex resultsLock;
+    PriorityJobQueue queue(threads);
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        setJobDeadline(jobs[j], started);
+        queue.submit(jobs[j].priority, jobs[j].token, [&, j](double waitSeconds, const char* dropped) {
+            const ManifestJob& job = jobs[j];
+            BatchJobResult& outcome = outcomes[j];
+            if (dropped && job.error.empty()) {
+                outcome.cancelled = true;
+                outcome.message = std::string("Cancelled: ") + dropped + " before starting";
+            } else {
+                outcome = runManifestJob(job, state);
+            }
+            std::string record = manifestResultJson(job, outcome, waitSeconds);
+            std::lock_guard<std::mutex> lock(resultsLock);
+            results << record << std::flush;
+            return outcome.cancelled;
+        });
+    }
+    queue.wait();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    resetStatistics(state);
+    size_t failed = 0;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        const BatchJobResult& outcome = outcomes[j];
+        addStats(state, outcome.stats);
+        failed += outcome.ok ? 0 : 1;
+    }
+    // The summary lists the variants the jobs used, with their counts
+    state.selectedVariants.clear();
+    for (const auto& [variant, count] : state.variantUsageCount) {
+        state.selectedVariants.push_back(variant);
+    }
+    updateResultSummary(state, std::to_string(jobs.size() - failed) + " of " + std::to_string(jobs.size()) + " jobs");
+    std::stringstream summary;
+    summary << std::fixed << std::setprecision(2);
+    summary << "Manifest: " << jobs.size() << " jobs on " << threads << " threads, " << failed << " failed, "
+            << seconds << " s; " << catalog.variantPools.size() << " variant selection(s) and "
+            << catalog.labelTables.size() << " label table(s) resolved for all jobs\n"
+            << describeQueueLatency(queue);
+    state.resultSummary += summary.str();
+    state.processingComplete = failed == 0;
+    std::string error;
+    if (!latencyFile.empty() && !writeQueueLatencyFile(latencyFile, queue, error)) {
+        state.statusMessage += error + "\n";
+        state.processingComplete = false;
+    }
+}
+
+// Sharding: one run's part of a job split across machines. A single text file
+// is split into shardCount line ranges of about equal size; shard i (from 1)
+// transforms the lines starting in [size * (i - 1) / count, size * i / count),
+// each bound moved to the start of the next line. Only shard 1 writes the header
+// row, so the shard outputs joined in shard order are the output of the whole
+// file. Shards need a seed (state.seeded) so that every note gets the choices it
+// gets in a single run.
+void processFileShard(const std::string& inputFile, const std::string& outputFile, int shard, int shardCount,
+                      AppState& state) {
+    state.statusMessage.clear();
+    if (!state.seeded) {
+        state.statusMessage = "Error: --shard needs --seed so the shards make the choices of a single run";
+        return;
+    }
+    if (isStandardStream(inputFile) || isMidiFile(inputFile) || isSnbPath(outputFile) || outputFile.empty() ||
+        !state.selectedTracks.empty()) {
+        state.statusMessage = "Error: a single file is sharded by lines: a text input file to a text output, "
+                              "without --tracks";
+        return;
+    }
+    MappedFile input;
+    OutputDestination destination;
+    if (!input.open(inputFile) || !destination.open(outputFile, false)) {
+        state.statusMessage = "Error opening files.";
+        return;
+    }
+    std::ostream& output = destination.stream();
+
+    const uint64_t size = input.size;
+    size_t begin = shard == 1 ? 0 : nextLineStart(input.data, input.size, size * (shard - 1) / shardCount);
+    size_t end = shard == shardCount ? input.size : nextLineStart(input.data, input.size, size * shard / shardCount);
+    begin = std::min(begin, end);
+
+    resetStatistics(state);
+    state.notePosition = std::count(input.data, input.data + begin, '\n');
+    const uint64_t firstLine = state.notePosition;
+    TextOutputSink textSink(output, shard == 1);
+    std::string line;
+    try {
+        forEachLineInRange(input.data, begin, end, [&](std::string_view text) {
+            line.assign(text);
+            transformLine(line, state, textSink);
+        });
+    } catch (const JobCancelled& cancelled) {
+        destination.close();
+        reportCancelled(state, cancelled, {outputFile});
+        return;
+    }
+
+    destination.close();
+    if (!output) {
+        state.statusMessage += "Error writing output: " + outputFile;
+        return;
+    }
+    updateResultSummary(state, isStandardStream(outputFile) ? "stdout" : outputFile);
+    state.resultSummary += "Shard " + std::to_string(shard) + "/" + std::to_string(shardCount) + ": lines " +
+                           std::to_string(firstLine + 1) + "-" + std::to_string(state.notePosition) + ", bytes " +
+                           std::to_string(begin) + "-" + std::to_string(end) + " of " + std::to_string(size) + "\n";
+    state.statusMessage += "Processing complete!";
+    state.processingComplete = true;
+}
+
+
+// Statistics records on disk. The binary form is a fixed header followed by
+// the histogram entries; records can be concatenated into one file and are read
+// back one after another. Records from any host merge, so the layout is fixed:
+// integers are little-endian (the .snb host check above enforces it) and the
+// header has no padding. The JSON form is one line for dashboards and scripts,
+// with the same version number:
+//   {"version":1,"runs":1,"eligible":2,"transformed":1,"variants":{"STTM2m":1},
+//    "labels":{"SAN":[2,1]},"tracks":{"1":[3,1]}}
+// where labels and tracks hold [notes, transformed notes].
+const char STATS_RECORD_MAGIC[4] = {'S', 'S', 'T', 'R'};
+const uint32_t STATS_RECORD_VERSION = 1;
+
+struct StatsRecordHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t runs;
+    uint64_t eligible;
+    uint64_t transformed;
+    uint32_t variantCount;
+    uint32_t labelCount;
+    uint32_t trackCount;
+    uint32_t bodyBytes;      // Size of the entries that follow
+};
+static_assert(sizeof(StatsRecordHeader) == 48, "StatsRecordHeader must keep its on-disk size");
+
+// Entries: variants as (uint16 name length, name, uint64 count), labels as
+// (uint16 name length, name, uint64 notes, uint64 transformed), tracks as
+// (int32 track, uint64 notes, uint64 transformed)
+bool writeStatsRecord(std::ostream& output, const StatsRecord& stats) {
+    std::string body;
+    auto put = [&](const auto& value) { body.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    auto putName = [&](const std::string& name) {
+        uint16_t length = static_cast<uint16_t>(std::min<size_t>(name.size(), UINT16_MAX));
+        put(length);
+        body.append(name, 0, length);
+    };
+    for (const auto& [variant, count] : stats.variants) {
+        putName(variant);
+        put(count);
+    }
+    for (const auto& [label, counts] : stats.labels) {
+        putName(label);
+        put(counts.first);
+        put(counts.second);
+    }
+    for (const auto& [track, counts] : stats.tracks) {
+        put(static_cast<int32_t>(track));
+        put(counts.first);
+        put(counts.second);
+    }
+
+    StatsRecordHeader header = {};
+    std::memcpy(header.magic, STATS_RECORD_MAGIC, 4);
+    header.version = STATS_RECORD_VERSION;
+    header.runs = stats.runs;
+    header.eligible = stats.eligible;
+    header.transformed = stats.transformed;
+    header.variantCount = static_cast<uint32_t>(stats.variants.size());
+    header.labelCount = static_cast<uint32_t>(stats.labels.size());
+    header.trackCount = static_cast<uint32_t>(stats.tracks.size());
+    header.bodyBytes = static_cast<uint32_t>(body.size());
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(body.data(), body.size());
+    return static_cast<bool>(output);
+}
+
+// Read the next binary record and merge it into stats. Returns false at the end
+// of the input, with error set if the input ended in the middle of a record or
+// holds something else.
+bool readStatsRecord(std::istream& input, StatsRecord& stats, std::string& body, std::string& error) {
+    StatsRecordHeader header;
+    if (!input.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        if (input.gcount() != 0) {
+            error = "truncated record header";
+        }
+        return false;
+    }
+    if (std::memcmp(header.magic, STATS_RECORD_MAGIC, 4) != 0 || header.version != STATS_RECORD_VERSION) {
+        error = "not a statistics record";
+        return false;
+    }
+    body.resize(header.bodyBytes);
+    if (!input.read(&body[0], header.bodyBytes)) {
+        error = "truncated record";
+        return false;
+    }
+
+    size_t at = 0;
+    auto get = [&](auto& value) {
+        if (body.size() - at < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, body.data() + at, sizeof(value));
+        at += sizeof(value);
+        return true;
+    };
+    std::string name;
+    auto getName = [&]() {
+        uint16_t length;
+        if (!get(length) || body.size() - at < length) {
+            return false;
+        }
+        name.assign(body, at, length);
+        at += length;
+        return true;
+    };
+    stats.runs += header.runs;
+    stats.eligible += header.eligible;
+    stats.transformed += header.transformed;
+    for (uint32_t i = 0; i < header.variantCount; ++i) {
+        uint64_t count;
+        if (!getName() || !get(count)) {
+            error = "corrupt variant entry";
+            return false;
+        }
+        stats.variants[name] += count;
+    }
+    for (uint32_t i = 0; i < header.labelCount; ++i) {
+        uint64_t notes, transformed;
+        if (!getName() || !get(notes) || !get(transformed)) {
+            error = "corrupt label entry";
+            return false;
+        }
+        auto& counts = stats.labels[name];
+        counts.first += notes;
+        counts.second += transformed;
+    }
+    for (uint32_t i = 0; i < header.trackCount; ++i) {
+        int32_t track;
+        uint64_t notes, transformed;
+        if (!get(track) || !get(notes) || !get(transformed)) {
+            error = "corrupt track entry";
+            return false;
+        }
+        auto& counts = stats.tracks[track];
+        counts.first += notes;
+        counts.second += transformed;
+    }
+    if (at != body.size()) {
+        error = "corrupt record";
+        return false;
+    }
+    return true;
+}
+
+void writeStatsJson(std::ostream& output, const StatsRecord& stats) {
+    output << "{\"version\":" << STATS_RECORD_VERSION << ",\"runs\":" << stats.runs << ",\"eligible\":" << stats.eligible
+           << ",\"transformed\":" << stats.transformed << ",\"variants\":{";
+    const char* separator = "";
+    for (const auto& [variant, count] : stats.variants) {
+        output << separator << jsonQuote(variant) << ":" << count;
+        separator = ",";
+    }
+    output << "},\"labels\":{";
+    separator = "";
+    for (const auto& [label, counts] : stats.labels) {
+        output << separator << jsonQuote(label) << ":[" << counts.first << "," << counts.second << "]";
+        separator = ",";
+    }
+    output << "},\"tracks\":{";
+    separator = "";
+    for (const auto& [track, counts] : stats.tracks) {
+        output << separator << "\"" << track << "\":[" << counts.first << "," << counts.second << "]";
+        separator = ",";
+    }
+    output << "}}\n";
+}
+
+// Write a statistics record: JSON when the path ends in .json or is "-"
+// (stdout), the binary form otherwise
+bool writeStatsRecordFile(const std::string& path, const StatsRecord& stats, std::string& error) {
+    const bool json = isStandardStream(path) ||
+                      (path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0);
+    if (isStandardStream(path)) {
+        writeStatsJson(std::cout, stats);
+        return static_cast<bool>(std::cout.flush());
+    }
+    std::ofstream file(path, json ? std::ios::out : std::ios::binary);
+    if (!file.is_open()) {
+        error = "Error opening statistics file: " + path;
+        return false;
+    }
+    if (json) {
+        writeStatsJson(file, stats);
+    } else {
+        writeStatsRecord(file, stats);
+    }
+    file.close();
+    if (!file) {
+        error = "Error writing statistics file: " + path;
+        return false;
+    }
+    return true;
+}
+
+// Write the statistics of the last run in state as a record of one run
+bool writeStatsFile(const std::string& path, const AppState& state, std::string& error) {
+    return writeStatsRecordFile(path, statsOf(state), error);
+}
+
+// Merge binary statistics records into one, reading each input once from start
+// to end ("-" is stdin); a file may hold many concatenated records. Inputs that
+// cannot be read are reported and left out. The merged record is written to
+// outputFile and described in resultSummary.
+void mergeStatsFiles(const std::vector<std::string>& inputs, const std::string& outputFile, AppState& state) {
+    auto started = std::chrono::steady_clock::now();
+    state.statusMessage.clear();
+    StatsRecord total;
+    std::string body;
+    uint64_t records = 0;
+    size_t failed = 0;
+    for (const std::string& input : inputs) {
+        std::ifstream file;
+        if (!isStandardStream(input)) {
+            file.open(input, std::ios::binary);
+        }
+        std::istream& stream = isStandardStream(input) ? std::cin : file;
+        if (!isStandardStream(input) && !file.is_open()) {
+            appendStatus(state, "Error opening statistics file: " + input + "\n");
+            failed++;
+            continue;
+        }
+        // Merge into a copy of the file's records first, so a corrupt file adds nothing
+        StatsRecord fileStats;
+        uint64_t fileRecords = 0;
+        std::string error;
+        while (readStatsRecord(stream, fileStats, body, error)) {
+            fileRecords++;
+        }
+        if (!error.empty() || fileRecords == 0) {
+            appendStatus(state, "Error reading statistics file " + input + ": " +
+                                (error.empty() ? std::string("no records") : error) + "\n");
+            failed++;
+            continue;
+        }
+        total.merge(fileStats);
+        records += fileRecords;
+    }
+
+    std::string error;
+    if (!writeStatsRecordFile(outputFile, total, error)) {
+        appendStatus(state, error + "\n");
+        return;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::stringstream summary;
+    summary << std::fixed << std::setprecision(1);
+    summary << "Merged " << records << " records from " << inputs.size() - failed << " of " << inputs.size()
+            << " files in " << seconds * 1000 << " ms into " << (isStandardStream(outputFile) ? "stdout" : outputFile)
+            << "\n"
+            << total.runs << " runs: " << total.eligible << " eligible notes, " << total.transformed
+            << " transformed (" << (total.eligible > 0 ? 100.0 * total.transformed / total.eligible : 0.0) << "%); "
+            << total.variants.size() << " variants, " << total.labels.size() << " labels, " << total.tracks.size()
+            << " tracks\n";
+    state.resultSummary = summary.str();
+    state.processingComplete = failed == 0;
+}
+
+// Result cache: finished runs kept under state.resultCacheDirectory and found
+// again by their inputs. The key is a 128-bit hash of the input bytes together
+// with every option that changes the outputs: percentage, resolved variant
+// pool, seed, selected tracks, label file contents, which outputs are written
+// and their encoding. Only seeded runs are cached; without a seed the choices
+// come from rand() and a run is not meant to repeat. Each entry is a directory
+// named by its key holding the outputs ("text", "midi"), the statistics record
+// of the run ("stats") and the size and hash of each output ("entry"), which
+// are checked before an entry is used. A hit is placed at the output paths as a
+// reflink where the file system has them, else as a hard link, else as a copy.
+// An entry's modification time is its last use; once the entries pass
+// state.resultCacheBudget bytes, the least recently used ones are removed.
+const char* const RESULT_CACHE_VERSION = "slides-result-cache 1";
+
+struct CachedOutput {
+    const char* name;          // File name in the entry
+    const std::string* path;   // Output path of the run
+};
+
+// Hash of a whole file; false if it cannot be read
+bool hashFile(const std::string& path, uint64_t& size, uint64_t& hash) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    size = file.size;
+    hash = hashBytes(file.data, file.size, 0);
+    return true;
+}
+
+// Every option of a seeded run that changes its outputs, as text: false when
+// the variant selection or the label file is not usable
+bool describeRunOptions(AppState& state, const std::string& textOutputFile, const std::string& midiOutputFile,
+                        std::string& description) {
+    if (!state.variantPool || state.variantPool->selection != state.selectedVariants) {
+        state.variantPool = resolveVariantPool(state.selectedVariants);
+    }
+    if (!state.variantPool->unknown.empty()) {
+        return false;
+    }
+
+    std::stringstream options;
+    options << RESULT_CACHE_VERSION << "\npct " << std::hexfloat << state.transformationPercentage << std::dec
+            << "\nseed " << state.seed << "\nvariants";
+    for (const std::string& variant : state.variantPool->variants) {
+        options << ' ' << variant;
+    }
+    options << "\ntracks";
+    for (int track : state.selectedTracks) {
+        options << ' ' << track;
+    }
+    options << "\ntext " << (textOutputFile.empty() ? "none" : isSnbPath(textOutputFile) ? "snb" : "rows")
+            << "\nmidi ";
+    if (midiOutputFile.empty()) {
+        options << "none";
+    } else {
+        options << "format " << state.midiFormat << (state.compactMidi ? " compact" : "");
+    }
+    uint64_t size, hash;
+    if (!state.labelFile.empty()) {
+        if (!hashFile(state.labelFile, size, hash)) {
+            return false;
+        }
+        options << "\nlabels " << size << ' ' << hash;
+    }
+    description = options.str();
+    return true;
+}
+
+// The cache key of a run, or false for a run that is not cached
+bool resultCacheKey(const std::string& inputFile, const std::string& textOutputFile,
+                    const std::string& midiOutputFile, AppState& state, std::string& key) {
+    std::string text;
+    MappedFile input;
+    if (state.resultCacheDirectory.empty() || !state.seeded || isStandardStream(inputFile) ||
+        isStandardStream(textOutputFile) || !describeRunOptions(state, textOutputFile, midiOutputFile, text) ||
+        !input.open(inputFile)) {
+        return false;
+    }
+    const uint64_t optionsHash = hashBytes(text.data(), text.size(), 0);
+    const uint64_t high = hashBytes(input.data, input.size, optionsHash);
+    const uint64_t low = hashBytes(input.data, input.size, optionsHash ^ 0x9E3779B97F4A7C15ULL);
+    char digits[33];
+    std::snprintf(digits, sizeof(digits), "%016llx%016llx", static_cast<unsigned long long>(high),
+                  static_cast<unsigned long long>(low));
+    key = digits;
+    return true;
+}
+
+// Make target a copy of source that shares its blocks, where the file system can
+bool reflinkFile(const std::string& source, const std::string& target) {
+#ifdef FICLONE
+    int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool cloned = out >= 0 && ::ioctl(out, FICLONE, in) == 0;
+    ::close(in);
+    if (out >= 0) {
+        ::close(out);
+        if (!cloned) {
+            ::unlink(target.c_str());
+        }
+    }
+    return cloned;
+#else
+    return false;
+#endif
+}
+
+// Put a cached file at target by reflink, hard link or copy, the first that
+// works; the file is made next to target and renamed over it. method is set to
+// the way it was placed.
+bool placeCachedFile(const std::string& source, const std::string& target, const char*& method) {
+    const std::string temporaryFile = target + ".tmp";
+    std::error_code error;
+    std::filesystem::remove(temporaryFile, error);
+    if (reflinkFile(source, temporaryFile)) {
+        method = "reflink";
+    } else if (std::filesystem::create_hard_link(source, temporaryFile, error), !error) {
+        method = "hard link";
+    } else if (std::filesystem::copy_file(source, temporaryFile, error), !error) {
+        method = "copy";
+    } else {
+        return false;
+    }
+    std::filesystem::rename(temporaryFile, target, error);
+    std::error_code ignored;
+    std::filesystem::remove(temporaryFile, ignored); // Left behind when target already was that file
+    return !error;
+}
+
+// Serve a run from the result cache. Returns true, with the outputs in place
+// and state as after the run, on a hit; otherwise key is the run's cache key,
+// or empty for a run that is not cached.
+bool serveCachedResult(const std::string& inputFile, const std::string& textOutputFile,
+                       const std::string& midiOutputFile, AppState& state, std::string& key) {
+    key.clear();
+    if (!resultCacheKey(inputFile, textOutputFile, midiOutputFile, state, key)) {
+        key.clear();
+        return false;
+    }
+    const std::filesystem::path entry = std::filesystem::path(state.resultCacheDirectory) / key;
+    std::ifstream listing(entry / "entry");
+    std::ifstream statsFile(entry / "stats", std::ios::binary);
+    StatsRecord stats;
+    std::string body, error;
+    if (!listing.is_open() || !statsFile.is_open() || !readStatsRecord(statsFile, stats, body, error)) {
+        return false;
+    }
+
+    // Check every output against its listed size and hash; an entry changed on
+    // disk, say through a hard link to an output that was rewritten, is dropped
+    const CachedOutput outputs[] = {{"text", &textOutputFile}, {"midi", &midiOutputFile}};
+    std::map<std::string, std::pair<uint64_t, uint64_t>> listed;
+    std::string name;
+    uint64_t size, hash;
+    while (listing >> name >> size >> std::hex >> hash >> std::dec) {
+        listed[name] = {size, hash};
+    }
+    for (const CachedOutput& output : outputs) {
+        auto found = listed.find(output.name);
+        if (output.path->empty()) {
+            continue;
+        }
+        if (found == listed.end() || !hashFile((entry / output.name).string(), size, hash) ||
+            std::make_pair(size, hash) != found->second) {
+            std::error_code ignored;
+            std::filesystem::remove_all(entry, ignored);
+            return false;
+        }
+    }
+
+    const char* method = "copy";
+    for (const CachedOutput& output : outputs) {
+        if (!output.path->empty() && !placeCachedFile((entry / output.name).string(), *output.path, method)) {
+            return false;
+        }
+    }
+    std::error_code ignored;
+    std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ignored);
+
+    resetStatistics(state);
+    addStats(state, stats);
+    state.statusMessage = "Result cache hit: " + key + " (" + method + ")\nProcessing complete!";
+    if (midiOutputFile.empty()) {
+        updateResultSummary(state, textOutputFile);
+        state.processingComplete = true;
+    } else {
+        updateResultSummary(state, textOutputFile.empty() ? midiOutputFile : textOutputFile + " and " + midiOutputFile);
+        state.statusMessage += "\nMIDI file created successfully: " + midiOutputFile + "\n";
+        state.processingComplete = !textOutputFile.empty();
+    }
+    return true;
+}
+
+// Remove the least recently used entries until the cache fits in budget bytes,
+// and entries left half made for over an hour
+void trimResultCache(const std::string& directory, uint64_t budget) {
+    struct Entry {
+        std::filesystem::file_time_type used;
+        uint64_t bytes;
+        std::filesystem::path path;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    const auto now = std::filesystem::file_time_type::clock::now();
+    std::error_code error;
+    for (const auto& item : std::filesystem::directory_iterator(directory, error)) {
+        std::error_code ignored;
+        Entry entry{item.last_write_time(ignored), 0, item.path()};
+        if (!item.is_directory(ignored)) {
+            continue;
+        }
+        if (entry.path.filename().string().find('.') != std::string::npos) {
+            if (now - entry.used > std::chrono::hours(1)) {
+                std::filesystem::remove_all(entry.path, ignored);
+            }
+            continue;
+        }
+        for (const auto& file : std::filesystem::directory_iterator(entry.path, ignored)) {
+            std::error_code unknown;
+            uint64_t size = file.file_size(unknown);
+            entry.bytes += unknown ? 0 : size;
+        }
+        total += entry.bytes;
+        entries.push_back(std::move(entry));
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (size_t i = 0; i < entries.size() && total > budget; ++i) {
+        std::error_code ignored;
+        std::filesystem::remove_all(entries[i].path, ignored);
+        total -= entries[i].bytes;
+    }
+}
+
+// Keep the outputs of a finished run under its cache key. The outputs are
+// copied (by reflink where possible), so rewriting them later leaves the entry
+// as it is. The entry is made under a temporary name and renamed into place.
+void storeCachedResult(const std::string& key, const std::string& textOutputFile, const std::string& midiOutputFile,
+                       const AppState& state) {
+    if (key.empty() || state.statusMessage.find("Error") != std::string::npos ||
+        state.statusMessage.find("Cancelled: ") != std::string::npos) {
+        return;
+    }
+    static std::atomic<uint64_t> entriesMade{0};
+    const std::filesystem::path directory(state.resultCacheDirectory);
+    const std::filesystem::path entry = directory / key;
+    const std::filesystem::path temporary =
+        directory / (key + ".tmp" +
+                     std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "-" +
+                     std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "-" +
+                     std::to_string(entriesMade++));
+    std::error_code error;
+    if (std::filesystem::exists(entry, error) || !std::filesystem::create_directories(temporary, error)) {
+        return;
+    }
+
+    std::stringstream listing;
+    const CachedOutput outputs[] = {{"text", &textOutputFile}, {"midi", &midiOutputFile}};
+    bool stored = true;
+    for (const CachedOutput& output : outputs) {
+        if (output.path->empty()) {
+            continue;
+        }
+        const std::string copy = (temporary / output.name).string();
+        uint64_t size, hash;
+        if (!reflinkFile(*output.path, copy)) {
+            std::filesystem::copy_file(*output.path, copy, error);
+        }
+        if (error || !hashFile(copy, size, hash)) {
+            stored = false;
+            break;
+        }
+        listing << output.name << ' ' << size << ' ' << std::hex << hash << std::dec << '\n';
+    }
+    std::string statsError;
+    stored = stored && writeStatsRecordFile((temporary / "stats").string(), statsOf(state), statsError);
+    std::ofstream listingFile(temporary / "entry");
+    listingFile << listing.str();
+    listingFile.close();
+    if (stored && listingFile) {
+        std::filesystem::rename(temporary, entry, error);
+    }
+    if (!stored || !listingFile || error) {
+        std::filesystem::remove_all(temporary, error);
+    }
+    trimResultCache(state.resultCacheDirectory, state.resultCacheBudget);
+}
+
+// Incremental reprocessing: a text input is cut into content-defined chunks of
+// lines, and a chunk whose bytes were in the input of the previous run of the
+// same output reuses that run's rows instead of being transformed again. A
+// line ends a chunk when a hash of it and the line before has its low
+// INCREMENTAL_CHUNK_BITS bits clear, so an edit moves only the boundaries next
+// to it; chunks are kept between INCREMENTAL_MIN_LINES and INCREMENTAL_MAX_LINES
+// lines. A note's random choices are keyed by its own identity: the hash of
+// its line and how many lines with the same text come before it in its chunk,
+// not its line number. A note keeps its slides when other lines are edited,
+// inserted or removed, unless those lines have the same text and come before
+// it in the chunk, and a run from scratch gives the same output as an
+// incremental one. Since this keying differs from the line positions of
+// --seed (see seededRandom), incremental runs always use seed 0 and refuse a
+// seed of their own, so that equal seeds never mean different outputs.
+// <output>.chunks keeps,
+// for every chunk of the last run, its hashes, where its rows are in the output
+// and its statistics, with the size and time of the output and a hash of the
+// run's options; if any of these do not match, every chunk is transformed.
+const uint32_t INCREMENTAL_CHUNK_BITS = 8;   // About 256 lines per chunk
+const uint64_t INCREMENTAL_MIN_LINES = 32;
+const uint64_t INCREMENTAL_MAX_LINES = 4096;
+const char INCREMENTAL_MAGIC[4] = {'S', 'I', 'N', 'C'};
+const uint32_t INCREMENTAL_VERSION = 2;
+
+struct IncrementalHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t optionsHash;
+    uint64_t outputSize;     // Stamp of the output the chunks describe
+    int64_t outputTime;
+    uint64_t chunkCount;
+};
+
+// Followed in the file by the chunk's statistics record
+struct IncrementalChunkEntry {
+    uint64_t identity;       // Hash of the chunk's bytes
+    uint64_t check;          // Second hash of the bytes, which must match as well
+    uint64_t outputBegin;    // The chunk's rows in the output
+    uint64_t outputBytes;
+};
+
+struct IncrementalChunk {
+    IncrementalChunkEntry entry;
+    StatsRecord stats;
+};
+
+std::string incrementalStatePath(const std::string& outputPath) {
+    return outputPath + ".chunks";
+}
+
+// Cut text into content-defined chunks of whole lines, as [begin, end) byte ranges
+std::vector<std::pair<size_t, size_t>> splitContentChunks(const char* data, size_t size) {
+    std::vector<std::pair<size_t, size_t>> chunks;
+    const uint64_t mask = (uint64_t(1) << INCREMENTAL_CHUNK_BITS) - 1;
+    size_t begin = 0;
+    uint64_t lines = 0;
+    uint64_t previous = 0;
+    forEachLineInRange(data, 0, size, [&](std::string_view line) {
+        const uint64_t hash = hashBytes(line.data(), line.size(), 0);
+        const uint64_t window = hash ^ (previous << 17 | previous >> 47);
+        previous = hash;
+        if ((++lines >= INCREMENTAL_MIN_LINES && (window & mask) == 0) || lines >= INCREMENTAL_MAX_LINES) {
+            const size_t end = std::min(size, static_cast<size_t>(line.data() - data) + line.size() + 1);
+            chunks.emplace_back(begin, end);
+            begin = end;
+            lines = 0;
+        }
+    });
+    if (begin < size) {
+        chunks.emplace_back(begin, size);
+    }
+    return chunks;
+}
+
+// Read the chunks of the previous run; false when there are none that can be used
+bool readIncrementalState(const std::string& outputFile, uint64_t optionsHash,
+                          std::unordered_map<uint64_t, IncrementalChunk>& chunks) {
+    std::ifstream file(incrementalStatePath(outputFile), std::ios::binary);
+    IncrementalHeader header;
+    uint64_t outputSize;
+    int64_t outputTime;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, INCREMENTAL_MAGIC, 4) != 0 || header.version != INCREMENTAL_VERSION ||
+        header.optionsHash != optionsHash || !noteIndexStamp(outputFile, outputSize, outputTime) ||
+        header.outputSize != outputSize || header.outputTime != outputTime) {
+        return false;
+    }
+    std::string body, error;
+    for (uint64_t i = 0; i < header.chunkCount; ++i) {
+        IncrementalChunk chunk;
+        if (!file.read(reinterpret_cast<char*>(&chunk.entry), sizeof(chunk.entry)) ||
+            !readStatsRecord(file, chunk.stats, body, error) ||
+            chunk.entry.outputBegin + chunk.entry.outputBytes > outputSize) {
+            chunks.clear();
+            return false;
+        }
+        chunks.emplace(chunk.entry.identity, std::move(chunk));
+    }
+    return true;
+}
+
+bool writeIncrementalState(const std::string& outputFile, uint64_t optionsHash,
+                           const std::vector<IncrementalChunk>& chunks) {
+    IncrementalHeader header = {};
+    std::memcpy(header.magic, INCREMENTAL_MAGIC, 4);
+    header.version = INCREMENTAL_VERSION;
+    header.optionsHash = optionsHash;
+    header.chunkCount = chunks.size();
+    if (!noteIndexStamp(outputFile, header.outputSize, header.outputTime)) {
+        return false;
+    }
+    std::ofstream file(incrementalStatePath(outputFile), std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const IncrementalChunk& chunk : chunks) {
+        file.write(reinterpret_cast<const char*>(&chunk.entry), sizeof(chunk.entry));
+        writeStatsRecord(file, chunk.stats);
+    }
+    file.close();
+    return static_cast<bool>(file);
+}
+
+// Transform a text file into text rows, reusing the rows of the chunks that are
+// unchanged since the last run of the same output, and export the MIDI file too
+// when midiOutputFile is not empty, re-encoding only the tracks that changed
+// (as --to-midi --midi-cache). Choices are keyed by note identity with seed 0.
+void processFileIncremental(const std::string& inputFile, const std::string& outputFile,
+                            const std::string& midiOutputFile, AppState& state) {
+    state.statusMessage.clear();
+    state.processingComplete = false;
+    if (state.seeded) {
+        state.statusMessage = "Error: incremental mode keys its random choices by note identity, not by line "
+                              "position, and cannot be combined with --seed";
+        return;
+    }
+    state.seeded = true;
+    state.seed = 0;
+    std::string options;
+    if (isStandardStream(inputFile) || isStandardStream(outputFile) || outputFile.empty() ||
+        isSnbPath(outputFile) || isMidiFile(inputFile) || isSnbFile(inputFile) || !state.selectedTracks.empty()) {
+        state.statusMessage = "Error: incremental mode needs a text input file, a text output file and all tracks";
+        return;
+    }
+    if (!describeRunOptions(state, outputFile, "", options)) {
+        state.statusMessage = "Error: unknown slide variant";
+        return;
+    }
+    options += "\nincremental " + std::to_string(INCREMENTAL_VERSION);
+    const uint64_t optionsHash = hashBytes(options.data(), options.size(), 0);
+
+    MappedFile input;
+    if (!input.open(inputFile)) {
+        state.statusMessage = "Error opening files.";
+        return;
+    }
+    std::unordered_map<uint64_t, IncrementalChunk> previous;
+    MappedFile previousOutput;
+    if (!readIncrementalState(outputFile, optionsHash, previous) || !previousOutput.open(outputFile)) {
+        previous.clear();
+    }
+
+    const std::string temporaryFile = outputFile + ".tmp";
+    std::ofstream output(temporaryFile);
+    if (!output.is_open()) {
+        state.statusMessage = "Error opening files.";
+        return;
+    }
+    writeTextHeader(output);
+    uint64_t written = static_cast<uint64_t>(output.tellp());
+
+    // Rows reused from the previous output are copied in runs of adjacent chunks
+    uint64_t copyBegin = 0;
+    uint64_t copyEnd = 0;
+    auto flushCopy = [&] {
+        output.write(previousOutput.data + copyBegin, static_cast<std::streamsize>(copyEnd - copyBegin));
+        copyBegin = copyEnd = 0;
+    };
+
+    std::vector<IncrementalChunk> chunks;
+    uint64_t transformedChunks = 0;
+    uint64_t transformedLines = 0;
+    std::string line;
+    std::ostringstream rows;
+    std::unordered_map<uint64_t, uint64_t> occurrences; // Earlier lines of the chunk with the same text
+    try {
+        for (const auto& [begin, end] : splitContentChunks(input.data, input.size)) {
+            IncrementalChunk chunk;
+            chunk.entry.identity = hashBytes(input.data + begin, end - begin, 0);
+            chunk.entry.check = hashBytes(input.data + begin, end - begin, optionsHash);
+            chunk.entry.outputBegin = written;
+            auto found = previous.find(chunk.entry.identity);
+            if (found != previous.end() && found->second.entry.check == chunk.entry.check) {
+                const IncrementalChunkEntry& reused = found->second.entry;
+                if (copyEnd != reused.outputBegin) {
+                    flushCopy();
+                    copyBegin = reused.outputBegin;
+                }
+                copyEnd = reused.outputBegin + reused.outputBytes;
+                chunk.entry.outputBytes = reused.outputBytes;
+                chunk.stats = found->second.stats;
+            } else {
+                flushCopy();
+                rows.str("");
+                TextOutputSink sink(rows, false);
+                resetStatistics(state);
+                const size_t errors = state.statusMessage.size();
+                uint64_t index = 0;
+                occurrences.clear();
+                forEachLineInRange(input.data, begin, end, [&](std::string_view text) {
+                    const uint64_t hash = hashBytes(text.data(), text.size(), 0);
+                    state.notePosition = hash ^ (occurrences[hash]++ * 0xC2B2AE3D27D4EB4FULL);
+                    index++;
+                    line.assign(text);
+                    transformLine(line, state, sink);
+                });
+                const std::string text = rows.str();
+                output.write(text.data(), static_cast<std::streamsize>(text.size()));
+                chunk.entry.outputBytes = text.size();
+                chunk.stats = statsOf(state);
+                // A chunk with notes that failed is transformed again next time, so its errors are reported again
+                chunk.entry.check ^= state.statusMessage.size() != errors ? ~uint64_t(0) : 0;
+                transformedChunks++;
+                transformedLines += index;
+            }
+            written += chunk.entry.outputBytes;
+            chunks.push_back(std::move(chunk));
+        }
+        flushCopy();
+        throwIfCancelled(state);
+    } catch (const JobCancelled& cancelled) {
+        output.close();
+        std::remove(temporaryFile.c_str());
+        reportCancelled(state, cancelled);
+        return;
+    }
+
+    output.close();
+    previousOutput.close();
+    std::error_code renameError;
+    if (output) {
+        std::filesystem::rename(temporaryFile, outputFile, renameError);
+    }
+    if (!output || renameError) {
+        std::remove(temporaryFile.c_str());
+        state.statusMessage += "Error writing output: " + outputFile;
+        return;
+    }
+    if (!writeIncrementalState(outputFile, optionsHash, chunks)) {
+        appendStatus(state, "Error writing " + incrementalStatePath(outputFile) + "\n");
+    }
+
+    resetStatistics(state);
+    for (const IncrementalChunk& chunk : chunks) {
+        addStats(state, chunk.stats);
+    }
+    updateResultSummary(state, outputFile);
+    state.statusMessage += "Processing complete!\nIncremental: " + std::to_string(transformedChunks) + " of " +
+                           std::to_string(chunks.size()) + " chunks transformed (" +
+                           std::to_string(transformedLines) + " lines), the rest reused";
+    state.processingComplete = true;
+
+    if (!midiOutputFile.empty()) {
+        state.statusMessage += "\n";
+        const bool midiTrackCache = state.midiTrackCache;
+        state.midiTrackCache = true;
+        convertToMidi(outputFile, midiOutputFile, state);
+        state.midiTrackCache = midiTrackCache;
+        state.processingComplete = state.statusMessage.find("MIDI file created successfully") != std::string::npos;
+    }
+}
+
+#ifdef PLATFORM_LINUX
+// Server mode: one process keeps the variant pools and label tables of earlier
+// jobs and runs jobs sent over a Unix domain socket. Every message is a frame: a
+// 4-byte little-endian payload length, then the payload. A request is a JSON
+// object of the manifest form ({"input": ..., "output": ..., "midi": ...}) or
+// {"command": "ping" | "stats" | "shutdown"}; the reply is one frame holding
+// the job's JSON result line without its newline. A connection may send any
+// number of requests, and connections are served in parallel.
+//
+// A request may also pass its input and outputs as open file descriptors,
+// usually memfds, attached to the frame with SCM_RIGHTS. "input_fd",
+// "output_fd" and "midi_fd" then give the positions of the input, text output
+// and MIDI output among the attached descriptors, and the reply adds the
+// sizes of the outputs as "output_bytes" and "midi_bytes".
+//
+// Jobs wait for a worker in a priority queue: a request may give "priority"
+// ("interactive", "normal" or "bulk"), "deadline_ms" counted from its arrival,
+// and an "id" under which another connection can stop it with
+// {"command": "cancel", "id": ...}. The "stats" reply adds the queue wait and
+// service time histograms of each priority class.
+const uint32_t SERVER_MAX_FRAME = 16 << 20;
+const size_t SERVER_MAX_DESCRIPTORS = 3;
+
+// Read exactly size bytes from a socket; false at end of stream or on error.
+// Descriptors that come with the bytes are added to descriptors.
+bool readSocketBytes(int socket, char* data, size_t size, std::vector<int>& descriptors) {
+    while (size > 0) {
+        iovec part{data, size};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * SERVER_MAX_DESCRIPTORS)];
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t count = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+                const size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < received; ++i) {
+                    int descriptor;
+                    std::memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                    descriptors.push_back(descriptor);
+                }
+            }
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+bool writeSocketBytes(int socket, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t count = ::send(socket, data, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+bool readFrame(int socket, std::string& payload, std::vector<int>& descriptors) {
+    unsigned char header[4];
+    if (!readSocketBytes(socket, reinterpret_cast<char*>(header), sizeof(header), descriptors)) {
+        return false;
+    }
+    uint32_t size = header[0] | header[1] << 8 | header[2] << 16 | static_cast<uint32_t>(header[3]) << 24;
+    if (size > SERVER_MAX_FRAME) {
+        return false;
+    }
+    payload.resize(size);
+    return readSocketBytes(socket, payload.data(), size, descriptors);
+}
+
+// Text written straight into the pages of a shared file such as a memfd. The
+// file and its mapping grow as rows are added; finish() cuts the file to the
+// bytes written.
+struct MappedOutputBuffer : std::streambuf {
+    int fd;
+    char* base = nullptr;
+    size_t capacity = 0;
+    bool failed = false;
+
+    explicit MappedOutputBuffer(int descriptor) : fd(descriptor) {}
+
+    ~MappedOutputBuffer() override {
+        if (base) {
+            ::munmap(base, capacity);
+        }
+    }
+
+    size_t written() const {
+        return base ? static_cast<size_t>(pptr() - base) : 0;
+    }
+
+    bool grow(size_t needed) {
+        const size_t used = written();
+        const size_t size = std::max({capacity * 2, needed, static_cast<size_t>(1) << 20});
+        void* mapping = MAP_FAILED;
+        if (::ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            mapping = base ? ::mremap(base, capacity, size, MREMAP_MAYMOVE)
+                           : ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (mapping == MAP_FAILED) {
+            failed = true;
+            return false;
+        }
+        base = static_cast<char*>(mapping);
+        capacity = size;
+        setp(base, base + capacity);
+        for (size_t skip = used; skip > 0;) {
+            int step = static_cast<int>(std::min<size_t>(skip, INT_MAX));
+            pbump(step);
+            skip -= static_cast<size_t>(step);
+        }
+        return true;
+    }
+
+    int overflow(int ch) override {
+        if (ch == traits_type::eof()) {
+            return traits_type::not_eof(ch);
+        }
+        if (!grow(written() + 1)) {
+            return traits_type::eof();
+        }
+        *pptr() = static_cast<char>(ch);
+        pbump(1);
+        return ch;
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize count) override {
+        if (epptr() - pptr() < count && !grow(written() + static_cast<size_t>(count))) {
+            return 0;
+        }
+        std::memcpy(pptr(), data, static_cast<size_t>(count));
+        for (std::streamsize skip = count; skip > 0;) {
+            int step = static_cast<int>(std::min<std::streamsize>(skip, INT_MAX));
+            pbump(step);
+            skip -= step;
+        }
+        return count;
+    }
+
+    bool finish(size_t& size) {
+        size = written();
+        if (base) {
+            ::munmap(base, capacity);
+            base = nullptr;
+            setp(nullptr, nullptr);
+        }
+        return !failed && ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+    }
+};
+
+// Run a job whose input and outputs are open descriptors (-1 for an output not
+// wanted). The input is mapped and transformed in place, a text input line by
+// line and a MIDI input as a whole; the text rows go straight into the pages
+// of the text output, and the MIDI file is written into its descriptor.
+BatchJobResult runDescriptorJob(const ManifestJob& job, int input, int textOutput, int midiOutput,
+                                const AppState& options, uint64_t& textBytes, uint64_t& midiBytes) {
+    auto started = std::chrono::steady_clock::now();
+    BatchJobResult result;
+    if (!job.error.empty()) {
+        result.message = job.error;
+        return result;
+    }
+    AppState state = manifestJobOptions(job, options);
+    state.statusMessage.clear();
+    state.processingComplete = false;
+    state.workerThreads = 1; // The server's queue runs its jobs in parallel
+
+    MappedFile mapped;
+    if (!mapped.openDescriptor(input)) {
+        result.message = "Error mapping input descriptor: " + std::string(std::strerror(errno));
+        return result;
+    }
+    MappedOutputBuffer textBuffer(textOutput);
+    std::ostream text(&textBuffer);
+    std::unique_ptr<TextOutputSink> textSink;
+    std::unique_ptr<MidiEventSink> midiSink;
+    std::unique_ptr<TeeSink> both;
+    if (textOutput >= 0) {
+        textSink = std::make_unique<TextOutputSink>(text);
+    }
+    if (midiOutput >= 0) {
+        midiSink = std::make_unique<MidiEventSink>(state);
+    }
+    if (textSink && midiSink) {
+        both = std::make_unique<TeeSink>(*textSink, *midiSink);
+    }
+    TransformSink& sink = both ? static_cast<TransformSink&>(*both)
+                        : textSink ? static_cast<TransformSink&>(*textSink) : *midiSink;
+
+    try {
+        throwIfCancelled(state);
+        if (mapped.size >= 4 && std::memcmp(mapped.data, "MThd", 4) == 0) {
+            if (!transformMidiData(mapped.data, mapped.size, job.input, state, sink)) {
+                result.message = state.statusMessage + "Error reading MIDI input";
+                return result;
+            }
+        } else {
+            resetStatistics(state);
+            std::string line;
+            forEachLineInRange(mapped.data, 0, mapped.size, [&](std::string_view row) {
+                line.assign(row);
+                transformLine(line, state, sink);
+            });
+        }
+        throwIfCancelled(state);
+    } catch (const JobCancelled& cancelled) {
+        reportCancelled(state, cancelled);
+        if (textOutput >= 0 && ::ftruncate(textOutput, 0) != 0) {
+            appendStatus(state, "Error clearing output descriptor: " + std::string(std::strerror(errno)) + "\n");
+        }
+        result.message = state.statusMessage;
+        result.cancelled = true;
+        result.stats = statsOf(state);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return result;
+    }
+
+    size_t size = 0;
+    result.ok = !textSink || (textBuffer.finish(size) && text);
+    state.statusMessage += result.ok ? "Processing complete!" : "Error writing output descriptor";
+    textBytes = size;
+    if (midiSink) {
+        state.statusMessage += "\n";
+        // The descriptor is reopened through /proc so every MIDI writer can use it
+        const std::string path = "/proc/self/fd/" + std::to_string(midiOutput);
+        writeMidiFile(midiSink->notes, path, state);
+        result.ok = result.ok && state.statusMessage.find("MIDI file created successfully") != std::string::npos;
+        size_t named = state.statusMessage.find(path);
+        if (named != std::string::npos) {
+            state.statusMessage.replace(named, path.size(), job.midi);
+        }
+        struct stat written;
+        midiBytes = ::fstat(midiOutput, &written) == 0 ? static_cast<uint64_t>(written.st_size) : 0;
+    }
+    result.message = state.statusMessage;
+    result.stats = statsOf(state);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+bool writeFrame(int socket, std::string_view payload) {
+    const uint32_t size = static_cast<uint32_t>(payload.size());
+    std::string frame(4 + payload.size(), '\0');
+    for (int byte = 0; byte < 4; ++byte) {
+        frame[byte] = static_cast<char>(size >> (8 * byte));
+    }
+    std::memcpy(frame.data() + 4, payload.data(), payload.size());
+    return writeSocketBytes(socket, frame.data(), frame.size());
+}
+
+// What a server shares between its connections
+struct JobServer {
+    int listener = -1;
+    const AppState* options = nullptr;
+    JobCatalog catalog;
+    std::unique_ptr<PriorityJobQueue> queue;
+    std::mutex lock;                  // Guards everything below
+    std::condition_variable closed;
+    std::set<int> connections;
+    std::map<std::string, std::shared_ptr<CancellationToken>> running; // Queued and running jobs by id
+    bool stopping = false;
+    StatsRecord stats;
+    uint64_t jobs = 0;
+    uint64_t failed = 0;
+    double busySeconds = 0;
+};
+
+// Stop accepting connections and end the open ones after their current request
+void stopJobServer(JobServer& server) {
+    std::lock_guard<std::mutex> lock(server.lock);
+    server.stopping = true;
+    ::shutdown(server.listener, SHUT_RDWR);
+    for (int connection : server.connections) {
+        ::shutdown(connection, SHUT_RD);
+    }
+}
+
+// Run a job through the server's queue and wait for its outcome. A job is
+// listed under its id while it is queued or running, so that it can be cancelled.
+BatchJobResult runServerJob(JobServer& server, ManifestJob& job, const std::function<BatchJobResult()>& run,
+                            double& waitSeconds) {
+    waitSeconds = 0;
+    if (job.error.empty() && !job.id.empty()) {
+        std::lock_guard<std::mutex> lock(server.lock);
+        if (!server.running.emplace(job.id, job.token).second) {
+            job.error = "Job id already in use: " + job.id;
+        }
+    }
+    BatchJobResult outcome;
+    if (!job.error.empty()) {
+        outcome.message = job.error;
+    } else {
+        setJobDeadline(job, std::chrono::steady_clock::now());
+        auto done = std::make_shared<std::promise<BatchJobResult>>();
+        std::future<BatchJobResult> result = done->get_future();
+        server.queue->submit(job.priority, job.token, [&, done](double wait, const char* dropped) {
+            BatchJobResult outcome;
+            if (dropped) {
+                outcome.cancelled = true;
+                outcome.message = std::string("Cancelled: ") + dropped + " before starting";
+            } else {
+                outcome = run();
+            }
+            waitSeconds = wait;
+            const bool cancelled = outcome.cancelled;
+            done->set_value(std::move(outcome));
+            return cancelled;
+        });
+        outcome = result.get();
+        if (!job.id.empty()) {
+            std::lock_guard<std::mutex> lock(server.lock);
+            server.running.erase(job.id);
+        }
+    }
+    std::lock_guard<std::mutex> lock(server.lock);
+    server.stats.merge(outcome.stats);
+    server.jobs++;
+    server.failed += outcome.ok ? 0 : 1;
+    server.busySeconds += outcome.seconds;
+    return outcome;
+}
+
+// Run a request that passed its input and outputs as descriptors
+std::string serveDescriptorRequest(JobServer& server, std::map<std::string, std::string>& fields,
+                                   const std::vector<int>& descriptors, size_t number) {
+    ManifestJob job;
+    job.percentage = server.options->transformationPercentage;
+    // The descriptors stand in for the paths, named by their field in messages
+    int chosen[3] = {-1, -1, -1};
+    const char* const keys[3] = {"input", "output", "midi"};
+    std::string error;
+    for (int i = 0; i < 3; ++i) {
+        const std::string key = std::string(keys[i]) + "_fd";
+        if (fields.count(key) == 0) {
+            fields[keys[i]].clear();
+            continue;
+        }
+        char* end = nullptr;
+        unsigned long index = std::strtoul(fields[key].c_str(), &end, 10);
+        if (fields[key].empty() || *end != '\0' || index >= descriptors.size()) {
+            error = !error.empty() ? error : "Invalid " + key + ": " + std::to_string(descriptors.size()) + " descriptor(s) attached";
+            continue;
+        }
+        chosen[i] = descriptors[index];
+        if (fields[keys[i]].empty()) {
+            fields[keys[i]] = key;
+        }
+    }
+    readManifestJob(fields, job);
+    job.line = number;
+    if (!error.empty()) {
+        job.error = error;
+    }
+    resolveJobResources(job, server.catalog);
+
+    uint64_t textBytes = 0;
+    uint64_t midiBytes = 0;
+    double waitSeconds = 0;
+    BatchJobResult outcome = runServerJob(server, job, [&] {
+        return runDescriptorJob(job, chosen[0], chosen[1], chosen[2], *server.options, textBytes, midiBytes);
+    }, waitSeconds);
+    std::string text = manifestResultJson(job, outcome, waitSeconds);
+    text.erase(text.size() - 2);
+    return text + ",\"output_bytes\":" + std::to_string(textBytes) + ",\"midi_bytes\":" +
+           std::to_string(midiBytes) + "}";
+}
+
+// Answer one request frame
+std::string serveRequest(JobServer& server, const std::string& request, const std::vector<int>& descriptors,
+                         size_t number) {
+    ManifestJob job;
+    job.percentage = server.options->transformationPercentage;
+    std::map<std::string, std::string> fields;
+    std::string error;
+    if (parseJsonObjectLine(request, fields, error) && fields.count("input_fd") != 0) {
+        return serveDescriptorRequest(server, fields, descriptors, number);
+    }
+    if (error.empty() && !fields["command"].empty()) {
+        const std::string& command = fields["command"];
+        std::stringstream reply;
+        if (command == "ping") {
+            reply << "{\"status\":\"ok\",\"command\":\"ping\"}";
+        } else if (command == "stats") {
+            std::lock_guard<std::mutex> lock(server.lock);
+            reply << std::fixed << std::setprecision(3);
+            reply << "{\"status\":\"ok\",\"command\":\"stats\",\"jobs\":" << server.jobs << ",\"failed\":"
+                  << server.failed << ",\"busy_seconds\":" << server.busySeconds << ",\"latency\":";
+            writeQueueLatencyJson(reply, *server.queue);
+            reply << ",\"stats\":";
+            writeStatsJson(reply, server.stats);
+        } else if (command == "cancel") {
+            std::lock_guard<std::mutex> lock(server.lock);
+            auto found = server.running.find(fields["id"]);
+            if (found != server.running.end()) {
+                found->second->cancel();
+            }
+            reply << "{\"status\":" << (found != server.running.end() ? "\"ok\"" : "\"failed\"")
+                  << ",\"command\":\"cancel\",\"id\":" << jsonQuote(fields["id"]);
+            if (found == server.running.end()) {
+                reply << ",\"message\":\"No queued or running job with this id\"";
+            }
+            reply << "}";
+        } else if (command == "shutdown") {
+            stopJobServer(server);
+            reply << "{\"status\":\"ok\",\"command\":\"shutdown\"}";
+        } else {
+            reply << "{\"status\":\"failed\",\"command\":" << jsonQuote(command)
+                  << ",\"message\":\"Unknown command\"}";
+        }
+        std::string text = reply.str();
+        text.erase(text.find_last_not_of("\n") + 1);
+        return text;
+    }
+
+    if (!parseManifestLine(request, job)) {
+        job.error = "Empty request";
+    }
+    job.line = number;
+    if (job.error.empty() && (isStandardStream(job.input) || isStandardStream(job.output))) {
+        job.error = "The server has no stdin or stdout for jobs";
+    }
+    resolveJobResources(job, server.catalog);
+    double waitSeconds = 0;
+    BatchJobResult outcome = runServerJob(server, job, [&] { return runManifestJob(job, *server.options); },
+                                          waitSeconds);
+    std::string text = manifestResultJson(job, outcome, waitSeconds);
+    text.pop_back();
+    return text;
+}
+
+// Serve the requests of one connection until the client closes it
+void serveConnection(JobServer& server, int connection) {
+    std::string request;
+    std::vector<int> descriptors;
+    for (size_t number = 1; readFrame(connection, request, descriptors); ++number) {
+        std::string reply = serveRequest(server, request, descriptors, number);
+        for (int descriptor : descriptors) {
+            ::close(descriptor);
+        }
+        descriptors.clear();
+        if (!writeFrame(connection, reply)) {
+            break;
+        }
+    }
+    for (int descriptor : descriptors) {
+        ::close(descriptor);
+    }
+    std::lock_guard<std::mutex> lock(server.lock);
+    server.connections.erase(connection);
+    ::close(connection);
+    server.closed.notify_all();
+}
+
+// Run the server on socketPath until a shutdown request. A stale socket left by
+// a server that is gone is replaced; any other file at the path is an error. The
+// jobs run with the options of state on state.workerThreads workers; when the
+// server stops, state holds the statistics of all its jobs, and the latency
+// histograms of its queue are written to latencyFile unless it is empty.
+void runServer(const std::string& socketPath, AppState& state, const std::string& latencyFile) {
+    state.statusMessage.clear();
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+        state.statusMessage = "Error: socket path must be 1 to " + std::to_string(sizeof(address.sun_path) - 1) +
+                              " bytes long\n";
+        return;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+
+    struct stat existing;
+    if (::lstat(socketPath.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            state.statusMessage = "Error: " + socketPath + " exists and is not a socket\n";
+            return;
+        }
+        int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe >= 0 && ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        if (probe >= 0) {
+            ::close(probe);
+        }
+        if (live) {
+            state.statusMessage = "Error: a server is already running on " + socketPath + "\n";
+            return;
+        }
+        ::unlink(socketPath.c_str());
+    }
+
+    JobServer server;
+    server.options = &state;
+    server.queue = std::make_unique<PriorityJobQueue>(workerThreadCount(state, SIZE_MAX));
+    server.listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listener < 0 ||
+        ::bind(server.listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(server.listener, SOMAXCONN) != 0) {
+        state.statusMessage = "Error listening on " + socketPath + ": " + std::strerror(errno) + "\n";
+        if (server.listener >= 0) {
+            ::close(server.listener);
+        }
+        return;
+    }
+    std::cerr << "Serving on " << socketPath << std::endl;
+
+    auto started = std::chrono::steady_clock::now();
+    while (true) {
+        int connection = ::accept4(server.listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection < 0 && errno == EINTR) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(server.lock);
+        if (connection < 0 || server.stopping) {
+            if (connection >= 0) {
+                ::close(connection);
+            }
+            break;
+        }
+        server.connections.insert(connection);
+        std::thread(serveConnection, std::ref(server), connection).detach();
+    }
+    {
+        std::unique_lock<std::mutex> lock(server.lock);
+        server.stopping = true;
+        for (int connection : server.connections) {
+            ::shutdown(connection, SHUT_RD);
+        }
+        server.closed.wait(lock, [&] { return server.connections.empty(); });
+    }
+    ::close(server.listener);
+    ::unlink(socketPath.c_str());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    resetStatistics(state);
+    addStats(state, server.stats);
+    state.selectedVariants.clear();
+    for (const auto& [variant, count] : state.variantUsageCount) {
+        state.selectedVariants.push_back(variant);
+    }
+    updateResultSummary(state, std::to_string(server.jobs - server.failed) + " of " +
+                               std::to_string(server.jobs) + " jobs");
+    std::stringstream summary;
+    summary << std::fixed << std::setprecision(2);
+    summary << "Server: " << server.jobs << " jobs, " << server.failed << " failed, " << server.busySeconds
+            << " s busy in " << seconds << " s; " << server.catalog.variantPools.size()
+            << " variant selection(s) and " << server.catalog.labelTables.size() << " label table(s) resolved\n"
+            << describeQueueLatency(*server.queue);
+    state.resultSummary += summary.str();
+    state.processingComplete = true;
+    std::string error;
+    if (!latencyFile.empty() && !writeQueueLatencyFile(latencyFile, *server.queue, error)) {
+        state.statusMessage += error + "\n";
+        state.processingComplete = false;
+    }
+}
+#endif
@@ -3,10 +3,13 @@
 // for the Slides Transformation tool.
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <cstdint>
 
 // Platform detection
 #if defined(_WIN32) || defined(_WIN64)
@@ -28,6 +31,9 @@
 #endif
 
 // Forward declarations of functions from SlidesTransformation.cpp
+struct VariantPool;
+struct CancellationToken;
+
 struct AppState {
     std::string inputFile;
     std::string outputFile;
@@ -37,14 +43,53 @@ struct AppState {
     bool processingComplete = false;
     std::string statusMessage;
     std::string resultSummary;
-    int totalEligibleNotes = 0;
-    int transformedNotes = 0;
-    std::map<std::string, int> variantUsageCount;
+    uint64_t totalEligibleNotes = 0; // 64-bit: merged fleet and server totals pass 2^31
+    uint64_t transformedNotes = 0;
+    std::map<std::string, uint64_t> variantUsageCount;
+    std::map<std::string, std::pair<uint64_t, uint64_t>> labelCounts; // Notes and transformed notes per label
+    std::map<int, std::pair<uint64_t, uint64_t>> trackCounts;         // Notes and transformed notes per track
+    std::set<int> selectedTracks; // Empty means all tracks
+    bool useTrackIndex = false;   // Build and keep the sidecar index for track-filtered runs
+    int workerThreads = 0;        // Threads for parallel work, 0 = one per hardware thread
+    bool compactMidi = false;     // MIDI running status, note-off as note-on with velocity 0
+    int midiFormat = 1;           // 0 = all tracks merged into one, 1 = one MTrk per track
+    size_t midiMemoryBudget = 0;  // Bytes for MIDI export note buffers, 0 = unlimited
+    std::string spillDirectory;   // Where MIDI export spills notes, empty = system temp directory
+    std::string labelFile;        // Labels for MIDI input, one line per note; empty = meta events
+    bool midiTrackCache = false;  // Reuse unchanged tracks of the previous export of the same MIDI file
+    bool seeded = false;          // Draw random choices from seed and note position instead of rand()
+    uint64_t seed = 0;
+    uint64_t notePosition = 0;    // Input line (or MIDI note) being transformed, from 0
+    std::shared_ptr<const VariantPool> variantPool;                // Resolved selectedVariants, shared by jobs
+    std::shared_ptr<const std::vector<std::string>> labelTable;   // Preloaded labelFile lines, shared by jobs
+    std::shared_ptr<const CancellationToken> cancellation;         // Checked while transforming; may be empty
+    std::string resultCacheDirectory;   // Cache of seeded runs' outputs; empty for none
+    uint64_t resultCacheBudget = 1ULL << 30;
 };
 
 // Forward declarations of functions from SlidesTransformation.cpp
 void processFile(const std::string& inputFile, const std::string& outputFile, AppState& state);
 void convertToMidi(const std::string& inputFile, const std::string& outputFile, AppState& state);
+void verifyMidiFile(const std::string& sourceFile, const std::string& midiFile, AppState& state);
+void processFileToMidi(const std::string& inputFile, const std::string& textOutputFile,
+                       const std::string& midiOutputFile, AppState& state);
+void convertTextToSnb(const std::string& inputFile, const std::string& outputFile, AppState& state);
+void convertSnbToText(const std::string& inputFile, const std::string& outputFile, AppState& state);
+void indexNoteFile(const std::string& inputFile, AppState& state);
+bool expandBatchInputs(const std::string& spec, std::vector<std::string>& inputs, std::string& error);
+void runBatch(const std::vector<std::string>& inputs, const std::string& textTemplate,
+              const std::string& midiTemplate, AppState& state, int shard, int shardCount);
+void runManifest(const std::string& manifestPath, std::ostream& results, AppState& state,
+                 const std::string& latencyFile);
+#ifdef PLATFORM_LINUX
+void runServer(const std::string& socketPath, AppState& state, const std::string& latencyFile);
+#endif
+void processFileIncremental(const std::string& inputFile, const std::string& outputFile,
+                            const std::string& midiOutputFile, AppState& state);
+void processFileShard(const std::string& inputFile, const std::string& outputFile, int shard, int shardCount,
+                      AppState& state);
+bool writeStatsFile(const std::string& path, const AppState& state, std::string& error);
+void mergeStatsFiles(const std::vector<std::string>& inputs, const std::string& outputFile, AppState& state);
 
 // Constants
 const int WINDOW_WIDTH = 800;
@@ -62,6 +107,404 @@ const char* WINDOW_TITLE = "Slides Transformation Tool";
 #define BUTTON_COLOR 0x87CEFA    // Light blue
 #endif
 
+// Parse a track list such as "3" or "1,4-6"
+bool parseTrackList(const std::string& text, std::set<int>& tracks) {
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        try {
+            size_t dash = item.find('-', 1);
+            int first = std::stoi(item.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+            if (last < first) {
+                return false;
+            }
+            for (int track = first; track <= last; ++track) {
+                tracks.insert(track);
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return !tracks.empty();
+}
+
+// Parse a whole non-negative number no greater than max, such as a seed or a size in MiB
+bool parseUnsigned(const std::string& text, uint64_t max, uint64_t& value) {
+    if (text.empty() || text[0] < '0' || text[0] > '9') {
+        return false;  // stoull would accept a sign or leading spaces
+    }
+    try {
+        size_t used = 0;
+        unsigned long long number = std::stoull(text, &used);
+        if (used != text.size() || number > max) {
+            return false;
+        }
+        value = number;
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Write the --stats record of a run, if one was asked for
+bool writeRunStats(const std::string& statsFile, const AppState& state) {
+    std::string error;
+    if (!statsFile.empty() && !writeStatsFile(statsFile, state, error)) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Command-line mode shared by the Linux and generic entry points.
+// Options start with "--" and may appear anywhere; everything else is positional:
+//   <input_file> <output_file> [midi_output_file] [transformation_percentage] [variant]
+// With --no-text the text output is skipped and the positional form becomes
+//   <input_file> <midi_output_file> [transformation_percentage] [variant]
+// --to-snb and --to-text convert between the text and .snb forms: <input_file> <output_file>
+// --to-midi exports a processed file as it is, like "Generate MIDI": <processed_file> <midi_file>;
+// with --midi-cache unchanged tracks are copied from the previous export
+// --index builds or refreshes the sidecar track index of a note file: <file>
+// --verify checks a MIDI export note for note against its processed file: <processed_file> <midi_file>
+// --tracks <list> processes and exports only the listed tracks, e.g. "3" or "1,4-6";
+// --track-index keeps a sidecar index so repeat runs read only those tracks' bytes
+// The input file may be a standard MIDI file; --labels <file> then gives one label per note
+// --batch runs many inputs in one process: the input is a directory, a wildcard such as
+// scores/*.txt or @list, and the outputs are templates with {name}, {stem} or {index}
+// --manifest <file> runs the jobs listed in a JSON Lines or TSV file, printing a JSON
+// result line per job on stdout and the totals on stderr; jobs may have a priority class
+// and a deadline
+// --serve <socket> keeps running and takes manifest-style jobs over a Unix domain socket,
+// answering each with its JSON result line (see SlidesClient)
+// --latency <file> writes the queue wait and service time histograms of each priority
+// class of --manifest or --serve as JSON
+// --result-cache <dir> keeps the outputs of seeded runs and serves repeats of a run from
+// them; --result-cache-size <MiB> bounds the cache (1024 by default)
+// --incremental retransforms only the parts of a text input changed since the last run
+// to the same output, keeping <output>.chunks beside it; it keys the random choices by
+// note identity and cannot be combined with --seed
+// --seed <n> makes the random choices depend only on the seed and each note's position
+// --shard <i>/<n> runs part i of n: with --batch the listed files of that shard, otherwise
+// that shard's line range of a text file; the shard outputs joined make a single run's output
+// --stats <file> writes the run's statistics as a record that merges with others: binary,
+// or JSON for a .json name
+// --merge-stats merges statistics records into one: <output> <record files, dirs, patterns or @lists>...
+int runCommandLine(int argc, char* argv[]) {
+    std::vector<std::string> args;
+    bool writeText = true;
+    std::string conversion;
+    std::set<int> selectedTracks;
+    bool useTrackIndex = false;
+    int workerThreads = 0;
+    bool compactMidi = false;
+    int midiFormat = 1;
+    size_t midiMemoryBudget = 0;
+    std::string spillDirectory;
+    std::string labelFile;
+    bool midiTrackCache = false;
+    bool batch = false;
+    bool incremental = false;
+    std::string manifest;
+    std::string serveSocket;
+    bool seeded = false;
+    uint64_t seed = 0;
+    int shard = 0;
+    int shardCount = 0;
+    std::string statsFile;
+    std::string latencyFile;
+    std::string resultCacheDirectory;
+    uint64_t resultCacheBudget = 1ULL << 30;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-text") {
+            writeText = false;
+        } else if (arg == "--track-index") {
+            useTrackIndex = true;
+        } else if (arg == "--compact-midi") {
+            compactMidi = true;
+        } else if (arg == "--format0") {
+            midiFormat = 0;
+        } else if (arg == "--midi-cache") {
+            midiTrackCache = true;
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "--midi-memory" && i + 1 < argc) {
+            uint64_t mebibytes;
+            if (!parseUnsigned(argv[++i], SIZE_MAX >> 20, mebibytes)) {
+                std::cout << "Invalid MIDI memory budget: " << argv[i] << " (expected MiB)" << std::endl;
+                return 1;
+            }
+            midiMemoryBudget = static_cast<size_t>(mebibytes) << 20;
+        } else if (arg == "--spill-dir" && i + 1 < argc) {
+            spillDirectory = argv[++i];
+        } else if (arg == "--manifest" && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (arg == "--shard" && i + 1 < argc) {
+            char slash = 0;
+            std::istringstream spec(argv[++i]);
+            if (!(spec >> shard >> slash >> shardCount) || slash != '/' || shard < 1 || shard > shardCount) {
+                std::cout << "Invalid shard: " << argv[i] << " (expected i/n with 1 <= i <= n)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--stats" && i + 1 < argc) {
+            statsFile = argv[++i];
+        } else if (arg == "--latency" && i + 1 < argc) {
+            latencyFile = argv[++i];
+        } else if (arg == "--result-cache" && i + 1 < argc) {
+            resultCacheDirectory = argv[++i];
+        } else if (arg == "--result-cache-size" && i + 1 < argc) {
+            uint64_t mebibytes;
+            if (!parseUnsigned(argv[++i], UINT64_MAX >> 20, mebibytes)) {
+                std::cout << "Invalid result cache size: " << argv[i] << " (expected MiB)" << std::endl;
+                return 1;
+            }
+            resultCacheBudget = mebibytes << 20;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            if (!parseUnsigned(argv[++i], UINT64_MAX, seed)) {
+                std::cout << "Invalid seed: " << argv[i] << " (expected a number from 0 to " << UINT64_MAX << ")" << std::endl;
+                return 1;
+            }
+            seeded = true;
+        } else if (arg == "--labels" && i + 1 < argc) {
+            labelFile = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            uint64_t threads;
+            if (!parseUnsigned(argv[++i], INT32_MAX, threads)) {
+                std::cout << "Invalid thread count: " << argv[i] << " (expected a number, 0 for one per hardware thread)" << std::endl;
+                return 1;
+            }
+            workerThreads = static_cast<int>(threads);
+        } else if (arg == "--tracks" && i + 1 < argc) {
+            if (!parseTrackList(argv[++i], selectedTracks)) {
+                std::cout << "Invalid track list: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--to-snb" || arg == "--to-text" || arg == "--to-midi" || arg == "--index" ||
+                   arg == "--verify" || arg == "--merge-stats") {
+            conversion = arg;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    if (conversion == "--index") {
+        if (args.size() != 1) {
+            std::cout << "Usage: " << argv[0] << " --index <file>" << std::endl;
+            return 1;
+        }
+        AppState state;
+        indexNoteFile(args[0], state);
+        std::cout << state.resultSummary << state.statusMessage << std::endl;
+        return state.resultSummary.empty() ? 1 : 0;
+    }
+
+    if (conversion == "--merge-stats") {
+        if (args.size() < 2) {
+            std::cout << "Usage: " << argv[0] << " --merge-stats <output> <record_file|dir|pattern|@list|->..." << std::endl;
+            return 1;
+        }
+        std::vector<std::string> inputs;
+        for (size_t i = 1; i < args.size(); ++i) {
+            std::string error;
+            if (args[i] != "-" && !expandBatchInputs(args[i], inputs, error)) {
+                std::cout << error << std::endl;
+                return 1;
+            }
+            if (args[i] == "-") {
+                inputs.push_back(args[i]);
+            }
+        }
+        AppState state;
+        mergeStatsFiles(inputs, args[0], state);
+        std::cerr << state.resultSummary << state.statusMessage << std::flush;
+        return state.processingComplete ? 0 : 1;
+    }
+
+    if (conversion == "--verify") {
+        if (args.size() != 2) {
+            std::cout << "Usage: " << argv[0] << " --verify <processed_file> <midi_file>" << std::endl;
+            return 1;
+        }
+        AppState state;
+        state.selectedTracks = selectedTracks;
+        state.useTrackIndex = useTrackIndex;
+        state.midiMemoryBudget = midiMemoryBudget;
+        state.spillDirectory = spillDirectory;
+        verifyMidiFile(args[0], args[1], state);
+        std::cout << state.statusMessage << state.resultSummary << std::flush;
+        return state.resultSummary.empty() ? 1 : 0;
+    }
+
+    if (!manifest.empty()) {
+        AppState state;
+        state.selectedTracks = selectedTracks;
+        state.useTrackIndex = useTrackIndex;
+        state.workerThreads = workerThreads;
+        state.compactMidi = compactMidi;
+        state.midiFormat = midiFormat;
+        state.midiMemoryBudget = midiMemoryBudget;
+        state.spillDirectory = spillDirectory;
+        state.resultCacheDirectory = resultCacheDirectory;
+        state.resultCacheBudget = resultCacheBudget;
+        runManifest(manifest, std::cout, state, latencyFile);
+        std::cerr << state.resultSummary << state.statusMessage << std::flush;
+        return writeRunStats(statsFile, state) && state.processingComplete ? 0 : 1;
+    }
+
+    if (!serveSocket.empty()) {
+#ifdef PLATFORM_LINUX
+        AppState state;
+        state.selectedTracks = selectedTracks;
+        state.useTrackIndex = useTrackIndex;
+        state.workerThreads = workerThreads;
+        state.compactMidi = compactMidi;
+        state.midiFormat = midiFormat;
+        state.midiMemoryBudget = midiMemoryBudget;
+        state.spillDirectory = spillDirectory;
+        state.resultCacheDirectory = resultCacheDirectory;
+        state.resultCacheBudget = resultCacheBudget;
+        runServer(serveSocket, state, latencyFile);
+        std::cerr << state.resultSummary << state.statusMessage << std::flush;
+        return writeRunStats(statsFile, state) && state.processingComplete ? 0 : 1;
+#else
+        std::cout << "--serve needs Unix domain sockets" << std::endl;
+        return 1;
+#endif
+    }
+
+    if (!conversion.empty()) {
+        if (args.size() != 2) {
+            std::cout << "Usage: " << argv[0] << " " << conversion << " <input_file> <output_file>" << std::endl;
+            return 1;
+        }
+        AppState state;
+        if (conversion == "--to-snb") {
+            convertTextToSnb(args[0], args[1], state);
+        } else if (conversion == "--to-midi") {
+            state.selectedTracks = selectedTracks;
+            state.useTrackIndex = useTrackIndex;
+            state.workerThreads = workerThreads;
+            state.compactMidi = compactMidi;
+            state.midiFormat = midiFormat;
+            state.midiMemoryBudget = midiMemoryBudget;
+            state.spillDirectory = spillDirectory;
+            state.midiTrackCache = midiTrackCache;
+            convertToMidi(args[0], args[1], state);
+        } else {
+            convertSnbToText(args[0], args[1], state);
+        }
+        std::cout << state.statusMessage << std::endl;
+        return state.statusMessage.find("Error") == std::string::npos ? 0 : 1;
+    }
+
+    if (args.size() < 2) {
+        std::cout << "Usage: " << argv[0] << " <input_file> <output_file> [midi_output_file] [transformation_percentage] [variant]" << std::endl;
+        std::cout << "       " << argv[0] << " --no-text <input_file> <midi_output_file> [transformation_percentage] [variant]" << std::endl;
+        std::cout << "       " << argv[0] << " --to-snb|--to-text|--to-midi <input_file> <output_file>" << std::endl;
+        std::cout << "       " << argv[0] << " --index <file>" << std::endl;
+        std::cout << "       " << argv[0] << " --verify <processed_file> <midi_file>" << std::endl;
+        std::cout << "       " << argv[0] << " --batch <dir|pattern|@list> <output_template> [midi_template] [transformation_percentage] [variant]" << std::endl;
+        std::cout << "       " << argv[0] << " --manifest <jobs.jsonl|jobs.tsv>" << std::endl;
+        std::cout << "       " << argv[0] << " --serve <socket>" << std::endl;
+        std::cout << "       " << argv[0] << " --merge-stats <output> <record_file|dir|pattern|@list|->..." << std::endl;
+        std::cout << "Options: --tracks <list> (e.g. 3 or 1,4-6), --track-index, --threads <n>, --compact-midi, --format0," << std::endl;
+        std::cout << "         --midi-memory <MiB>, --spill-dir <dir>, --labels <file> (labels for MIDI input)," << std::endl;
+        std::cout << "         --midi-cache (with --to-midi), --seed <n>, --shard <i>/<n>, --stats <file>," << std::endl;
+        std::cout << "         --latency <file> (with --manifest or --serve), --result-cache <dir>," << std::endl;
+        std::cout << "         --result-cache-size <MiB>, --incremental" << std::endl;
+        std::cout << "Use - as input_file or output_file to stream through stdin/stdout" << std::endl;
+        std::cout << "Example: " << argv[0] << " input.txt output.txt output.mid 50 RANDOM" << std::endl;
+        return 1;
+    }
+
+    AppState state;
+    state.selectedTracks = selectedTracks;
+    state.useTrackIndex = useTrackIndex;
+    state.workerThreads = workerThreads;
+    state.compactMidi = compactMidi;
+    state.midiFormat = midiFormat;
+    state.midiMemoryBudget = midiMemoryBudget;
+    state.spillDirectory = spillDirectory;
+    state.labelFile = labelFile;
+    state.seeded = seeded;
+    state.seed = seed;
+    state.resultCacheDirectory = resultCacheDirectory;
+    state.resultCacheBudget = resultCacheBudget;
+    size_t next = 0;
+    state.inputFile = args[next++];
+    if (writeText) {
+        state.outputFile = args[next++];
+    }
+
+    if (next < args.size()) {
+        state.midiOutputFile = args[next++];
+    }
+
+    if (next < args.size()) {
+        state.transformationPercentage = std::stod(args[next++]);
+    }
+
+    if (next < args.size()) {
+        state.selectedVariants.push_back(args[next++]);
+    } else {
+        state.selectedVariants.push_back("RANDOM");
+    }
+
+    if (batch) {
+        std::vector<std::string> inputs;
+        std::string error;
+        if (!expandBatchInputs(state.inputFile, inputs, error)) {
+            std::cout << error << std::endl;
+            return 1;
+        }
+        runBatch(inputs, state.outputFile, state.midiOutputFile, state, shard, shardCount);
+        std::cout << state.resultSummary << state.statusMessage << std::flush;
+        return writeRunStats(statsFile, state) && state.processingComplete ? 0 : 1;
+    }
+
+    // With the text going to stdout ("-"), messages move to stderr to keep the stream clean
+    std::ostream& report = state.outputFile == "-" ? std::cerr : std::cout;
+
+    if (shardCount > 0) {
+        if (!state.midiOutputFile.empty()) {
+            std::cout << "A sharded file produces text only; join the shard outputs and export them with --to-midi" << std::endl;
+            return 1;
+        }
+        processFileShard(state.inputFile, state.outputFile, shard, shardCount, state);
+        report << state.resultSummary << state.statusMessage << std::endl;
+        return writeRunStats(statsFile, state) && state.processingComplete ? 0 : 1;
+    }
+
+    if (incremental) {
+        processFileIncremental(state.inputFile, state.outputFile, state.midiOutputFile, state);
+        report << state.statusMessage << std::endl;
+        return writeRunStats(statsFile, state) && state.processingComplete ? 0 : 1;
+    }
+
+    if (state.midiOutputFile.empty()) {
+        // Process the file
+        processFile(state.inputFile, state.outputFile, state);
+        report << state.statusMessage << std::endl;
+        return writeRunStats(statsFile, state) ? 0 : 1;
+    }
+
+    if (state.midiOutputFile == "-") {
+        std::cout << "MIDI output cannot be written to stdout" << std::endl;
+        return 1;
+    }
+
+    // Transform straight into the MIDI encoder; the text output is written in the same pass
+    processFileToMidi(state.inputFile, state.outputFile, state.midiOutputFile, state);
+    report << state.statusMessage << std::endl;
+
+    return writeRunStats(statsFile, state) ? 0 : 1;
+}
+
 #ifdef PLATFORM_WINDOWS
 // Windows GUI implementation
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
@@ -88,6 +531,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
     // Create application state
     AppState* state = new AppState();
+    state->midiTrackCache = true; // "Generate MIDI" is re-run after edits
 
     // Create window
     HWND hwnd = CreateWindowEx(
@@ -117,6 +561,45 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     return (int)msg.wParam;
 }
 
+// Read the percentage trackbar and variant combobox into the application state
+void readTransformSettings(HWND hwnd, AppState* state) {
+    // Get transformation percentage
+    HWND hTrackbar = GetDlgItem(hwnd, 4);
+    state->transformationPercentage = SendMessage(hTrackbar, TBM_GETPOS, 0, 0);
+
+    // Get variant selection
+    HWND hComboBox = GetDlgItem(hwnd, 5);
+    int selectedIndex = SendMessage(hComboBox, CB_GETCURSEL, 0, 0);
+    char variantText[100];
+    SendMessage(hComboBox, CB_GETLBTEXT, selectedIndex, (LPARAM)variantText);
+
+    // Clear previous variants
+    state->selectedVariants.clear();
+
+    // Set selected variant
+    if (selectedIndex == 0) {
+        state->selectedVariants.push_back("RANDOM");
+    } else if (selectedIndex == 1) {
+        state->selectedVariants.push_back("STTM2m");
+    } else if (selectedIndex == 2) {
+        state->selectedVariants.push_back("STTm2M");
+    } else if (selectedIndex == 3) {
+        state->selectedVariants.push_back("ISTTM2m");
+    } else if (selectedIndex == 4) {
+        state->selectedVariants.push_back("DSTTM2m");
+    } else if (selectedIndex == 5) {
+        state->selectedVariants.push_back("TTSM2m2M");
+    } else if (selectedIndex == 6) {
+        state->selectedVariants.push_back("TTSd1M2m2M");
+    } else if (selectedIndex == 7) {
+        state->selectedVariants.push_back("TTITM2M2M");
+    } else if (selectedIndex == 8) {
+        state->selectedVariants.push_back("ITTITM2M2M");
+    } else if (selectedIndex == 9) {
+        state->selectedVariants.push_back("ITTSM2M2m");
+    }
+}
+
 // Windows message handler
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     // Get the application state
@@ -248,6 +731,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
                     if (GetOpenFileName(&ofn)) {
                         state->inputFile = ofn.lpstrFile;
+                        state->processingComplete = false;
                         // Update status
                         HWND hStatus = GetDlgItem(hwnd, 8);
                         std::string status = "Input file selected: " + state->inputFile + "\r\n";
@@ -263,12 +747,13 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                     ofn.hwndOwner = hwnd;
                     ofn.lpstrFile = szFile;
                     ofn.nMaxFile = sizeof(szFile);
-                    ofn.lpstrFilter = "Text Files\0*.txt\0All Files\0*.*\0";
+                    ofn.lpstrFilter = "Text Files\0*.txt\0Binary Note Stream\0*.snb\0All Files\0*.*\0";
                     ofn.nFilterIndex = 1;
                     ofn.Flags = OFN_PATHMUSTEXIST;
 
                     if (GetSaveFileName(&ofn)) {
                         state->outputFile = ofn.lpstrFile;
+                        state->processingComplete = false;
                         // Update status
                         HWND hStatus = GetDlgItem(hwnd, 8);
                         std::string status = "Output file selected: " + state->outputFile + "\r\n";
@@ -304,41 +789,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                         break;
                     }
 
-                    // Get transformation percentage
-                    HWND hTrackbar = GetDlgItem(hwnd, 4);
-                    state->transformationPercentage = SendMessage(hTrackbar, TBM_GETPOS, 0, 0);
-
-                    // Get variant selection
-                    HWND hComboBox = GetDlgItem(hwnd, 5);
-                    int selectedIndex = SendMessage(hComboBox, CB_GETCURSEL, 0, 0);
-                    char variantText[100];
-                    SendMessage(hComboBox, CB_GETLBTEXT, selectedIndex, (LPARAM)variantText);
-                    
-                    // Clear previous variants
-                    state->selectedVariants.clear();
-                    
-                    // Set selected variant
-                    if (selectedIndex == 0) {
-                        state->selectedVariants.push_back("RANDOM");
-                    } else if (selectedIndex == 1) {
-                        state->selectedVariants.push_back("STTM2m");
-                    } else if (selectedIndex == 2) {
-                        state->selectedVariants.push_back("STTm2M");
-                    } else if (selectedIndex == 3) {
-                        state->selectedVariants.push_back("ISTTM2m");
-                    } else if (selectedIndex == 4) {
-                        state->selectedVariants.push_back("DSTTM2m");
-                    } else if (selectedIndex == 5) {
-                        state->selectedVariants.push_back("TTSM2m2M");
-                    } else if (selectedIndex == 6) {
-                        state->selectedVariants.push_back("TTSd1M2m2M");
-                    } else if (selectedIndex == 7) {
-                        state->selectedVariants.push_back("TTITM2M2M");
-                    } else if (selectedIndex == 8) {
-                        state->selectedVariants.push_back("ITTITM2M2M");
-                    } else if (selectedIndex == 9) {
-                        state->selectedVariants.push_back("ITTSM2M2m");
-                    }
+                    readTransformSettings(hwnd, state);
 
                     // Process the file
                     processFile(state->inputFile, state->outputFile, *state);
@@ -350,13 +801,21 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 }
 
                 case 7: { // Generate MIDI
-                    if (state->outputFile.empty() || state->midiOutputFile.empty()) {
-                        MessageBox(hwnd, "Please process a file and select MIDI output file.", "Error", MB_ICONERROR | MB_OK);
+                    if (state->midiOutputFile.empty() || (state->inputFile.empty() && !state->processingComplete)) {
+                        MessageBox(hwnd, "Please select an input file and a MIDI output file.", "Error", MB_ICONERROR | MB_OK);
                         break;
                     }
 
-                    // Convert to MIDI
-                    convertToMidi(state->outputFile, state->midiOutputFile, *state);
+                    if (state->processingComplete) {
+                        // Convert the processed text so the MIDI matches it
+                        convertToMidi(state->outputFile, state->midiOutputFile, *state);
+                    } else {
+                        // Single pass: transform straight into the MIDI encoder,
+                        // also writing the text output if one is selected
+                        readTransformSettings(hwnd, state);
+                        processFileToMidi(state->inputFile, state->outputFile, state->midiOutputFile, *state);
+                        SetWindowText(GetDlgItem(hwnd, 8), state->resultSummary.c_str());
+                    }
 
                     // Update status
                     HWND hStatus = GetDlgItem(hwnd, 8);
@@ -408,36 +867,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 int main(int argc, char* argv[]) {
     // Check if we're running in command-line mode
     if (argc >= 3) {
-        // Command-line mode
-        AppState state;
-        state.inputFile = argv[1];
-        state.outputFile = argv[2];
-        
-        if (argc > 3) {
-            state.midiOutputFile = argv[3];
-        }
-        
-        if (argc > 4) {
-            state.transformationPercentage = std::stod(argv[4]);
-        }
-        
-        if (argc > 5) {
-            state.selectedVariants.push_back(argv[5]);
-        } else {
-            state.selectedVariants.push_back("RANDOM");
-        }
-        
-        // Process the file
-        processFile(state.inputFile, state.outputFile, state);
-        std::cout << state.statusMessage << std::endl;
-        
-        // Generate MIDI if output file is specified
-        if (!state.midiOutputFile.empty()) {
-            convertToMidi(state.outputFile, state.midiOutputFile, state);
-            std::cout << state.statusMessage << std::endl;
-        }
-        
-        return 0;
+        return runCommandLine(argc, argv);
     }
 
     // GUI mode
@@ -476,6 +906,7 @@ int main(int argc, char* argv[]) {
     
     // Create application state
     AppState state;
+    state.midiTrackCache = true; // "Generate MIDI" is re-run after edits
     
     // Event loop
     XEvent event;
@@ -586,6 +1017,7 @@ int main(int argc, char* argv[]) {
                 if (x >= 150 && x <= 300 && y >= 20 && y <= 50) {
                     // Open file dialog (simplified)
                     state.inputFile = "/tmp/input.txt";
+                    state.processingComplete = false;
                     state.statusMessage = "Input file selected: " + state.inputFile;
                     XClearArea(display, window, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, True);
                 }
@@ -594,6 +1026,7 @@ int main(int argc, char* argv[]) {
                 else if (x >= 150 && x <= 300 && y >= 60 && y <= 90) {
                     // Open file dialog (simplified)
                     state.outputFile = "/tmp/output.txt";
+                    state.processingComplete = false;
                     state.statusMessage = "Output file selected: " + state.outputFile;
                     XClearArea(display, window, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, True);
                 }
@@ -634,10 +1067,15 @@ int main(int argc, char* argv[]) {
                 
                 // Generate MIDI button
                 else if (x >= 180 && x <= 330 && y >= 300 && y <= 330) {
-                    if (state.outputFile.empty() || state.midiOutputFile.empty()) {
-                        state.statusMessage = "Error: Please process a file and select MIDI output file.";
-                    } else {
+                    if (state.midiOutputFile.empty() || (state.inputFile.empty() && !state.processingComplete)) {
+                        state.statusMessage = "Error: Please select an input file and a MIDI output file.";
+                    } else if (state.processingComplete) {
+                        // Convert the processed text so the MIDI matches it
                         convertToMidi(state.outputFile, state.midiOutputFile, state);
+                    } else {
+                        // Single pass: transform straight into the MIDI encoder,
+                        // also writing the text output if one is selected
+                        processFileToMidi(state.inputFile, state.outputFile, state.midiOutputFile, state);
                     }
                     XClearArea(display, window, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, True);
                 }
@@ -666,40 +1104,6 @@ int main(int argc, char* argv[]) {
 // Standard entry point for command-line usage
 #if !defined(PLATFORM_WINDOWS) && !defined(PLATFORM_LINUX)
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cout << "Usage: " << argv[0] << " <input_file> <output_file> [midi_output_file] [transformation_percentage] [variant]" << std::endl;
-        std::cout << "Example: " << argv[0] << " input.txt output.txt output.mid 50 RANDOM" << std::endl;
-        return 1;
-    }
-
-    AppState state;
-    state.inputFile = argv[1];
-    state.outputFile = argv[2];
-    
-    if (argc > 3) {
-        state.midiOutputFile = argv[3];
-    }
-    
-    if (argc > 4) {
-        state.transformationPercentage = std::stod(argv[4]);
-    }
-    
-    if (argc > 5) {
-        state.selectedVariants.push_back(argv[5]);
-    } else {
-        state.selectedVariants.push_back("RANDOM");
-    }
-    
-    // Process the file
-    processFile(state.inputFile, state.outputFile, state);
-    std::cout << state.statusMessage << std::endl;
-    
-    // Generate MIDI if output file is specified
-    if (!state.midiOutputFile.empty()) {
-        convertToMidi(state.outputFile, state.midiOutputFile, state);
-        std::cout << state.statusMessage << std::endl;
-    }
-    
-    return 0;
+    return runCommandLine(argc, argv);
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,350 @@
+#!/usr/bin/env bash
+# Reproducible checks of the streaming memory bound and of the behaviour of each
+# feature, mostly by comparing paths that must give identical outputs (stdin and
+# files, shards and whole runs, indexed and scanned track selections, .snb and
+# text). Each check prints "ok" or "FAIL"; the script fails if any check does.
+#
+# Usage: tests/check_outputs.sh <SlidesTransformation binary> [work directory]
+# The server checks use SlidesClient from the binary's directory, or $CLIENT.
+# STREAM_MB sets the size of the generated stream (128 by default; 10240 for
+# the 10 GB run in the README) and STREAM_RSS_KB the peak RSS it may reach.
+set -eu
+
+BIN=$1
+CLIENT=${CLIENT:-$(dirname "$BIN")/SlidesClient}
+WORK=${2:-$(mktemp -d)}
+STREAM_MB=${STREAM_MB:-128}
+STREAM_RSS_KB=${STREAM_RSS_KB:-16384}
+VARIANT=TTSd1M2m2M
+mkdir -p "$WORK"
+cd "$WORK"
+
+failures=0
+pass() { echo "ok   $1"; }
+fail() { echo "FAIL $1"; failures=$((failures + 1)); }
+same() { if cmp -s "$2" "$3"; then pass "$1"; else fail "$1 ($2 differs from $3)"; fi; }
+check() { local name=$1; shift; if "$@" > /dev/null 2>&1; then pass "$name"; else fail "$name"; fi; }
+
+# Start "$BIN --serve server.sock" with the given options and wait for its socket
+startServer() {
+    rm -f server.sock
+    "$BIN" "$@" --serve server.sock > server.log 2>&1 &
+    serverPid=$!
+    for ((i = 0; i < 100; i++)); do
+        if [ -S server.sock ]; then break; fi
+        sleep 0.05
+    done
+}
+
+# A score of $1 note rows over 16 tracks, with eligible and other labels
+generate() {
+    awk -v rows="$1" 'BEGIN {
+        split("C C# D D# E F F# G G# A A# B", names, " ")
+        split("SAN RLN SMP I8 HT RN U2R XYZ CDB", labels, " ")
+        print "Track Note Duration Label"
+        for (i = 0; i < rows; i++) {
+            printf "%d %s%d %d %s\n", i % 16 + 1, names[i * 7 % 12 + 1], i % 5 + 2, (i % 4 + 1) * 256, labels[i % 9 + 1]
+        }
+    }'
+}
+
+# A format 1 MIDI file of $1 tracks with $2 notes each, a "SAN" text event before
+# every note, at 1024 ticks per quarter note
+byte() { local octal; printf -v octal '\\%03o' "$1"; printf "$octal"; }
+u32() { byte $(($1 >> 24 & 255)); byte $(($1 >> 16 & 255)); byte $(($1 >> 8 & 255)); byte $(($1 & 255)); }
+generateMidi() {
+    local track note pitch
+    printf 'MThd'; u32 6; byte 0; byte 1; byte 0; byte "$1"; byte 4; byte 0
+    for ((track = 1; track <= $1; track++)); do
+        printf 'MTrk'; u32 $(($2 * 16 + 4))
+        for ((note = 0; note < $2; note++)); do
+            pitch=$((48 + (note * 5 + track * 7) % 36))
+            byte 0; byte 255; byte 1; byte 3; printf 'SAN'
+            byte 0; byte 144; byte "$pitch"; byte 100
+            byte 136; byte 0; byte 128; byte "$pitch"; byte 64
+        done
+        byte 0; byte 255; byte 47; byte 0
+    done
+}
+
+generate 20000 > score.txt
+
+# 1. Streaming: peak RSS of a generated stream piped through "- -"
+generate 16384 | tail -n +2 > block.txt
+blockBytes=$(wc -c < block.txt)
+blocks=$(( (STREAM_MB * 1024 * 1024 + blockBytes - 1) / blockBytes ))
+{ head -n 1 score.txt; for ((i = 0; i < blocks; i++)); do cat block.txt; done; } |
+    "$BIN" - - "" 50 "$VARIANT" > /dev/null 2> stream.log &
+pid=$!
+peak=0
+while kill -0 "$pid" 2> /dev/null; do
+    hwm=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status" 2> /dev/null || true)
+    if [ -n "$hwm" ] && [ "$hwm" -gt "$peak" ]; then peak=$hwm; fi
+    sleep 0.05
+done
+if ! wait "$pid"; then
+    fail "stream of $STREAM_MB MiB (exit status)"
+elif [ "$peak" -eq 0 ]; then
+    echo "skip stream of $STREAM_MB MiB: no /proc to read the peak RSS from"
+elif [ "$peak" -le "$STREAM_RSS_KB" ]; then
+    pass "stream of $STREAM_MB MiB, peak RSS $peak kB"
+else
+    fail "stream of $STREAM_MB MiB, peak RSS $peak kB over $STREAM_RSS_KB kB"
+fi
+
+# 2. A seeded run gives the same text through stdin/stdout as through files
+"$BIN" --seed 5 score.txt full.txt full.mid 60 "$VARIANT" > run.log
+"$BIN" --seed 5 - - "" 60 "$VARIANT" < score.txt > piped.txt 2> /dev/null
+same "stdin/stdout equals file output" full.txt piped.txt
+
+# 3. The shards of a seeded run, joined in order, are the whole run
+: > shards.txt
+for shard in 1 2 3; do
+    "$BIN" --seed 5 --shard "$shard/3" score.txt "shard$shard.txt" "" 60 "$VARIANT" > /dev/null
+    cat "shard$shard.txt" >> shards.txt
+done
+same "shard union equals the whole run" full.txt shards.txt
+
+# 4. A seeded run over some tracks draws what the whole run draws for them
+"$BIN" --seed 5 --tracks 3 score.txt track3.txt "" 60 "$VARIANT" > /dev/null
+awk '$1 == 3' full.txt > expected3.txt
+awk '$1 == 3' track3.txt > actual3.txt
+same "--tracks 3 equals track 3 of the whole run" expected3.txt actual3.txt
+
+# 5. .snb output and conversions round-trip to the same text
+"$BIN" --seed 5 score.txt full.snb "" 60 "$VARIANT" > /dev/null
+"$BIN" --to-text full.snb fromsnb.txt > /dev/null
+same ".snb output converts back to the text output" full.txt fromsnb.txt
+"$BIN" --to-snb full.txt converted.snb > /dev/null
+"$BIN" --to-text converted.snb roundtrip.txt > /dev/null
+same "text to .snb to text round trip" full.txt roundtrip.txt
+"$BIN" --to-midi full.snb fromsnb.mid > /dev/null
+same ".snb MIDI export equals the direct export" full.mid fromsnb.mid
+
+# 6. The MIDI file holds the notes of the text output
+if "$BIN" --verify full.txt full.mid > verify.log; then
+    pass "MIDI export matches the text output"
+else
+    fail "MIDI export matches the text output (see $WORK/verify.log)"
+fi
+
+# 7. A result cache hit serves what the run produced
+rm -rf cache
+"$BIN" --seed 5 --result-cache cache score.txt miss.txt miss.mid 60 "$VARIANT" > miss.log
+"$BIN" --seed 5 --result-cache cache score.txt hit.txt hit.mid 60 "$VARIANT" > hit.log
+if grep -q "Result cache hit" hit.log; then pass "second cached run is a hit"; else fail "second cached run is a hit"; fi
+same "cache miss equals the uncached run" full.txt miss.txt
+same "cache hit equals the miss (text)" miss.txt hit.txt
+same "cache hit equals the miss (MIDI)" miss.mid hit.mid
+
+# 8. Incremental reprocessing of an edited score equals a fresh run
+rm -f incremental.txt incremental.txt.chunks fresh.txt fresh.txt.chunks
+"$BIN" --incremental score.txt incremental.txt "" 60 "$VARIANT" > /dev/null
+awk 'NR == 5000 { $3 = $3 * 2 } NR == 12000 { print "7 D4 512 RLN" } NR != 15000 { print }' score.txt > edited.txt
+"$BIN" --incremental edited.txt incremental.txt "" 60 "$VARIANT" > incremental.log
+"$BIN" --incremental edited.txt fresh.txt "" 60 "$VARIANT" > /dev/null
+same "incremental run equals a fresh run" fresh.txt incremental.txt
+if grep -q "the rest reused" incremental.log; then pass "incremental run reused chunks"; else fail "incremental run reused chunks"; fi
+
+# 9. --tracks keeps the same lines, malformed rows included, with or without an index
+awk 'NR % 500 == 0 { print "3 C4 abc SAN"; print "-3 C4 256 SAN" } { print }' score.txt > malformed.txt
+rm -f malformed.txt.idx
+"$BIN" --seed 5 --tracks 3 malformed.txt scanned.txt "" 60 "$VARIANT" > /dev/null
+"$BIN" --seed 5 --tracks 3 --track-index malformed.txt indexed.txt "" 60 "$VARIANT" > /dev/null
+same "--tracks output with an index equals the scan" scanned.txt indexed.txt
+if grep -q "^3 C4 abc SAN" indexed.txt; then pass "malformed rows of a selected track pass through"; else fail "malformed rows of a selected track pass through"; fi
+
+# 10. --tracks on stdin draws what the whole run draws for the selected track
+"$BIN" --seed 5 --tracks 3 - - "" 60 "$VARIANT" < score.txt 2> /dev/null | awk '$1 == 3' > piped3.txt
+same "--tracks 3 through stdin equals track 3 of the whole run" expected3.txt piped3.txt
+
+# 11. Running status and velocity-0 note-offs shrink the file and keep its notes
+"$BIN" --seed 5 --compact-midi score.txt compact.txt compact.mid 60 "$VARIANT" > /dev/null
+check "--compact-midi export passes --verify" "$BIN" --verify compact.txt compact.mid
+if [ "$(wc -c < compact.mid)" -lt "$(wc -c < full.mid)" ]; then
+    pass "--compact-midi export is smaller"
+else
+    fail "--compact-midi export is smaller"
+fi
+
+# 12. A MIDI export over its memory budget spills to track files and writes the same file
+{ cat score.txt; for i in 1 2 3 4 5 6 7; do tail -n +2 score.txt; done; } > score8.txt
+"$BIN" --seed 5 score8.txt "" unbounded.mid 60 "$VARIANT" > /dev/null
+rm -rf spill && mkdir spill
+"$BIN" --seed 5 --midi-memory 1 --spill-dir spill score8.txt "" spilled.mid 60 "$VARIANT" > spill.log
+if grep -q "notes spilled to" spill.log; then pass "--midi-memory 1 spills notes"; else fail "--midi-memory 1 spills notes"; fi
+same "spilled export equals the unbounded export" unbounded.mid spilled.mid
+if [ -z "$(ls spill)" ]; then pass "spill files are removed"; else fail "spill files are removed"; fi
+
+# 13. A format 0 export merges the tracks and keeps every note
+"$BIN" --seed 5 --format0 score.txt format0.txt format0.mid 60 "$VARIANT" > /dev/null
+if "$BIN" --verify format0.txt format0.mid | grep -q "(format 0)"; then
+    pass "--format0 export passes --verify"
+else
+    fail "--format0 export passes --verify"
+fi
+
+# 14. MIDI input: a seeded run over some tracks draws what the whole run draws
+generateMidi 3 400 > input.mid
+"$BIN" --seed 7 input.mid midiall.txt "" 50 "$VARIANT" > /dev/null
+"$BIN" --seed 7 --tracks 3 input.mid midi3.txt "" 50 "$VARIANT" > /dev/null
+awk '$1 == 3' midiall.txt > expectedmidi3.txt
+awk '$1 == 3' midi3.txt > actualmidi3.txt
+if [ "$(wc -l < expectedmidi3.txt)" -ge 400 ] && grep -q "$VARIANT" expectedmidi3.txt; then
+    pass "MIDI input is read with its text-event labels"
+else
+    fail "MIDI input is read with its text-event labels"
+fi
+same "MIDI input --tracks 3 equals track 3 of the whole run" expectedmidi3.txt actualmidi3.txt
+
+# 15. The MIDI track cache encodes only changed tracks and writes what a full export writes
+rm -f cached.mid cached.mid.tcache
+"$BIN" --to-midi --midi-cache full.txt cached.mid > /dev/null
+"$BIN" --to-midi --midi-cache full.txt cached.mid > cache1.log
+same "track-cached export equals the full export" full.mid cached.mid
+check "unchanged export reuses all 16 tracks" grep -q "16 of 16 tracks reused" cache1.log
+awk 'NR > 2 && $1 == 4 && !done { $3 = $3 * 2; done = 1 } { print }' full.txt > edited4.txt
+"$BIN" --to-midi edited4.txt uncached4.mid > /dev/null
+"$BIN" --to-midi --midi-cache edited4.txt cached.mid > cache2.log
+same "track-cached export after an edit equals the full export" uncached4.mid cached.mid
+check "an edit in one track re-encodes only that track" grep -q "15 of 16 tracks reused, 1 encoded" cache2.log
+
+# 16. Batch mode gives each file the outputs of a single run and sums their statistics
+rm -rf batchin batchout && mkdir batchin
+for part in 1 2 3 4 5; do
+    awk -v part="$part" 'NR == 1 || NR % 5 == part - 1' score.txt > "batchin/part$part.txt"
+done
+"$BIN" --batch --threads 3 --seed 5 --stats batch.json 'batchin/*.txt' 'batchout/{stem}.txt' 'batchout/{stem}.mid' \
+    60 "$VARIANT" > /dev/null
+eligible=0
+batchSame=1
+for part in 1 2 3 4 5; do
+    "$BIN" --seed 5 --stats single.json "batchin/part$part.txt" single.txt single.mid 60 "$VARIANT" > /dev/null
+    cmp -s single.txt "batchout/part$part.txt" && cmp -s single.mid "batchout/part$part.mid" || batchSame=0
+    eligible=$((eligible + $(grep -o '"eligible":[0-9]*' single.json | cut -d: -f2)))
+done
+if [ "$batchSame" -eq 1 ]; then pass "batch outputs equal single runs"; else fail "batch outputs equal single runs"; fi
+check "batch statistics sum the files" grep -q "\"eligible\":$eligible," batch.json
+
+# 17. Work stealing: a file over 32 MB is split into chunks that give the single-run outputs
+rm -rf stealin stealout && mkdir stealin
+{ cat score.txt; for ((i = 0; i < 130; i++)); do tail -n +2 score.txt; done; } > stealin/large.txt
+cp batchin/part1.txt batchin/part2.txt stealin/
+"$BIN" --batch --threads 4 --seed 5 'stealin/*.txt' 'stealout/{stem}.txt' 'stealout/{stem}.mid' 60 "$VARIANT" > steal.log
+"$BIN" --seed 5 stealin/large.txt large.txt large.mid 60 "$VARIANT" > /dev/null
+check "the large file is split into chunks" grep -q "1 files split into [2-9]" steal.log
+same "split batch text equals a single run" large.txt stealout/large.txt
+same "split batch MIDI equals a single run" large.mid stealout/large.mid
+if ls stealout | grep -q "\.part[0-9]"; then fail "chunk part files are removed"; else pass "chunk part files are removed"; fi
+
+# 18. Manifest jobs with their own parameters give the outputs of the same command lines
+rm -f manifest1.txt manifest1.mid manifest2.txt manifest3.txt
+cat > jobs.jsonl << 'JOBS'
+{"input": "batchin/part1.txt", "output": "manifest1.txt", "midi": "manifest1.mid", "pct": 30, "variants": ["TTSd1M2m2M"], "seed": 3}
+{"input": "batchin/part2.txt", "output": "manifest2.txt", "pct": 80, "variants": ["STTM2m"], "seed": 9}
+{"input": "batchin/part3.txt", "output": "manifest3.txt", "variants": ["NOVARIANT"], "seed": 1}
+JOBS
+if "$BIN" --threads 2 --manifest jobs.jsonl > manifest.out 2> /dev/null; then manifestStatus=0; else manifestStatus=1; fi
+"$BIN" --seed 3 batchin/part1.txt single.txt single.mid 30 TTSd1M2m2M > /dev/null
+same "manifest job 1 equals its command line (text)" single.txt manifest1.txt
+same "manifest job 1 equals its command line (MIDI)" single.mid manifest1.mid
+"$BIN" --seed 9 batchin/part2.txt single.txt "" 80 STTM2m > /dev/null
+same "manifest job 2 equals its command line" single.txt manifest2.txt
+if grep -q '"line":3,.*"status":"failed"' manifest.out && [ ! -e manifest3.txt ] && [ "$manifestStatus" -eq 1 ]; then
+    pass "a job with an unknown variant fails alone"
+else
+    fail "a job with an unknown variant fails alone"
+fi
+
+# 19. Malformed numeric options are reported with status 1 instead of aborting
+for option in "--seed x" "--seed -1" "--threads x" "--midi-memory -5" "--result-cache-size 1M"; do
+    # shellcheck disable=SC2086
+    if "$BIN" $option score.txt rejected.txt > option.log 2>&1; then status=0; else status=$?; fi
+    if [ "$status" -eq 1 ] && grep -q "^Invalid" option.log; then
+        pass "$option is rejected"
+    else
+        fail "$option is rejected (status $status)"
+    fi
+done
+
+# 20. Statistics records of the shards merge into the record of the whole run
+for shard in 1 2 3; do
+    "$BIN" --seed 5 --shard "$shard/3" --stats "shard$shard.sstat" score.txt "shard$shard.txt" "" 60 "$VARIANT" > /dev/null
+done
+"$BIN" --seed 5 --stats whole.json score.txt whole.txt "" 60 "$VARIANT" > /dev/null
+"$BIN" --merge-stats merged.json shard1.sstat shard2.sstat shard3.sstat 2> /dev/null
+cat shard3.sstat shard1.sstat shard2.sstat > concatenated.sstat
+"$BIN" --merge-stats concatenated.json concatenated.sstat 2> /dev/null
+sed 's/"runs":[0-9]*,//' whole.json > whole.counts
+sed 's/"runs":[0-9]*,//' merged.json > merged.counts
+same "merged shard statistics equal the whole run's" whole.counts merged.counts
+same "concatenated records merge the same in any order" merged.json concatenated.json
+check "merged record counts 3 runs" grep -q '"runs":3,' merged.json
+if [ "$(head -c 8 shard1.sstat | od -An -tx1 | tr -d ' \n')" = "5353545201000000" ]; then
+    pass "binary record starts with SSTR and little-endian version 1"
+else
+    fail "binary record starts with SSTR and little-endian version 1"
+fi
+
+# 21. Server mode: a job sent over the socket gives the outputs of the same manifest job
+if [ -x "$CLIENT" ]; then
+    startServer
+    check "server answers ping" grep -q '"status":"ok"' <("$CLIENT" server.sock ping)
+    rm -f served1.txt served1.mid
+    "$CLIENT" server.sock '{"input": "batchin/part1.txt", "output": "served1.txt", "midi": "served1.mid", "pct": 30, "variants": ["TTSd1M2m2M"], "seed": 3}' > served.out
+    check "server job succeeds" grep -q '"status":"ok"' served.out
+    same "server job equals the manifest job (text)" manifest1.txt served1.txt
+    same "server job equals the manifest job (MIDI)" manifest1.mid served1.mid
+    "$CLIENT" server.sock shutdown > /dev/null
+    wait "$serverPid" || true
+    if [ ! -e server.sock ]; then pass "server removes its socket on shutdown"; else fail "server removes its socket on shutdown"; fi
+else
+    echo "skip server checks: no SlidesClient at $CLIENT"
+fi
+
+# 22. Jobs over memfds give the outputs of the same jobs over paths, for text and MIDI input
+if [ -x "$CLIENT" ]; then
+    startServer
+    "$CLIENT" --memfd server.sock batchin/part1.txt memfd1.txt memfd1.mid \
+        '{"pct": 30, "variants": ["TTSd1M2m2M"], "seed": 3}' > memfd.out
+    check "memfd job succeeds" grep -q '"status":"ok"' memfd.out
+    same "memfd job equals the path job (text)" manifest1.txt memfd1.txt
+    same "memfd job equals the path job (MIDI)" manifest1.mid memfd1.mid
+    "$CLIENT" --memfd server.sock input.mid memfdmidi.txt "" "{\"pct\": 50, \"variants\": [\"$VARIANT\"], \"seed\": 7}" > /dev/null
+    same "memfd job with MIDI input equals the command line" midiall.txt memfdmidi.txt
+    "$CLIENT" server.sock shutdown > /dev/null
+    wait "$serverPid" || true
+fi
+
+# 23. A job past its deadline, or cancelled by id, reports "cancelled" and leaves no output
+rm -f deadline1.txt deadline2.txt
+cat > deadline.jsonl << 'JOBS'
+{"input": "batchin/part1.txt", "output": "deadline1.txt"}
+{"input": "stealin/large.txt", "output": "deadline2.txt", "deadline_ms": 20}
+JOBS
+"$BIN" --threads 1 --manifest deadline.jsonl > deadline.out 2> /dev/null || true
+check "a manifest job past its deadline is cancelled" grep -q '"line":2,.*"status":"cancelled"' deadline.out
+if [ -e deadline1.txt ] && [ ! -e deadline2.txt ]; then
+    pass "the cancelled job leaves no output, the other job finishes"
+else
+    fail "the cancelled job leaves no output, the other job finishes"
+fi
+if [ -x "$CLIENT" ]; then
+    startServer
+    rm -f cancelled.txt
+    "$CLIENT" server.sock '{"id": "large", "input": "stealin/large.txt", "output": "cancelled.txt"}' > cancelled.out &
+    clientPid=$!
+    sleep 0.5
+    "$CLIENT" server.sock '{"command": "cancel", "id": "large"}' > /dev/null
+    wait "$clientPid" || true
+    check "a running server job is cancelled by id" grep -q '"status":"cancelled"' cancelled.out
+    if [ ! -e cancelled.txt ]; then pass "the cancelled server job leaves no output"; else fail "the cancelled server job leaves no output"; fi
+    "$CLIENT" server.sock shutdown > /dev/null
+    wait "$serverPid" || true
+fi
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures check(s) failed; outputs are in $WORK"
+    exit 1
+fi
+echo "All checks passed"